@@ -2,21 +2,155 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
 #include "LibDisk.h"
+#include "LibSimd.h"
 
 typedef struct sector {
   char data[SECTOR_SIZE];
 } sector_t;
 
 // used to see what happened w/ disk ops
-int diskErrno; 
+__thread int diskErrno; 
 
 // the disk in memory (static makes it private to the file)
 static sector_t* disk;
 
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+// where the sectors live: normally the whole disk is in memory; a
+// mapped image is used in place, read-only (see Disk_Map) or writable
+// and shared with other processes (see Disk_MapShared); a mounted
+// archive is read-only and its sectors are decompressed on demand
+// (see Disk_MountArchive)
+typedef enum {
+  DISK_MEMORY,
+  DISK_MAPPED,
+  DISK_SHARED,
+  DISK_ARCHIVE,
+} disk_mode_t;
+static disk_mode_t mode = DISK_MEMORY;
+static int disk_fd = -1; // the mapped image file, kept open (see Disk_Fd)
+static int replayed;     // set once a log was applied to a mapped image
+
+// the mounted archive
+static const char* arch_map; // the archive file, mapped
+static size_t arch_len;
+static int* arch_pos;        // sector -> position in the archive index, or -1
+
+// sectors handed out by Disk_Pin(), and the copies made of them when
+// they're not in memory otherwise (i.e., from a mounted archive);
+// 'pinned' counts the pins of all sectors, and the disk isn't released
+// while it's not 0; 'pin_mutex' guards them all, as threads may pin
+// and unpin at the same time
+static pthread_mutex_t pin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned short pins[TOTAL_SECTORS];
+static char* pin_copy[TOTAL_SECTORS];
+static int pinned;
+
+// sectors written since the disk was loaded or saved, and sectors
+// whose latest content is in the log rather than the image (see
+// Disk_SaveLog)
+static unsigned char dirty[TOTAL_SECTORS];
+static unsigned char logged[TOTAL_SECTORS];
+static int dirty_count;  // the sectors set in dirty[]
+static long dirty_since; // when the first of them was written, in ms
+
+// the image file that the disk is the same as, but for the dirty and
+// logged sectors (see Disk_Commit), or "" if there's none
+static char base_file[1024];
+
+// the background flusher (see Disk_StartFlusher): 'dirty_mutex'
+// guards the dirty sectors while they're copied out, and is taken by
+// Disk_Write only while the flusher runs; 'flush_mutex' is held for
+// the whole of any write-back, so that they happen one at a time
+static pthread_mutex_t dirty_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int flushing;     // set while the flusher thread runs
+static int flusher_stop; // tells it to finish
+static int flush_ratio;  // percent of the disk dirty to start a flush
+static int flush_age;    // age in ms of the oldest change to start one
+static char flush_log[1024]; // where the sectors go
+static void (*flush_hold)(void);    // keep the disk from changing...
+static void (*flush_release)(void); // ...and let it change again
+
+// used for statistics (see Disk_GetStats); the counters are updated
+// atomically, as the threads of the task pool and of the FUSE daemon
+// read sectors at the same time
+static int lastSector = 0;
+static Disk_Stats_t stats;
+
+#define COUNT(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+
+// count an access to 'sector' in the statistics: any access that is
+// not to the sector last touched (by any thread) or the one right
+// after it is a seek
+static void profile(int sector)
+{
+  int last = __atomic_exchange_n(&lastSector, sector, __ATOMIC_RELAXED);
+  if(sector != last && sector != last+1) {
+    COUNT(seeks, 1);
+    COUNT(seek_distance, sector > last ? sector-last : last-sector);
+  }
+}
+
+// the time in milliseconds, from some fixed point
+static long now_ms()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000L + t.tv_nsec/1000000;
+}
+
+static void mark_dirty(int sector)
+{
+  if (dirty[sector]) return;
+  dirty[sector] = 1;
+  if (dirty_count++ == 0) dirty_since = now_ms();
+  if (flushing && flush_ratio > 0 && dirty_count*100 >= flush_ratio*TOTAL_SECTORS)
+    pthread_cond_signal(&flusher_wake);
+}
+
+static void clear_dirty()
+{
+  memset(dirty, 0, sizeof(dirty));
+  dirty_count = 0;
+}
+
+// drop whatever currently backs the disk (memory, a mapped image or
+// a mounted archive); return 0 if successful, -1 if a sector of it is
+// still pinned
+static int release_disk()
+{
+  pthread_mutex_lock(&pin_mutex);
+  int busy = pinned > 0;
+  pthread_mutex_unlock(&pin_mutex);
+  if (busy) {
+    diskErrno = E_DISK_BUSY;
+    return -1;
+  }
+  Disk_StopFlusher();
+  if(mode == DISK_MEMORY)
+    free(disk);
+  else if(mode == DISK_MAPPED || mode == DISK_SHARED) {
+    munmap(disk, TOTAL_SECTORS*sizeof(sector_t));
+    close(disk_fd);
+    disk_fd = -1;
+  } else {
+    munmap((void*)arch_map, arch_len);
+    free(arch_pos);
+  }
+  disk = NULL;
+  mode = DISK_MEMORY;
+  replayed = 0;
+  return 0;
+}
 
 /*
  * Disk_Init
@@ -28,12 +162,125 @@ static sector_t* disk;
  */
 int Disk_Init()
 {
+  if (release_disk() < 0) return -1;
+
   // create the disk image and fill every sector with zeroes
   disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
   if(disk == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  clear_dirty();
+  memset(logged, 0, sizeof(logged));
+  base_file[0] = '\0';
+  return 0;
+}
+
+// write 'len' bytes at offset 'off' of the file, retrying short writes
+static int write_at(int fd, const char* buf, size_t len, off_t off)
+{
+  while(len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if(n <= 0) return -1;
+    buf += n; len -= n; off += n;
+  }
+  return 0;
+}
+
+// write the in-memory disk to the new file 'file' and sync it
+static int save_image(char* file)
+{
+  int fd;
+
+  // open the diskFile
+  if ((fd = open(file, O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+    
+  // actually write the disk image to a file, one run at a time; the
+  // file is new, so the runs of zeroes are left as holes
+  int i = 0;
+  while (i < TOTAL_SECTORS) {
+    int zero = Simd_IsZero(disk + i, sizeof(sector_t));
+    int j = i + 1;
+    while (j < TOTAL_SECTORS && Simd_IsZero(disk + j, sizeof(sector_t)) == zero) j++;
+    if (!zero && write_at(fd, disk[i].data, (size_t)(j - i) * sizeof(sector_t),
+			  (off_t)i * sizeof(sector_t)) < 0) {
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    i = j;
+  }
+
+  // a trailing run of zeroes was skipped
+  if (ftruncate(fd, (off_t)TOTAL_SECTORS * sizeof(sector_t)) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+    
+  if (fsync(fd) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
+
+// sync the directory holding 'file', so that a rename in it lasts;
+// return 0 if successful, -1 otherwise
+static int sync_dir(char* file)
+{
+  char dir[1024];
+  const char* slash = strrchr(file, '/');
+  if (slash == NULL) strcpy(dir, ".");
+  else snprintf(dir, sizeof(dir), "%.*s", slash == file ? 1 : (int)(slash - file), file);
+  int fd = open(dir, O_RDONLY);
+  if (fd < 0) return -1;
+  int ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+// Disk_Save() of the in-memory disk, with the write-backs held off:
+// the image goes to '<file>.tmp', which then replaces 'file'; an
+// image mapped by another process (see map_image) isn't replaced, as
+// the mapping would go on showing the old file
+static int save_atomic(char* file)
+{
+  int old = open(file, O_RDONLY);
+  if (old >= 0 && flock(old, LOCK_EX|LOCK_NB) < 0) {
+    close(old);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+
+  char tmp[1100];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  unlink(tmp);
+  int ret = save_image(tmp);
+  if (ret == 0 && rename(tmp, file) < 0) {
+    diskErrno = E_WRITING_FILE;
+    ret = -1;
+  }
+  if (ret < 0) unlink(tmp);
+  else if (sync_dir(file) < 0) {
+    diskErrno = E_WRITING_FILE;
+    ret = -1;
+  }
+  if (old >= 0) close(old);
+  if (ret < 0) return -1;
+
+  // the file holds everything now
+  pthread_mutex_lock(&dirty_mutex);
+  clear_dirty();
+  pthread_mutex_unlock(&dirty_mutex);
+  memset(logged, 0, sizeof(logged));
+  snprintf(base_file, sizeof(base_file), "%s", file);
   return 0;
 }
 
@@ -41,34 +288,39 @@ int Disk_Init()
  * Disk_Save
  *
  * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
+ * will replace an existing file with the same name so be careful
+ *
+ * The image is written to a temporary file next to 'file', synced,
+ * and renamed over 'file', so a crash leaves either the old image or
+ * the new one. Most of a disk image is zeroes, so the image is written
+ * as runs of sectors: runs holding data are written out, and runs of
+ * all-zero sectors are skipped. The file ends up sparse. It fails if
+ * another process has 'file' mapped (see Disk_Map).
  */
 int Disk_Save(char* file)
 {
-  FILE* diskFile;
-    
   // error check
   if (file == NULL) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
     
-  // open the diskFile
-  if ((diskFile = fopen(file, "w")) == NULL) {
-    diskErrno = E_OPENING_FILE;
-    return -1;
+  // a shared image is the file already; just flush it
+  if (mode == DISK_SHARED) {
+    if (msync(disk, TOTAL_SECTORS*sizeof(sector_t), MS_SYNC) < 0) {
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    return 0;
   }
-    
-  // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-    fclose(diskFile);
-    diskErrno = E_WRITING_FILE;
+  if (mode != DISK_MEMORY) {
+    diskErrno = E_DISK_READ_ONLY;
     return -1;
   }
-    
-  // clean up and return
-  fclose(diskFile);
-  return 0;
+  pthread_mutex_lock(&flush_mutex);
+  int ret = save_atomic(file);
+  pthread_mutex_unlock(&flush_mutex);
+  return ret;
 }
 
 /*
@@ -87,6 +339,11 @@ int Disk_Load(char* file)
     return -1;
   }
     
+  if (mode != DISK_MEMORY) {
+    diskErrno = E_DISK_READ_ONLY;
+    return -1;
+  }
+    
   // open the diskFile
   if ((diskFile = fopen(file, "r")) == NULL) {
     diskErrno = E_OPENING_FILE;
@@ -102,9 +359,968 @@ int Disk_Load(char* file)
     
   // clean up and return
   fclose(diskFile);
+  clear_dirty();
+  memset(logged, 0, sizeof(logged));
+  snprintf(base_file, sizeof(base_file), "%s", file);
+  return 0;
+}
+
+/* logs */
+
+// a log holds the changes made to a disk image since the image was
+// last written, so that saving them is a single sequential append
+// rather than a rewrite of the image; it is a series of segments, one
+// per Disk_SaveLog(), each laid out as:
+//   log_segment_t
+//   int sectors[count]     -- the sector numbers, ascending
+//   the content of these sectors, in the same order
+// a segment that doesn't check out (e.g. cut short by a crash) ends
+// the log
+#define LOG_MAGIC 0x106a5e67
+
+typedef struct _log_segment {
+  int magic;
+  int count;
+  unsigned int crc; // crc32 of the sector numbers and content
+  int pad;
+} log_segment_t;
+
+// take the dirty sectors (only those set in 'only', unless it's NULL)
+// out of the disk, as a new log segment of 'len' bytes in '*seg'
+// (whose checksum is left to be done); return the number of sectors
+// in it, or -1 if it couldn't be allocated
+static int take_dirty(const unsigned char* only, log_segment_t** seg, size_t* len)
+{
+  pthread_mutex_lock(&dirty_mutex);
+  int count = dirty_count;
+  if (only) {
+    count = 0;
+    for (int i = 0; i < TOTAL_SECTORS; i++) count += dirty[i] & only[i];
+  }
+  *seg = NULL;
+  if (count > 0) {
+    *len = sizeof(log_segment_t) + count*(sizeof(int) + sizeof(sector_t));
+    *seg = malloc(*len);
+    if (*seg == NULL) {
+      pthread_mutex_unlock(&dirty_mutex);
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    int* sectors = (int*)(*seg + 1);
+    sector_t* data = (sector_t*)(sectors + count);
+    for (int i = 0, n = 0; i < TOTAL_SECTORS; i++) {
+      if (!dirty[i] || (only && !only[i])) continue;
+      sectors[n] = i;
+      memcpy(data + n++, disk + i, sizeof(sector_t));
+      if (only) {
+	dirty[i] = 0;
+	dirty_count--;
+      }
+    }
+    (*seg)->magic = LOG_MAGIC;
+    (*seg)->count = count;
+    (*seg)->pad = 0;
+    if (!only) clear_dirty();
+  }
+  pthread_mutex_unlock(&dirty_mutex);
+  return count;
+}
+
+// the sectors of a segment taken by take_dirty() couldn't be written
+// out, so they're dirty again
+static void put_back(log_segment_t* seg)
+{
+  pthread_mutex_lock(&dirty_mutex);
+  int* sectors = (int*)(seg + 1);
+  for (int i = 0; i < seg->count; i++) mark_dirty(sectors[i]);
+  pthread_mutex_unlock(&dirty_mutex);
+}
+
+// append the dirty sectors (only those set in 'only', unless it's
+// NULL) to the log as a new segment, and make it 'durable' if asked;
+// return the size of the log, or -1 on error
+static int save_log(char* log, const unsigned char* only, int durable)
+{
+  log_segment_t* seg;
+  size_t len;
+  int count = take_dirty(only, &seg, &len);
+  if (count < 0) return -1;
+
+  int fd = open(log, O_WRONLY|O_CREAT, 0666);
+  off_t end = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+  if (end < 0) {
+    if (fd >= 0) close(fd);
+    if (seg) { put_back(seg); free(seg); }
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  if (count > 0) {
+    int* sectors = (int*)(seg + 1);
+    seg->crc = crc32(0, (const Bytef*)sectors, len - sizeof(log_segment_t));
+    if (write_at(fd, (const char*)seg, len, end) < 0) {
+      // the broken tail is left for Disk_LoadLog to drop
+      close(fd);
+      put_back(seg);
+      free(seg);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    end += len;
+    for (int i = 0; i < count; i++) logged[sectors[i]] = 1;
+    free(seg);
+  }
+  if (durable && fdatasync(fd) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  close(fd);
+  return (int)end;
+}
+
+// write the dirty sectors (only those set in 'only', unless it's
+// NULL) in place into the disk image file, a run of adjacent sectors
+// at a time, and make them 'durable' if asked; return 0 if
+// successful, -1 otherwise
+static int save_in_place(char* file, const unsigned char* only, int durable)
+{
+  log_segment_t* seg;
+  size_t len;
+  int count = take_dirty(only, &seg, &len);
+  if (count < 0 || (count == 0 && !durable)) return count;
+
+  // (with nothing to write, what was written before is still synced)
+  int* sectors = (int*)(seg + 1);
+  sector_t* data = (sector_t*)(sectors + count);
+  int fd = open(file, O_WRONLY);
+  int ret = fd < 0 ? -1 : 0;
+  for (int i = 0; ret == 0 && i < count; ) {
+    int j = i + 1;
+    while (j < count && sectors[j] == sectors[j-1] + 1) j++;
+    ret = write_at(fd, data[i].data, (size_t)(j - i)*sizeof(sector_t), (off_t)sectors[i]*sizeof(sector_t));
+    i = j;
+  }
+  if (ret == 0 && durable) ret = fdatasync(fd);
+  if (fd >= 0) close(fd);
+  if (ret < 0) {
+    if (seg) put_back(seg);
+    diskErrno = fd < 0 ? E_OPENING_FILE : E_WRITING_FILE;
+  }
+  free(seg);
+  return ret;
+}
+
+/*
+ * Disk_SaveLog
+ *
+ * Appends the sectors written since the disk was last saved (in any
+ * way) to the log file as a new segment. Returns the size of the log
+ * in bytes, or -1 on error.
+ */
+int Disk_SaveLog(char* log)
+{
+  if (log == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (mode != DISK_MEMORY) {
+    diskErrno = E_DISK_READ_ONLY;
+    return -1;
+  }
+  pthread_mutex_lock(&flush_mutex);
+  int ret = save_log(log, NULL, 0);
+  pthread_mutex_unlock(&flush_mutex);
+  return ret;
+}
+
+/*
+ * Disk_LoadLog
+ *
+ * Applies the segments of a log file, in order, on top of the disk
+ * image just loaded with Disk_Load. A missing log is an empty one. A
+ * broken segment and whatever follows it are dropped from the file.
+ * On an image mapped with Disk_Map, the segments go to private copies
+ * of the sectors they hold, and neither the image nor the log is
+ * written (a broken tail is only skipped).
+ */
+int Disk_LoadLog(char* log)
+{
+  if (log == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (mode != DISK_MEMORY && mode != DISK_MAPPED) {
+    diskErrno = E_DISK_READ_ONLY;
+    return -1;
+  }
+
+  struct stat st;
+  int fd = open(log, mode == DISK_MAPPED ? O_RDONLY : O_RDWR);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    else if (access(log, F_OK) != 0) return 0;
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  const char* buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (buf == MAP_FAILED) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  off_t off = 0;
+  while (off + (off_t)sizeof(log_segment_t) <= st.st_size) {
+    const log_segment_t* seg = (const log_segment_t*)(buf + off);
+    if (seg->magic != LOG_MAGIC || seg->count <= 0 || seg->count > TOTAL_SECTORS) break;
+    size_t len = sizeof(log_segment_t) + seg->count*(sizeof(int) + sizeof(sector_t));
+    if (off + (off_t)len > st.st_size) break;
+    const int* sectors = (const int*)(seg + 1);
+    const sector_t* data = (const sector_t*)(sectors + seg->count);
+    if (crc32(0, (const Bytef*)sectors, len - sizeof(log_segment_t)) != seg->crc) break;
+    int i;
+    for (i = 0; i < seg->count; i++)
+      if (sectors[i] < 0 || sectors[i] >= TOTAL_SECTORS) break;
+    if (i < seg->count) break;
+
+    for (i = 0; i < seg->count; i++) {
+      memcpy(disk + sectors[i], data + i, sizeof(sector_t));
+      logged[sectors[i]] = 1;
+    }
+    if (mode == DISK_MAPPED) replayed = 1;
+    off += len;
+  }
+  munmap((void*)buf, st.st_size);
+
+  // drop a broken tail, so that new segments follow the good ones
+  if (mode == DISK_MEMORY && off < st.st_size && ftruncate(fd, off) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+// Disk_CleanLog(), with the write-backs held off
+static int clean_log(char* file, char* log)
+{
+  // the changes are committed once they're durable in the log
+  if (save_log(log, NULL, 1) < 0) return -1;
+
+  int fd = open(file, O_WRONLY);
+  if (fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  int i = 0;
+  while (i < TOTAL_SECTORS) {
+    if (!logged[i]) { i++; continue; }
+    int j = i + 1;
+    while (j < TOTAL_SECTORS && logged[j]) j++;
+    if (write_at(fd, disk[i].data, (size_t)(j - i)*sizeof(sector_t), (off_t)i*sizeof(sector_t)) < 0) {
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    i = j;
+  }
+  if (fdatasync(fd) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  close(fd);
+
+  if (truncate(log, 0) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  memset(logged, 0, sizeof(logged));
+  snprintf(base_file, sizeof(base_file), "%s", file);
   return 0;
 }
 
+/*
+ * Disk_CleanLog
+ *
+ * Brings the disk image file up to date and empties the log: the
+ * sectors written since the last Disk_SaveLog are logged first, then
+ * every sector found in the log is written in place, in ascending
+ * order, and made durable before the log is truncated. Should a crash
+ * come in between, replaying the log again does no harm.
+ */
+int Disk_CleanLog(char* file, char* log)
+{
+  if (file == NULL || log == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (mode != DISK_MEMORY) {
+    diskErrno = E_DISK_READ_ONLY;
+    return -1;
+  }
+  pthread_mutex_lock(&flush_mutex);
+  int ret = clean_log(file, log);
+  pthread_mutex_unlock(&flush_mutex);
+  return ret;
+}
+
+/*
+ * Disk_Commit
+ *
+ * Saves the disk to the image file so that a crash at any point
+ * leaves either the old content or the new one, with the least
+ * writing it can: when the disk was loaded from (or last saved to)
+ * that file and only part of it changed, the changes are committed to
+ * the log and then written in place (see Disk_CleanLog); otherwise,
+ * or without a log, the whole image is saved (see Disk_Save). Either
+ * way, the log is gone afterwards.
+ */
+int Disk_Commit(char* file, char* log)
+{
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (mode != DISK_MEMORY) return Disk_Save(file);
+
+  struct stat st;
+  pthread_mutex_lock(&flush_mutex);
+  int ret;
+  if (log && strcmp(file, base_file) == 0 && dirty_count <= TOTAL_SECTORS/4 &&
+      stat(file, &st) == 0 && st.st_size == (off_t)TOTAL_SECTORS*sizeof(sector_t)) {
+    ret = clean_log(file, log);
+  } else {
+    // what's in the log must reach the image before the log goes away
+    int pending = 0;
+    for (int i = 0; i < TOTAL_SECTORS && !pending; i++) pending = logged[i];
+    ret = log && pending && strcmp(file, base_file) == 0 ? clean_log(file, log) : 0;
+    if (ret == 0) ret = save_atomic(file);
+  }
+  if (ret == 0 && log) unlink(log);
+  pthread_mutex_unlock(&flush_mutex);
+  return ret;
+}
+
+/*
+ * Disk_SyncSectors
+ *
+ * Makes the 'n' given sectors durable in the backstore, and nothing
+ * else: those of them written since they were last saved go to the
+ * log (if 'log' isn't NULL) or in place into the disk image file,
+ * which is then synced to stable storage. A shared image has the
+ * pages of these sectors synced. Returns 0 if successful, -1 on error.
+ */
+int Disk_SyncSectors(char* file, char* log, int* sectors, int n)
+{
+  if (file == NULL || sectors == NULL || n < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  unsigned char only[TOTAL_SECTORS];
+  memset(only, 0, sizeof(only));
+  for (int i = 0; i < n; i++) {
+    if (sectors[i] < 0 || sectors[i] >= TOTAL_SECTORS) {
+      diskErrno = E_INVALID_PARAM;
+      return -1;
+    }
+    only[sectors[i]] = 1;
+  }
+
+  if (mode == DISK_SHARED) {
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < TOTAL_SECTORS; i++) {
+      if (!only[i]) continue;
+      char* start = (char*)((unsigned long)(disk + i) & ~(page - 1));
+      if (msync(start, (char*)(disk + i + 1) - start, MS_SYNC) < 0) {
+	diskErrno = E_WRITING_FILE;
+	return -1;
+      }
+    }
+    return 0;
+  }
+  if (mode != DISK_MEMORY) return 0; // nothing can have changed
+
+  pthread_mutex_lock(&flush_mutex);
+  int ret = log ? save_log(log, only, 1) : save_in_place(file, only, 1);
+  pthread_mutex_unlock(&flush_mutex);
+  return ret < 0 ? -1 : 0;
+}
+
+/* background flusher */
+
+static void* flusher_main(void* arg)
+{
+  // look at the dirty sectors a few times per age limit (and when
+  // Disk_Write finds the ratio reached)
+  long period = flush_age > 0 ? flush_age/4 : 1000;
+  if (period < 10) period = 10;
+  if (period > 1000) period = 1000;
+
+  // the limits are looked at before waiting too: a signal sent while
+  // the thread was starting, or flushing, found no one waiting for it
+  // (but after a failed flush, the next try waits a period)
+  int failed = 0;
+  pthread_mutex_lock(&dirty_mutex);
+  while (!flusher_stop) {
+    int due = !failed && dirty_count > 0 &&
+      ((flush_ratio > 0 && dirty_count*100 >= flush_ratio*TOTAL_SECTORS) ||
+       (flush_age > 0 && now_ms()-dirty_since >= flush_age));
+    if (!due) {
+      struct timespec t;
+      clock_gettime(CLOCK_REALTIME, &t);
+      t.tv_sec += period/1000;
+      t.tv_nsec += (period%1000)*1000000;
+      if (t.tv_nsec >= 1000000000) { t.tv_sec++; t.tv_nsec -= 1000000000; }
+      pthread_cond_timedwait(&flusher_wake, &dirty_mutex, &t);
+      failed = 0;
+      continue;
+    }
+
+    // the segment is taken while the caller holds off its changes, so
+    // that it doesn't catch one half done; Disk_Write only waits while
+    // the sectors are copied out, not while they're written
+    pthread_mutex_unlock(&dirty_mutex);
+    if (flush_hold) flush_hold();
+    pthread_mutex_lock(&flush_mutex);
+    failed = save_log(flush_log, NULL, 0) < 0;
+    pthread_mutex_unlock(&flush_mutex);
+    if (flush_release) flush_release();
+    pthread_mutex_lock(&dirty_mutex);
+  }
+  pthread_mutex_unlock(&dirty_mutex);
+  return NULL;
+}
+
+// a child process doesn't get the flusher thread, so it must not wait
+// for it; the locks are taken around fork() so that the child gets
+// them free
+static void before_fork()
+{
+  pthread_mutex_lock(&flush_mutex);
+  pthread_mutex_lock(&dirty_mutex);
+}
+
+static void after_fork()
+{
+  pthread_mutex_unlock(&dirty_mutex);
+  pthread_mutex_unlock(&flush_mutex);
+}
+
+static void after_fork_child()
+{
+  flushing = 0;
+  after_fork();
+}
+
+/*
+ * Disk_StartFlusher
+ *
+ * Starts a thread that appends the dirty sectors to the log (see
+ * Disk_SaveLog) as soon as 'ratio' percent of the disk is dirty or
+ * the oldest change is 'age' milliseconds old; either limit is
+ * ignored if it's not positive. The sectors never go to the disk
+ * image file itself: written there in place a few at a time, a crash
+ * could leave it with only some of the changes of an operation. For
+ * the same reason, the flusher calls 'hold' before it takes the dirty
+ * sectors and 'release' after (unless they're NULL), so that the
+ * caller can make it wait until no operation is half done: every
+ * segment in the log is then a state the caller left the disk in.
+ * Only the in-memory disk can have a flusher.
+ */
+int Disk_StartFlusher(char* log, int ratio, int age,
+		      void (*hold)(void), void (*release)(void))
+{
+  if (log == NULL || strlen(log) >= sizeof(flush_log)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (mode != DISK_MEMORY) {
+    diskErrno = E_DISK_READ_ONLY;
+    return -1;
+  }
+  Disk_StopFlusher();
+
+  static int forks_handled;
+  if (!forks_handled) {
+    pthread_atfork(before_fork, after_fork, after_fork_child);
+    forks_handled = 1;
+  }
+  strcpy(flush_log, log);
+  flush_hold = hold;
+  flush_release = release;
+  flush_ratio = ratio;
+  flush_age = age;
+  flusher_stop = 0;
+  flushing = 1;
+  if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+    flushing = 0;
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_StopFlusher
+ *
+ * Stops the flusher thread, if there's one; whatever is still dirty
+ * stays so.
+ */
+void Disk_StopFlusher()
+{
+  if (!flushing) return;
+  pthread_mutex_lock(&dirty_mutex);
+  flusher_stop = 1;
+  pthread_cond_signal(&flusher_wake);
+  pthread_mutex_unlock(&dirty_mutex);
+  pthread_join(flusher, NULL);
+  flushing = 0;
+}
+
+/* compressed archives */
+
+// an archive holds only the sectors that were chosen when it was
+// saved (and that are not all zeroes); the file is laid out as:
+//   archive_header_t
+//   int index[nsectors]            -- the stored sector numbers, ascending
+//   archive_chunk_t chunks[nchunks]
+//   the compressed chunks
+// the stored sectors are taken in index order, ARCHIVE_CHUNK_SECTORS
+// at a time, and each group is compressed (zlib) into one chunk; a
+// sector is found by its position p in the index: it's slot p%16 of
+// chunk p/16
+#define ARCHIVE_MAGIC "LFSARCH1"
+#define ARCHIVE_CHUNK_SECTORS 16
+
+typedef struct _archive_header {
+  char magic[8];
+  int sector_size;
+  int total_sectors;
+  int nsectors;
+  int nchunks;
+} archive_header_t;
+
+typedef struct _archive_chunk {
+  long long offset; // from the start of the file
+  int clen;         // compressed length
+  int pad;
+} archive_chunk_t;
+
+// decompression cache of the mounted archive
+static int arch_cached = -1;          // chunk held in arch_buf
+static sector_t arch_buf[ARCHIVE_CHUNK_SECTORS];
+
+// check the header and the tables of an archive of 'len' bytes;
+// return 0 if it looks sane, -1 otherwise
+static int archive_check(const char* buf, size_t len)
+{
+  const archive_header_t* h = (const archive_header_t*)buf;
+  if(len < sizeof(archive_header_t) ||
+     memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) ||
+     h->sector_size != SECTOR_SIZE || h->total_sectors != TOTAL_SECTORS ||
+     h->nsectors < 0 || h->nsectors > TOTAL_SECTORS ||
+     h->nchunks != (h->nsectors+ARCHIVE_CHUNK_SECTORS-1)/ARCHIVE_CHUNK_SECTORS)
+    return -1;
+  size_t tables = sizeof(archive_header_t) + h->nsectors*sizeof(int) +
+    h->nchunks*sizeof(archive_chunk_t);
+  if(len < tables) return -1;
+
+  const int* index = (const int*)(buf + sizeof(archive_header_t));
+  for(int i=0; i<h->nsectors; i++)
+    if(index[i] < 0 || index[i] >= TOTAL_SECTORS || (i > 0 && index[i] <= index[i-1]))
+      return -1;
+  const archive_chunk_t* c = (const archive_chunk_t*)(index + h->nsectors);
+  for(int i=0; i<h->nchunks; i++)
+    if(c[i].offset < tables || c[i].clen <= 0 || c[i].offset+c[i].clen > len)
+      return -1;
+  return 0;
+}
+
+// decompress chunk 'k' of the archive at 'buf' into 'out'
+static int archive_inflate(const char* buf, int k, sector_t* out)
+{
+  const archive_header_t* h = (const archive_header_t*)buf;
+  const archive_chunk_t* c = (const archive_chunk_t*)
+    (buf + sizeof(archive_header_t) + h->nsectors*sizeof(int)) + k;
+  int count = h->nsectors - k*ARCHIVE_CHUNK_SECTORS;
+  if(count > ARCHIVE_CHUNK_SECTORS) count = ARCHIVE_CHUNK_SECTORS;
+  uLongf olen = count*sizeof(sector_t);
+  if(uncompress((Bytef*)out, &olen, (const Bytef*)(buf + c->offset), c->clen) != Z_OK ||
+     olen != count*sizeof(sector_t))
+    return -1;
+  return 0;
+}
+
+// Disk_Read() for a mounted archive (the cache is shared by all the
+// threads reading, hence the lock)
+static pthread_mutex_t arch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int archive_read(int sector, char* buffer)
+{
+  int p = arch_pos[sector];
+  if(p < 0) {
+    // not stored, so it was all zeroes (or not in use)
+    memset(buffer, 0, sizeof(sector_t));
+    return 0;
+  }
+  pthread_mutex_lock(&arch_lock);
+  if(p/ARCHIVE_CHUNK_SECTORS != arch_cached) {
+    arch_cached = -1;
+    if(archive_inflate(arch_map, p/ARCHIVE_CHUNK_SECTORS, arch_buf) < 0) {
+      pthread_mutex_unlock(&arch_lock);
+      diskErrno = E_READING_FILE;
+      return -1;
+    }
+    arch_cached = p/ARCHIVE_CHUNK_SECTORS;
+  }
+  memcpy(buffer, arch_buf + p%ARCHIVE_CHUNK_SECTORS, sizeof(sector_t));
+  pthread_mutex_unlock(&arch_lock);
+  return 0;
+}
+
+// map a whole file read-only; return the mapping or NULL
+static const char* map_file(char* file, size_t* len)
+{
+  int fd = open(file, O_RDONLY);
+  if(fd < 0) return NULL;
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return NULL;
+  *len = st.st_size;
+  return (const char*)p;
+}
+
+/*
+ * Disk_IsArchive
+ *
+ * Returns 1 if the file is a disk archive (see Disk_SaveArchive), and
+ * 0 otherwise (including when it can't be opened).
+ */
+int Disk_IsArchive(char* file)
+{
+  char magic[8];
+  FILE* f;
+  if (file == NULL || (f = fopen(file, "r")) == NULL)
+    return 0;
+  int ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+    !memcmp(magic, ARCHIVE_MAGIC, sizeof(magic));
+  fclose(f);
+  return ok;
+}
+
+// the chunks of an archive being saved: the sectors to store, one
+// after another, and room for each chunk compressed
+typedef struct _archive_save {
+  sector_t* raw;
+  int nsectors;
+  char* data;   // chunk k at k*bound
+  uLong bound;
+  archive_chunk_t* chunks; // clen only, 0 if it failed
+} archive_save_t;
+
+static void archive_compress(void* arg, int k)
+{
+  archive_save_t* s = arg;
+  int first = k*ARCHIVE_CHUNK_SECTORS;
+  int count = s->nsectors-first < ARCHIVE_CHUNK_SECTORS ? s->nsectors-first : ARCHIVE_CHUNK_SECTORS;
+  uLongf clen = s->bound;
+  if (compress2((Bytef*)s->data + k*s->bound, &clen, (Bytef*)(s->raw + first),
+		count*sizeof(sector_t), Z_BEST_COMPRESSION) != Z_OK)
+    clen = 0;
+  s->chunks[k].clen = clen;
+}
+
+/*
+ * Disk_SaveArchive
+ *
+ * Saves the disk image as a compressed archive holding only the
+ * sectors marked in 'map' (one bit per sector, most significant bit
+ * first, like the file system bitmaps); sectors that are all zeroes
+ * are left out as well. With a NULL map every non-zero sector is kept.
+ * The sectors are read here, then compressed by 'each' (see LibDisk.h).
+ */
+int Disk_SaveArchive(char* file, char* map,
+		     void (*each)(int n, void (*fn)(void* arg, int k), void* arg))
+{
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // pick the sectors to store, and copy them out
+  int* index = malloc(TOTAL_SECTORS*sizeof(int));
+  sector_t* raw = malloc(TOTAL_SECTORS*sizeof(sector_t));
+  if (index == NULL || raw == NULL) {
+    free(index); free(raw);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  int nsectors = 0;
+  for (int i = 0; i < TOTAL_SECTORS; i++) {
+    if (map && !(map[i/8] & (0x80 >> (i%8)))) continue;
+    if (Disk_Read(i, raw[nsectors].data) < 0) {
+      free(index); free(raw);
+      return -1;
+    }
+    if (!Simd_IsZero(raw[nsectors].data, sizeof(sector_t)))
+      index[nsectors++] = i;
+  }
+
+  archive_header_t h;
+  memcpy(h.magic, ARCHIVE_MAGIC, sizeof(h.magic));
+  h.sector_size = SECTOR_SIZE;
+  h.total_sectors = TOTAL_SECTORS;
+  h.nsectors = nsectors;
+  h.nchunks = (nsectors+ARCHIVE_CHUNK_SECTORS-1)/ARCHIVE_CHUNK_SECTORS;
+
+  // compress the chunks, each into its own room
+  archive_save_t s;
+  s.raw = raw;
+  s.nsectors = nsectors;
+  s.bound = compressBound(ARCHIVE_CHUNK_SECTORS*sizeof(sector_t));
+  s.chunks = calloc(h.nchunks ? h.nchunks : 1, sizeof(archive_chunk_t));
+  s.data = malloc(h.nchunks*s.bound + 1);
+  if (s.chunks == NULL || s.data == NULL) {
+    free(index); free(raw); free(s.chunks); free(s.data);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  if (each) each(h.nchunks, archive_compress, &s);
+  else
+    for (int k = 0; k < h.nchunks; k++) archive_compress(&s, k);
+  free(raw);
+
+  // they're stored one after another
+  long long offset = sizeof(h) + nsectors*sizeof(int) + h.nchunks*sizeof(archive_chunk_t);
+  int ok = 1;
+  for (int k = 0; k < h.nchunks; k++) {
+    if (s.chunks[k].clen == 0) ok = 0;
+    s.chunks[k].offset = offset;
+    offset += s.chunks[k].clen;
+  }
+  if (!ok) {
+    free(index); free(s.chunks); free(s.data);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
+  // write it all out
+  FILE* f = fopen(file, "w");
+  ok = f != NULL;
+  if (ok) {
+    ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+      fwrite(index, sizeof(int), nsectors, f) == nsectors &&
+      fwrite(s.chunks, sizeof(archive_chunk_t), h.nchunks, f) == h.nchunks;
+    for (int k = 0; ok && k < h.nchunks; k++)
+      ok = fwrite(s.data + k*s.bound, 1, s.chunks[k].clen, f) == s.chunks[k].clen;
+    if (fclose(f) != 0) ok = 0;
+  }
+  free(index); free(s.chunks); free(s.data);
+  if (!ok) {
+    diskErrno = f ? E_WRITING_FILE : E_OPENING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+// read the archive in 'file' and check it; the mapping is returned
+static const char* archive_open(char* file, size_t* len)
+{
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return NULL;
+  }
+  const char* buf = map_file(file, len);
+  if (buf == NULL) {
+    diskErrno = E_OPENING_FILE;
+    return NULL;
+  }
+  if (archive_check(buf, *len) < 0) {
+    munmap((void*)buf, *len);
+    diskErrno = E_READING_FILE;
+    return NULL;
+  }
+  return buf;
+}
+
+/*
+ * Disk_LoadArchive
+ *
+ * Loads a disk archive into memory, replacing the current disk image
+ * (the counterpart of Disk_Load for archives).
+ */
+int Disk_LoadArchive(char* file)
+{
+  size_t len;
+  if (mode != DISK_MEMORY) {
+    diskErrno = E_DISK_READ_ONLY;
+    return -1;
+  }
+  const char* buf = archive_open(file, &len);
+  if (buf == NULL) return -1;
+
+  const archive_header_t* h = (const archive_header_t*)buf;
+  const int* index = (const int*)(buf + sizeof(archive_header_t));
+  memset(disk, 0, TOTAL_SECTORS*sizeof(sector_t));
+  for (int i = 0; i < TOTAL_SECTORS; i++) mark_dirty(i); // all of it is new
+  for (int k = 0; k < h->nchunks; k++) {
+    if (archive_inflate(buf, k, arch_buf) < 0) {
+      munmap((void*)buf, len);
+      diskErrno = E_READING_FILE;
+      return -1;
+    }
+    for (int p = k*ARCHIVE_CHUNK_SECTORS; p < h->nsectors && p < (k+1)*ARCHIVE_CHUNK_SECTORS; p++)
+      memcpy(disk + index[p], arch_buf + p%ARCHIVE_CHUNK_SECTORS, sizeof(sector_t));
+  }
+  munmap((void*)buf, len);
+  return 0;
+}
+
+/*
+ * Disk_MountArchive
+ *
+ * Uses a disk archive directly as the (read-only) disk: nothing is
+ * decompressed up front; Disk_Read inflates the chunk holding the
+ * sector when it's needed. Disk_Write and Disk_Save fail afterwards.
+ */
+int Disk_MountArchive(char* file)
+{
+  size_t len;
+  const char* buf = archive_open(file, &len);
+  if (buf == NULL) return -1;
+
+  int* pos = malloc(TOTAL_SECTORS*sizeof(int));
+  if (pos == NULL) {
+    munmap((void*)buf, len);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  const archive_header_t* h = (const archive_header_t*)buf;
+  const int* index = (const int*)(buf + sizeof(archive_header_t));
+  for (int i = 0; i < TOTAL_SECTORS; i++) pos[i] = -1;
+  for (int p = 0; p < h->nsectors; p++) pos[index[p]] = p;
+
+  // the in-memory image isn't needed anymore
+  if (release_disk() < 0) {
+    free(pos);
+    munmap((void*)buf, len);
+    return -1;
+  }
+  arch_map = buf;
+  arch_len = len;
+  arch_pos = pos;
+  arch_cached = -1;
+  mode = DISK_ARCHIVE;
+  return 0;
+}
+
+// map the disk image in 'file', shared and writable or private
+static int map_image(char* file, int writable, disk_mode_t new_mode)
+{
+  int fd;
+  struct stat st;
+
+  // error check
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // open the diskFile; it must hold a whole disk image. The file is
+  // locked shared for as long as it's mapped, so that save_atomic()
+  // doesn't replace it; if it was replaced while waiting for the
+  // lock, the new file is opened instead
+  struct stat cur;
+  for (;;) {
+    if ((fd = open(file, writable ? O_RDWR : O_RDONLY)) < 0) {
+      diskErrno = E_OPENING_FILE;
+      return -1;
+    }
+    if (flock(fd, LOCK_SH) < 0 || fstat(fd, &st) < 0 || stat(file, &cur) < 0 ||
+	(st.st_dev == cur.st_dev && st.st_ino == cur.st_ino)) break;
+    close(fd);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size != TOTAL_SECTORS*sizeof(sector_t)) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  // a read-only image is mapped private, so that a log can be applied
+  // to copies of its sectors (see Disk_LoadLog); the sectors that are
+  // not are the file's pages all the same
+  void* p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+		 writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
+  // the in-memory image isn't needed anymore
+  if (release_disk() < 0) {
+    munmap(p, st.st_size);
+    close(fd);
+    return -1;
+  }
+  disk = (sector_t*)p;
+  disk_fd = fd;
+  mode = new_mode;
+  return 0;
+}
+
+/*
+ * Disk_Map
+ *
+ * Uses a disk image file in place as the (read-only) disk instead of
+ * loading a copy of it: all processes using the same image share its
+ * pages in the page cache. Disk_Write and Disk_Save fail afterwards,
+ * and Disk_LoadLog applies a log without writing anything. The file
+ * only needs to be readable.
+ */
+int Disk_Map(char* file)
+{
+  return map_image(file, 0, DISK_MAPPED);
+}
+
+/*
+ * Disk_MapShared
+ *
+ * Uses a disk image file in place as the disk, writable: every
+ * Disk_Write lands in the file's pages right away and is seen by all
+ * other processes that mapped the same file. The caller is in charge
+ * of coordinating them. Disk_Save only flushes the pages to the file
+ * (whatever the file name), and Disk_Load fails.
+ */
+int Disk_MapShared(char* file)
+{
+  return map_image(file, 1, DISK_SHARED);
+}
+
+/*
+ * Disk_Fd
+ *
+ * Returns the file descriptor of the disk image when it is used in
+ * place (see Disk_Map and Disk_MapShared), or -1 otherwise (including
+ * when a log was applied on top of it). Sector s is at byte
+ * s*SECTOR_SIZE of the file, so its content can be handed to the
+ * kernel directly (e.g. with splice) rather than copied.
+ */
+int Disk_Fd()
+{
+  return replayed ? -1 : disk_fd;
+}
+
 /*
  * Disk_Read
  *
@@ -118,16 +1334,76 @@ int Disk_Read(int sector, char* buffer)
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  COUNT(reads, 1);
+  profile(sector);
+
+  if(mode == DISK_ARCHIVE)
+    return archive_read(sector, buffer);
     
   // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
-    diskErrno = E_MEM_OP;
-    return -1;
-  }
-    
+  memcpy(buffer, disk + sector, sizeof(sector_t));
   return 0;
 }
 
+/*
+ * Disk_Pin
+ *
+ * Returns the content of a sector where it lives, instead of copying
+ * it out; the memory stays there until Disk_Unpin(), and until then
+ * Disk_Init and the other calls that would release it fail with
+ * E_DISK_BUSY. The content isn't a snapshot: Disk_Write to the sector
+ * changes it in place, under whoever pinned it.
+ */
+const char* Disk_Pin(int sector)
+{
+  if ((sector < 0) || (sector >= TOTAL_SECTORS)) {
+    diskErrno = E_INVALID_PARAM;
+    return NULL;
+  }
+
+  COUNT(reads, 1);
+  profile(sector);
+
+  pthread_mutex_lock(&pin_mutex);
+  const char* p = NULL;
+  if (mode != DISK_ARCHIVE)
+    p = disk[sector].data;
+  else if (pin_copy[sector] == NULL) {
+    // an archived sector is only in memory while its chunk is cached,
+    // so it gets a copy of its own for as long as it's pinned
+    char* copy = malloc(sizeof(sector_t));
+    if (copy == NULL)
+      diskErrno = E_MEM_OP;
+    else if (archive_read(sector, copy) < 0)
+      free(copy);
+    else
+      p = pin_copy[sector] = copy;
+  } else
+    p = pin_copy[sector];
+  if (p) {
+    pins[sector]++;
+    pinned++;
+  }
+  pthread_mutex_unlock(&pin_mutex);
+  return p;
+}
+
+void Disk_Unpin(int sector)
+{
+  if ((sector < 0) || (sector >= TOTAL_SECTORS))
+    return;
+  pthread_mutex_lock(&pin_mutex);
+  if (pins[sector] > 0) {
+    pinned--;
+    if (--pins[sector] == 0 && pin_copy[sector]) {
+      free(pin_copy[sector]);
+      pin_copy[sector] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&pin_mutex);
+}
+
 /*
  * Disk_Write
  *
@@ -140,11 +1416,34 @@ int Disk_Write(int sector, char* buffer)
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
-    
-  // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
-    diskErrno = E_MEM_OP;
+  if(mode != DISK_MEMORY && mode != DISK_SHARED) {
+    diskErrno = E_DISK_READ_ONLY;
     return -1;
   }
+  COUNT(writes, 1);
+  profile(sector);
+    
+  // copy the memory for the user
+  if (flushing) pthread_mutex_lock(&dirty_mutex);
+  memcpy(disk + sector, buffer, sizeof(sector_t));
+  mark_dirty(sector);
+  if (flushing) pthread_mutex_unlock(&dirty_mutex);
   return 0;
 }
+
+void Disk_GetStats(Disk_Stats_t* s)
+{
+  s->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+  s->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+  s->seeks = __atomic_load_n(&stats.seeks, __ATOMIC_RELAXED);
+  s->seek_distance = __atomic_load_n(&stats.seek_distance, __ATOMIC_RELAXED);
+}
+
+void Disk_ResetStats()
+{
+  __atomic_store_n(&stats.reads, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats.writes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats.seeks, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats.seek_distance, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&lastSector, 0, __ATOMIC_RELAXED);
+}
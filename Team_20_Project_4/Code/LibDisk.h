@@ -13,8 +13,16 @@
 #ifndef __Disk_H__
 #define __Disk_H__
 
-// a few disk parameters
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a few disk parameters; the libraries can be built for another
+// sector size (see GEOMETRY in Makefile), which a disk image is then
+// bound to
+#ifndef SECTOR_SIZE
 #define SECTOR_SIZE 512
+#endif
 #define TOTAL_SECTORS 10000 
 
 // disk errors
@@ -24,9 +32,11 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_DISK_READ_ONLY,
+  E_DISK_BUSY, // a sector is still pinned (see Disk_Pin)
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+extern __thread int diskErrno; // used to see what happened w/ disk ops (per thread)
 
 int Disk_Init();
 int Disk_Save(char* file);
@@ -34,4 +44,65 @@ int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// the content of a sector where it is, without copying it; it stays
+// there until Disk_Unpin() is called as many times as Disk_Pin() was
+// (the disk can't be initialized, loaded or mapped again until then),
+// but a write to the sector changes it in place
+const char* Disk_Pin(int sector);
+void Disk_Unpin(int sector);
+
+// save the changes as segments appended to a log file, instead of
+// rewriting the image; a log is applied on top of the image it goes
+// with, and folded back into it by Disk_CleanLog
+int Disk_SaveLog(char* log); // returns the size of the log
+int Disk_LoadLog(char* log);
+int Disk_CleanLog(char* file, char* log);
+
+// save the disk to the image file atomically, through the log when
+// only part of the disk changed since it was loaded or saved
+int Disk_Commit(char* file, char* log);
+
+// make only the given sectors durable (to the log, if not NULL)
+int Disk_SyncSectors(char* file, char* log, int* sectors, int n);
+
+// append the changes to the log from a background thread, once
+// 'ratio' percent of the disk is dirty or the oldest change is 'age'
+// ms old; it calls 'hold' and 'release' around taking them, so that
+// the caller can keep it from catching an operation half done
+int Disk_StartFlusher(char* log, int ratio, int age,
+		      void (*hold)(void), void (*release)(void));
+void Disk_StopFlusher();
+
+// use a disk image file in place, read-only or shared between processes
+int Disk_Map(char* file);
+int Disk_MapShared(char* file);
+int Disk_Fd(); // the image file in use, or -1
+
+// compressed archives holding only selected sectors; the chunks of a
+// new archive are compressed by 'each', which calls fn(arg, k) for
+// every k from 0 to n-1, in any order and on any thread (NULL does it
+// one after another)
+int Disk_IsArchive(char* file);
+int Disk_SaveArchive(char* file, char* map,
+		     void (*each)(int n, void (*fn)(void* arg, int k), void* arg));
+int Disk_LoadArchive(char* file);
+int Disk_MountArchive(char* file);
+
+// the access profile of the disk since the program started or the last
+// Disk_ResetStats(): how many sectors were read and written, and how
+// many accesses were seeks (not to the sector last touched or the one
+// right after it) and how far they went in total, in sectors
+typedef struct _Disk_Stats {
+  long reads;
+  long writes;
+  long seeks;
+  long seek_distance;
+} Disk_Stats_t;
+void Disk_GetStats(Disk_Stats_t* stats);
+void Disk_ResetStats();
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // __Disk_H__
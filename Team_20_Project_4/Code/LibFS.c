@@ -1,10 +1,18 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "LibDisk.h"
 #include "LibFS.h"
+#include "LibSimd.h"
 #include <ctype.h>
 
 /*
@@ -32,6 +40,42 @@ void noprintf(char* str, ...) {}
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
 
+// the superblock also records the optional features the file system
+// was formatted with (zero in images made before there were any)
+typedef struct _superblock {
+  int magic;             // OS_MAGIC
+  int features;          // the FEATURE_* flags below
+  int pathindex_start;   // first sector of the path index (#6)
+  int pathindex_sectors; // number of sectors of the path index
+  int hotinode_start;    // first sector of the hot inode table (#7)
+  int hotinode_sectors;  // number of sectors of the hot inode table
+  int sector_size;       // SECTOR_SIZE of the build that formatted it
+  int sequence;          // the checkpoint this copy was written at
+  unsigned int checksum; // of all of the above (see sb_checksum())
+} superblock_t;
+
+// features
+#define FEATURE_PATHINDEX 0x1  // the path index (#6) is kept
+#define FEATURE_VARDIRENTS 0x2 // dirents are packed (see vardirent_t)
+#define FEATURE_HOTINODES 0x4  // the hot inode table (#7) is kept
+#define FEATURE_CHECKPOINTS 0x8 // there are two copies of the superblock
+
+// with FEATURE_CHECKPOINTS, the superblock is kept in two places, the
+// first sector and the last one of the disk, which take turns: each
+// FS_Sync() writes the superblock, with the next sequence number, to
+// the copy not written last time; so a crash while it's written leaves
+// the other copy whole, and the one with the checksum right and the
+// highest sequence number is used. That is all the copies guard
+// against: they don't record which of the other sectors made it to
+// the backstore (Disk_Commit() and the log see to those), so a mount
+// doesn't roll back to the state of the last checkpoint
+#define SHADOW_SUPERBLOCK_SECTOR (TOTAL_SECTORS-1)
+#define SUPERBLOCK_SECTOR(seq) ((seq)%2 ? SHADOW_SUPERBLOCK_SECTOR : SUPERBLOCK_START_SECTOR)
+
+// the sector size a file system was formatted with (the field is zero
+// in images made before it was recorded, all of which had 512)
+#define SB_SECTOR_SIZE(super) ((super)->sector_size ? (super)->sector_size : 512)
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR 1
@@ -79,6 +123,41 @@ typedef struct _inode {
 // blocks for the content of files and directories
 #define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
 
+// 6. the path index (optional), at the end of the disk, which maps the
+// hash of the full path of each file and directory to its inode, so
+// that a path can be looked up with a single probe instead of one
+// directory search per level; it's an open-addressing hash table
+// (linear probing) whose entries are checked against the directory
+// holding the file before they're trusted, and a path that isn't
+// found in it is still looked up the long way; so an index that
+// misses entries (e.g., when it's full) is slower but never wrong
+typedef struct _pathindex_entry {
+  unsigned long long hash; // hash of the full path (see path_hash())
+  int inode;  // inode of the file; 0 if the slot is free, -1 if removed
+  int parent; // inode of the directory holding the file
+} pathindex_entry_t;
+
+#define PATHINDEX_ENTRIES_PER_SECTOR (SECTOR_SIZE/sizeof(pathindex_entry_t))
+#define PATHINDEX_SLOTS 2048 // enough to keep it at most half full
+#define PATHINDEX_SECTORS (PATHINDEX_SLOTS/PATHINDEX_ENTRIES_PER_SECTOR)
+
+// the hash of the root directory's path, which other paths extend
+#define PATHINDEX_ROOT_HASH 0xcbf29ce484222325ULL
+
+// 7. the hot inode table (optional), right before the path index (or
+// at the end of the disk), which keeps a copy of the attributes of
+// each inode (but not its block map) packed densely, so that stat-like
+// operations read one sector for 64 inodes instead of one for 4; the
+// inode table is still the authority, and every inode table sector
+// written is copied to it (see write_inodes())
+typedef struct _hot_inode {
+  int size; // same as in inode_t
+  int type;
+} hot_inode_t;
+
+#define HOT_INODES_PER_SECTOR (SECTOR_SIZE/sizeof(hot_inode_t))
+#define HOT_INODE_SECTORS ((MAX_FILES+HOT_INODES_PER_SECTOR-1)/HOT_INODES_PER_SECTOR)
+
 // other file related definitions
 
 // max length of a path is 256 bytes (including the ending null)
@@ -101,14 +180,294 @@ typedef struct _dirent {
 // the number of directory entries that can be contained in a sector
 #define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
 
-// global errno value here
-int osErrno;
+// the geometry is fixed when the libraries are built, so all of the
+// above are constants; those that index sectors on every inode or
+// path index access are powers of two for any SECTOR_SIZE that is, so
+// that the divisions and remainders by them are shifts and masks
+#define IS_POWER_OF_2(n) ((n) > 0 && ((n) & ((n)-1)) == 0)
+_Static_assert(IS_POWER_OF_2(SECTOR_SIZE), "SECTOR_SIZE must be a power of 2");
+_Static_assert(IS_POWER_OF_2(INODES_PER_SECTOR), "inode_t must be a power of 2");
+_Static_assert(IS_POWER_OF_2(HOT_INODES_PER_SECTOR), "hot_inode_t must be a power of 2");
+_Static_assert(IS_POWER_OF_2(PATHINDEX_ENTRIES_PER_SECTOR) && IS_POWER_OF_2(PATHINDEX_SLOTS) &&
+	       PATHINDEX_SLOTS >= PATHINDEX_ENTRIES_PER_SECTOR, "bad path index geometry");
+
+// with FEATURE_VARDIRENTS, directory entries are packed instead: each
+// takes only the room its name needs, so more entries with short
+// names fit in a sector, and names can be longer (less than 64
+// bytes); each dirent sector starts with a header followed by the
+// entries, and the sectors of a directory are the leading non-zero
+// entries of its data[] (a sector that becomes empty is given back)
+#define MAX_LONG_NAME 64
+
+typedef struct _vardir_header {
+  unsigned short count; // number of entries in the sector
+  unsigned short used;  // bytes in use, header included
+} vardir_header_t;
+
+typedef struct __attribute__((packed)) _vardirent {
+  int inode;          // inode of the file
+  unsigned char len;  // length of the name
+  unsigned char tag;  // a hash of the name, checked before the name
+  char fname[];       // the name (without the ending null)
+} vardirent_t;
+
+#define VARDIRENT_SIZE(len) (sizeof(vardirent_t)+(len))
+
+// global errno value here (one per thread)
+__thread int osErrno;
 
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
+// the log kept next to the backstore file ('<backstore>.log'); with
+// FS_LOGGED, FS_Sync() appends the changed sectors to it rather than
+// rewrite the backstore, and folds it into the backstore once it's
+// bigger than LOG_CLEAN_SIZE
+static char log_filename[1030];
+static int fs_logged;
+
+// the log holds changes that only the process writing it knows about,
+// so that process (mounted with FS_LOGGED) holds a lock on the log
+// file for as long as it's mounted, and any other process holds it
+// while folding the log into the backstore; a process that can't have
+// it right away doesn't mount
+static int log_lock_fd = -1;
+#define LOG_CLEAN_SIZE (TOTAL_SECTORS*SECTOR_SIZE/2)
+
+// the size of each file when File_Sync() or File_DataSync() last made
+// its inode durable, or -1 if that isn't known
+static int synced_size[MAX_FILES];
+
+// the superblock of the mounted file system
+static superblock_t sb;
+
+// set when the file system is mounted read-only (e.g., from an archive)
+static int fs_readonly;
+
+// set when the image file is used in place (FS_SHARED, and FS_RDONLY,
+// whose image the FS_SHARED mounts of other processes change)
+static int fs_inplace;
+
+// when mounted with FS_SHARED, all processes work on the same mapped
+// image and coordinate through these locks, which live in a small
+// file next to the image ('<image>.lock') that every process maps;
+// the locks are robust, so a process dying while holding one doesn't
+// block the others forever; they also count the open files of each
+// inode, over all processes, so that none is unlinked while another
+// process has it open
+#define LOCKS_MAGIC 0x10c4f11e
+typedef struct _shared_locks {
+  int magic;              // set once the locks are initialized
+  pthread_mutex_t fs;     // the bitmaps and all directories
+  pthread_mutex_t inode[MAX_FILES]; // the content of each file
+  int opens[MAX_FILES];   // the open files of each inode
+} shared_locks_t;
+static shared_locks_t* locks; // NULL unless mounted with FS_SHARED
+static pid_t locks_pid;       // the process that mapped them
+
+// the lock file stays open while mounted with FS_SHARED, with a read
+// lock (fcntl(), apart from the flock() taken to set up the mount) on
+// its first byte, so that a process can tell whether it's the only
+// one with the file system mounted
+static int shared_lock_fd = -1;
+
+// without FS_SHARED, the same locks keep the threads of this process
+// apart, only they're not shared
+static shared_locks_t local_locks;
+static pthread_once_t local_locks_once = PTHREAD_ONCE_INIT;
+
 /* the following functions are internal helper functions */
 
+// scratch buffers (sectors, paths) come from a per-thread arena rather
+// than the stack, so they can be as big as sectors get; SCRATCH(name,
+// size) declares 'char* name' and hands it back when it goes out of
+// scope, so the arena is a stack of the buffers of the calls under
+// way, and it's empty again once an API call returns; when it runs
+// out, the buffer is malloc'ed instead and the arena is made as big as
+// it was needed the next time it's empty, so in the long run scratch
+// buffers cost no allocation; if there's no memory left for a buffer,
+// it's NULL and osErrno is E_GENERAL, so every SCRATCH() is checked
+#define SCRATCH_ALIGN 64 // the cache line size
+#define SCRATCH_INITIAL (16*SECTOR_SIZE)
+
+typedef struct _scratch_arena {
+  char* base;
+  size_t size, top;
+  size_t needed; // the most that was in use at once
+} scratch_arena_t;
+
+static __thread scratch_arena_t* arena;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void free_arena(void* p)
+{
+  scratch_arena_t* a = p;
+  free(a->base);
+  free(a);
+}
+
+static void make_arena_key()
+{
+  pthread_key_create(&arena_key, free_arena);
+}
+
+static char* scratch_push(size_t size)
+{
+  scratch_arena_t* a = arena;
+  if(!a) {
+    pthread_once(&arena_once, make_arena_key);
+    a = calloc(1, sizeof(scratch_arena_t));
+    if(!a) {
+      osErrno = E_GENERAL;
+      return NULL;
+    }
+    arena = a;
+    pthread_setspecific(arena_key, a);
+  }
+  size = (size+SCRATCH_ALIGN-1) & ~(size_t)(SCRATCH_ALIGN-1);
+  if(a->top == 0 && a->needed > a->size) {
+    // it ran out last time; it's not in use, so it can grow now
+    free(a->base);
+    a->size = a->needed > SCRATCH_INITIAL ? a->needed : SCRATCH_INITIAL;
+    a->base = aligned_alloc(SCRATCH_ALIGN, a->size);
+    if(!a->base) a->size = 0;
+  }
+  if(a->needed < a->top+size) a->needed = a->top+size;
+  if(a->top+size > a->size) {
+    char* p = aligned_alloc(SCRATCH_ALIGN, size);
+    if(!p) osErrno = E_GENERAL;
+    return p;
+  }
+  char* p = a->base+a->top;
+  a->top += size;
+  return p;
+}
+
+// give back the buffer at '*p' and all the ones pushed after it
+static void scratch_pop(char** p)
+{
+  scratch_arena_t* a = arena;
+  if(a && a->base <= *p && *p < a->base+a->size) a->top = *p-a->base;
+  else free(*p);
+}
+
+#define SCRATCH(name, size) \
+  char* name __attribute__((cleanup(scratch_pop))) = scratch_push(size)
+
+// objects that come and go often (Bloom filters, directory views) are
+// kept in pools instead of being given back to malloc: a pool has a
+// list of free objects shared by all threads (the depot), and each
+// thread keeps a few free objects of its own, so that getting one and
+// putting one back takes no lock and mostly reuses memory that's still
+// in the cache; new objects are carved from slabs that are never freed
+#define POOL_SLAB_SIZE 65536 // bytes per slab (at least one object)
+#define POOL_CACHE_MAX 32 // free objects a thread keeps to itself
+#define MAX_POOLS 4
+
+typedef struct _pool_object {
+  struct _pool_object* next;
+} pool_object_t;
+
+typedef struct _pool {
+  int id;      // of its cache in each thread
+  size_t size; // of its objects
+  pthread_mutex_t lock;
+  pool_object_t* depot;
+} pool_t;
+
+#define POOL_INITIALIZER(id, type) \
+  { id, (sizeof(type)+SCRATCH_ALIGN-1) & ~(size_t)(SCRATCH_ALIGN-1), \
+    PTHREAD_MUTEX_INITIALIZER, NULL }
+
+typedef struct _pool_cache {
+  pool_t* pool;
+  pool_object_t* free;
+  int count;
+} pool_cache_t;
+
+static __thread pool_cache_t pool_caches[MAX_POOLS];
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// move 'n' objects from the cache of this thread to the depot
+static void pool_spill(pool_cache_t* c, int n)
+{
+  if(n <= 0) return;
+  pool_object_t *first = c->free, *last = first;
+  for(int i=1; i<n; i++) last = last->next;
+  c->free = last->next;
+  c->count -= n;
+  pthread_mutex_lock(&c->pool->lock);
+  last->next = c->pool->depot;
+  c->pool->depot = first;
+  pthread_mutex_unlock(&c->pool->lock);
+}
+
+// a thread that exits leaves its free objects to the others
+static void pool_thread_exit(void* p)
+{
+  for(int i=0; i<MAX_POOLS; i++)
+    if(pool_caches[i].pool) pool_spill(&pool_caches[i], pool_caches[i].count);
+}
+
+static void make_pool_key()
+{
+  pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+// the cache of this thread for 'pool'
+static pool_cache_t* pool_cache(pool_t* pool)
+{
+  pool_cache_t* c = &pool_caches[pool->id];
+  if(!c->pool) {
+    pthread_once(&pool_once, make_pool_key);
+    pthread_setspecific(pool_key, pool_caches);
+    c->pool = pool;
+  }
+  return c;
+}
+
+// an object from 'pool' (not cleared); NULL if out of memory
+static void* pool_get(pool_t* pool)
+{
+  pool_cache_t* c = pool_cache(pool);
+  if(!c->free) {
+    // take what the depot has, or a new slab
+    pthread_mutex_lock(&pool->lock);
+    c->free = pool->depot;
+    pool->depot = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    c->count = 0;
+    for(pool_object_t* o = c->free; o; o = o->next) c->count++;
+    if(!c->free) {
+      int n = POOL_SLAB_SIZE/pool->size > 0 ? POOL_SLAB_SIZE/pool->size : 1;
+      char* slab = aligned_alloc(SCRATCH_ALIGN, n*pool->size);
+      if(!slab) return NULL;
+      for(int i=n-1; i>=0; i--) {
+	pool_object_t* o = (pool_object_t*)(slab+i*pool->size);
+	o->next = c->free;
+	c->free = o;
+      }
+      c->count = n;
+    }
+  }
+  pool_object_t* o = c->free;
+  c->free = o->next;
+  c->count--;
+  return o;
+}
+
+static void pool_put(pool_t* pool, void* p)
+{
+  if(!p) return;
+  pool_cache_t* c = pool_cache(pool);
+  pool_object_t* o = p;
+  o->next = c->free;
+  c->free = o;
+  if(++c->count > POOL_CACHE_MAX) pool_spill(c, c->count-POOL_CACHE_MAX/2);
+}
+
 int signum(int n) {
   if (n == 0) {
     return(0);
@@ -119,67 +478,85 @@ int signum(int n) {
   }
 }
 
-// check magic number in the superblock; return 1 if OK, and 0 if not
+// the checksum of a superblock (FNV-1a over the fields before it)
+static unsigned int sb_checksum(superblock_t* super)
+{
+  unsigned int h = 0x811c9dc5;
+  unsigned char* p = (unsigned char*)super;
+  for(int i=0; i<offsetof(superblock_t, checksum); i++)
+    h = (h ^ p[i])*0x01000193;
+  return h;
+}
+
+// read the copy of the superblock in 'sector'; return 1 if it's a
+// whole checkpoint, 2 if it's from before there were checkpoints (and
+// can only be in the first sector), and 0 if it's neither
+static int read_superblock(int sector, superblock_t* super)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return 0;
+  if(Disk_Read(sector, buf) < 0) return 0;
+  memcpy(super, buf, sizeof(superblock_t));
+  if(super->magic != OS_MAGIC) return 0;
+  if(!(super->features & FEATURE_CHECKPOINTS))
+    return sector == SUPERBLOCK_START_SECTOR && super->sequence == 0 &&
+      super->checksum == 0 ? 2 : 0;
+  return super->checksum == sb_checksum(super);
+}
+
+// check magic number in the superblock, and keep a copy of the
+// superblock (the latest of the two, see FEATURE_CHECKPOINTS); return
+// 1 if OK, and 0 if not
 static int check_magic()
 {
-  char buf[SECTOR_SIZE];
-  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
-    return 0;
-  if(*(int*)buf == OS_MAGIC) return 1;
-  else return 0;
+  superblock_t shadow;
+  memset(&sb, 0, sizeof(sb));
+  int ok = read_superblock(SUPERBLOCK_START_SECTOR, &sb);
+  if(read_superblock(SHADOW_SUPERBLOCK_SECTOR, &shadow) == 1 &&
+     (ok != 1 || shadow.sequence > sb.sequence)) {
+    memcpy(&sb, &shadow, sizeof(sb));
+    ok = 1;
+  }
+  if(ok && (SB_SECTOR_SIZE(&sb) != SECTOR_SIZE ||
+	    (sb.pathindex_sectors && sb.pathindex_sectors != PATHINDEX_SECTORS))) {
+    dprintf("... formatted with %d-byte sectors, not %d\n", SB_SECTOR_SIZE(&sb), SECTOR_SIZE);
+    ok = 0;
+  }
+  if(!ok) memset(&sb, 0, sizeof(sb));
+  dprintf("... superblock checkpoint %d (sector %d)\n", sb.sequence,
+	  SUPERBLOCK_SECTOR(sb.sequence));
+  return ok;
 }
 
 // initialize a bitmap with 'num' sectors starting from 'start'
 // sector; all bits should be set to zero except that the first
-// 'nbits' number of bits are set to one
-static void bitmap_init(int start, int num, int nbits)
+// 'nbits' number of bits are set to one; return 0 if successful, -1
+// otherwise
+static int bitmap_init(int start, int num, int nbits)
 {
   /* YOUR CODE  - Maurely Acosta*/
   dprintf("Creating a bitmap starting at sector %d, %d sectors long, %d bits are set to one\n", start, num, nbits);
 
-  char bitmap_buf[SECTOR_SIZE];    //chars are size 1
-
-  int sectors_set_to_one = nbits / 8 / SECTOR_SIZE; //number of sectors that are all 1
-  int remaining_bytes = nbits / 8 % SECTOR_SIZE; //number of bytes on first sector after sectors_set_to_one
-  int sectors_set_to_zero = num - sectors_set_to_one - signum(remaining_bytes); //number of sectors that are all 0
-
-  //all full sectors
-  for (int i = 0; i < SECTOR_SIZE; i++) {
-    bitmap_buf[i] = 0xff;
-  }
-  for (int i = start; i < start + sectors_set_to_one; i++) {
-    Disk_Write(i, bitmap_buf);
-  }
-
+  SCRATCH(bitmap_buf, SECTOR_SIZE);    //chars are size 1
+  if(!bitmap_buf) return -1;
   unsigned char bits[8] = { 0x0, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
-  //partial sector
-  int remaining = nbits % 8;
-  dprintf("Writting partial byte %x\n", bits[remaining]);
-
-  bitmap_buf[remaining_bytes] = bits[remaining];
-  for (int i = remaining_bytes + 1; i < SECTOR_SIZE; i++) {
-    bitmap_buf[i] = 0;
-  }
-  Disk_Write(start + sectors_set_to_one, bitmap_buf);
-
 
-  // Write sectors to 0
-  for (int i = 0; i < remaining_bytes; i++) {
-    bitmap_buf[i] = 0;
-  }
-  int end_of_sector = start + sectors_set_to_one + 1 + sectors_set_to_zero;
-  for (int i = start + sectors_set_to_one + 1; i < end_of_sector; i++) {
-    Disk_Write(i, bitmap_buf);
+  for (int i = 0; i < num; i++) {
+    // number of bits of this sector that must be set to one
+    int ones = nbits - i * SECTOR_SIZE * 8;
+    if (ones < 0) ones = 0;
+    if (ones > SECTOR_SIZE * 8) ones = SECTOR_SIZE * 8;
+
+    //full bytes, then the partial byte, then all zeros
+    memset(bitmap_buf, 0xff, ones / 8);
+    memset(bitmap_buf + ones / 8, 0, SECTOR_SIZE - ones / 8);
+    if (ones % 8) {
+      dprintf("Writting partial byte %x\n", bits[ones % 8]);
+      bitmap_buf[ones / 8] = bits[ones % 8];
+    }
+    if(Disk_Write(start + i, bitmap_buf) < 0) return -1;
   }
-
-}
-
-/*find if a specific bit is set inside a byte
-Return 1 if the bit is set in this position or 0 otherwise
-*/
-static int isBitSet (unsigned char c, int n) {
-    static unsigned char mask[] = {128, 64, 32, 16, 8, 4, 2, 1};
-    return ((c & mask[n]) != 0);
+  return 0;
 }
 
 /* Set a specific bit inside a byte
@@ -195,72 +572,31 @@ static char setBit (unsigned char c, int n) {
 // return -1 if the bitmap is already full (no more zeros)
 static int bitmap_first_unused(int start, int num, int nbits)
 {
-  int bytes_set_to_one = nbits / 8;           // Number of bytes to set to 1
-  int remaining_bits = nbits % 8;             // Remainder bits after the last byte set to 1
-  int last_block = 0;                        // am I in the last byte?
-  char bitmap_buf[SECTOR_SIZE];              //Buffer sector
-  int location = -1;
+  SCRATCH(bitmap_buf, SECTOR_SIZE);              //Buffer sector
+  if(!bitmap_buf) return -1;
 
   int i;
-  for(i = start; i < (start + num); i++){     //  Check all bytes of each sector
+  for(i = 0; i < num; i++){     //  Check the bits held by each sector
+    int sector_bits = nbits - i * SECTOR_SIZE * 8;
+    if(sector_bits <= 0) break;
+    if(sector_bits > SECTOR_SIZE * 8) sector_bits = SECTOR_SIZE * 8;
 
-    if(bytes_set_to_one < SECTOR_SIZE){ //if the last sector
-      last_block = 1;
-    }
-
-    if(Disk_Read(i, bitmap_buf) < 0){ // Read the sector
-      dprintf("Oops, failed reading the block %d\n" , i);
+    if(Disk_Read(start + i, bitmap_buf) < 0){ // Read the sector
+      dprintf("Oops, failed reading the block %d\n" , start + i);
       osErrno = E_GENERAL;
       return -1;
     }
 
-    int a_byte;
-    int bit;
-    int limit;
-
-    if(last_block == 1){ // Is this the last sector?
-      limit = bytes_set_to_one;
-    }else{ //Else check more than one sector
-      limit = SECTOR_SIZE;
-    }
-
-    for(a_byte = 0; a_byte < limit; a_byte++){ //Check each byte in each sector
-      for(bit = 0; bit < 8; bit++){  //Checking each bit inside this byte
-        location++;
-        if(!isBitSet(bitmap_buf[a_byte], bit)){
+    int bit = Simd_FirstZeroBit(bitmap_buf, sector_bits);
+    if(bit < 0) continue; // this sector is full
 
-          bitmap_buf[a_byte] = setBit(bitmap_buf[a_byte], bit);
-
-          if(Disk_Write(i, bitmap_buf) < 0) { //Write the sector back
-            dprintf("Oops, failed writting the block %d\n" , i);
-            osErrno = E_GENERAL;
-            return -1;
-          }
-          return location;
-        }
-
-      }
-    }
-
-
-    //Do a last check
-    //check the last bits in the last incompleted byte
-    if(last_block == 1){
-      for(bit = 0; bit < remaining_bits ; bit++){  //Check the remaining bits in this byte
-        location ++;
-        if(!isBitSet(bitmap_buf[a_byte], bit)){
-           bitmap_buf[a_byte] = setBit(bitmap_buf[a_byte], bit); //Set this bit
-
-          if(Disk_Write(i, bitmap_buf) < 0) { //Write the sector back
-            dprintf("Oops, failed writting the block %d\n" , i);
-            osErrno = E_GENERAL;
-            return -1;
-          }
-          return location;
-        }
-      }
+    bitmap_buf[bit / 8] = setBit(bitmap_buf[bit / 8], bit % 8);
+    if(Disk_Write(start + i, bitmap_buf) < 0) { //Write the sector back
+      dprintf("Oops, failed writting the block %d\n" , start + i);
+      osErrno = E_GENERAL;
+      return -1;
     }
-
+    return i * SECTOR_SIZE * 8 + bit;
   }
   return -1;
 }
@@ -272,7 +608,8 @@ static int bitmap_reset(int start, int num, int ibit)
   /* YOUR CODE  Maurely Acosta*/
   int number_bytes = ibit/8; // completed bytes before the one containing the reset bit
   int remaining_bits = ibit % 8; // location of the bit to reset within the last byte
-  char bitmap_buf[SECTOR_SIZE];
+  SCRATCH(bitmap_buf, SECTOR_SIZE);
+  if(!bitmap_buf) return -1;
 
     if(number_bytes > SECTOR_SIZE*num){
       //incorrect number of ibit because greater than the sector size.
@@ -302,14 +639,196 @@ static int bitmap_reset(int start, int num, int ibit)
   return 0;
 }
 
+// set the i-th bit of a bitmap starting from 'start' sector; return 0
+// if successful, -1 otherwise
+static int bitmap_set(int start, int ibit)
+{
+  SCRATCH(bitmap_buf, SECTOR_SIZE);
+  if(!bitmap_buf) return -1;
+  int sector = start+ibit/(SECTOR_SIZE*8);
+  int byte = (ibit/8)%SECTOR_SIZE;
+  if(Disk_Read(sector, bitmap_buf) < 0) return -1;
+  bitmap_buf[byte] = setBit(bitmap_buf[byte], ibit%8);
+  return Disk_Write(sector, bitmap_buf);
+}
+
+// same as bitmap_first_unused(), but take the first unused bit at or
+// after 'goal' if there is one (and the lowest one otherwise), so that
+// related things end up close together; a negative 'goal' is none
+static int bitmap_unused_near(int start, int num, int nbits, int goal)
+{
+  if(goal < 0 || goal >= nbits) return bitmap_first_unused(start, num, nbits);
+
+  SCRATCH(bitmap_buf, SECTOR_SIZE);
+  if(!bitmap_buf) return -1;
+  for(int i = goal/(SECTOR_SIZE*8); i < num; i++) {
+    int sector_bits = nbits - i * SECTOR_SIZE * 8;
+    if(sector_bits <= 0) break;
+    if(sector_bits > SECTOR_SIZE * 8) sector_bits = SECTOR_SIZE * 8;
+
+    if(Disk_Read(start + i, bitmap_buf) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+
+    // the bits up to the next byte boundary one at a time, then the
+    // rest of the sector in bulk
+    int from = goal - i * SECTOR_SIZE * 8;
+    if(from < 0) from = 0;
+    int bit = -1;
+    for(; from % 8 && from < sector_bits; from++)
+      if(!(bitmap_buf[from / 8] & (0x80 >> (from % 8)))) { bit = from; break; }
+    if(bit < 0 && from < sector_bits) {
+      bit = Simd_FirstZeroBit(bitmap_buf + from / 8, sector_bits - from);
+      if(bit >= 0) bit += from;
+    }
+    if(bit < 0) continue;
+
+    bitmap_buf[bit / 8] = setBit(bitmap_buf[bit / 8], bit % 8);
+    if(Disk_Write(start + i, bitmap_buf) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    return i * SECTOR_SIZE * 8 + bit;
+  }
+  return bitmap_first_unused(start, num, nbits);
+}
+
+// how new inodes and sectors are picked (see FS_AllocPolicy())
+static int alloc_policy = FS_ALLOC_FIRST;
+
+// allocation groups, in the spirit of FFS cylinder groups: the inodes
+// and the data sectors handed out by the bitmaps (the first
+// INODE_BITMAP_SIZE and SECTOR_BITMAP_SIZE bits of them, see
+// add_inode()) are split evenly into ALLOC_GROUPS groups, and the data
+// of an inode goes to the group matching its own
+#define ALLOC_GROUPS 8
+#define INODE_GROUP(inode) ((inode)*ALLOC_GROUPS/INODE_BITMAP_SIZE)
+#define GROUP_FIRST_INODE(group) (((group)*INODE_BITMAP_SIZE+ALLOC_GROUPS-1)/ALLOC_GROUPS)
+#define GROUP_FIRST_SECTOR(group) \
+  (DATABLOCK_START_SECTOR+(group)*(SECTOR_BITMAP_SIZE-DATABLOCK_START_SECTOR)/ALLOC_GROUPS)
+
+// return the number of unused bits from bit 'from' up to (but not
+// including) bit 'to' of a bitmap sector
+static int count_unused(const char* bitmap_buf, int from, int to)
+{
+  int n = 0, bit = from;
+  for(; bit < to && bit % 8; bit++)
+    if(!(bitmap_buf[bit / 8] & (0x80 >> (bit % 8)))) n++;
+  // the whole bytes in between at once
+  int bytes = (to - bit) / 8;
+  if(bytes > 0) {
+    n += bytes * 8 - Simd_Popcount(bitmap_buf + bit / 8, bytes);
+    bit += bytes * 8;
+  }
+  for(; bit < to; bit++)
+    if(!(bitmap_buf[bit / 8] & (0x80 >> (bit % 8)))) n++;
+  return n;
+}
+
+// pick the allocation group of a new top-level directory the way
+// Orlov's allocator does: the one with the most free inodes among
+// those with at least the average number of free sectors (rounded
+// down, as the groups differ in size by a sector), so that
+// top-level subtrees spread out and each has room to grow; return -1
+// if the bitmaps can't be read (the bits handed out all sit in the
+// first sector of either bitmap)
+static int orlov_group()
+{
+  SCRATCH(inodes, SECTOR_SIZE);
+  SCRATCH(sectors, SECTOR_SIZE);
+  if(!inodes || !sectors) return -1;
+  if(Disk_Read(INODE_BITMAP_START_SECTOR, inodes) < 0 ||
+     Disk_Read(SECTOR_BITMAP_START_SECTOR, sectors) < 0) return -1;
+
+  int free_inodes[ALLOC_GROUPS], free_sectors[ALLOC_GROUPS], total = 0;
+  for(int g = 0; g < ALLOC_GROUPS; g++) {
+    free_inodes[g] = count_unused(inodes, GROUP_FIRST_INODE(g), GROUP_FIRST_INODE(g+1));
+    free_sectors[g] = count_unused(sectors, GROUP_FIRST_SECTOR(g), GROUP_FIRST_SECTOR(g+1));
+    total += free_sectors[g];
+  }
+  int best = -1;
+  for(int g = 0; g < ALLOC_GROUPS; g++)
+    if(free_sectors[g] >= total/ALLOC_GROUPS && (best < 0 || free_inodes[g] > free_inodes[best]))
+      best = g;
+  dprintf("... orlov: group %d for a new top-level directory\n", best);
+  return best;
+}
+
+// get a new inode for a child of 'parent' of the given 'type'; return
+// -1 if there's none
+static int alloc_inode(int parent, int type)
+{
+  int goal = -1;
+  if(alloc_policy == FS_ALLOC_ORLOV && parent == 0 && type == 1) {
+    int group = orlov_group();
+    if(group >= 0) goal = GROUP_FIRST_INODE(group);
+  }
+  else if(alloc_policy != FS_ALLOC_FIRST) goal = parent+1;
+  return bitmap_unused_near(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE, goal);
+}
+
+// get a new sector for 'inode', to be its data sector 'n' (where
+// 'data' holds the ones it has so far); return -1 if there's none
+static int alloc_sector(int inode, int* data, int n)
+{
+  int goal = -1;
+  if(alloc_policy != FS_ALLOC_FIRST) {
+    // right after the previous sector, or in the inode's own group
+    goal = n > 0 && data[n-1] > 0 ? data[n-1]+1 : GROUP_FIRST_SECTOR(INODE_GROUP(inode));
+  }
+  return bitmap_unused_near(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE, goal);
+}
+
+// write a sector of the inode table (in 'buffer') to disk, and copy
+// the attributes of its inodes to the hot inode table if there's one;
+// return 0 if successful, -1 otherwise
+static int write_inodes(int sector, char* buffer)
+{
+  if(Disk_Write(sector, buffer) < 0) return -1;
+  if(!(sb.features & FEATURE_HOTINODES)) return 0;
+
+  int first = (sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+  int hot_sector = sb.hotinode_start+first/HOT_INODES_PER_SECTOR;
+  SCRATCH(hot_buffer, SECTOR_SIZE);
+  if(!hot_buffer) return -1;
+  if(Disk_Read(hot_sector, hot_buffer) < 0) return -1;
+  hot_inode_t* hot = (hot_inode_t*)hot_buffer+first%HOT_INODES_PER_SECTOR;
+  for(int i=0; i<INODES_PER_SECTOR; i++) {
+    hot[i].size = ((inode_t*)buffer)[i].size;
+    hot[i].type = ((inode_t*)buffer)[i].type;
+  }
+  return Disk_Write(hot_sector, hot_buffer);
+}
+
+// load the attributes of 'inode' into 'hot', from the hot inode table
+// if there's one; return 0 if successful, -1 otherwise
+static int load_hot_inode(int inode, hot_inode_t* hot)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  if(sb.features & FEATURE_HOTINODES) {
+    if(Disk_Read(sb.hotinode_start+inode/HOT_INODES_PER_SECTOR, buf) < 0) return -1;
+    *hot = ((hot_inode_t*)buf)[inode%HOT_INODES_PER_SECTOR];
+  } else {
+    if(Disk_Read(INODE_TABLE_START_SECTOR+inode/INODES_PER_SECTOR, buf) < 0) return -1;
+    inode_t* full = (inode_t*)buf+inode%INODES_PER_SECTOR;
+    hot->size = full->size;
+    hot->type = full->type;
+  }
+  return 0;
+}
+
 // return 1 if the file name is illegal; otherwise, return 0; legal
 // characters for a file name include letters (case sensitive),
 // numbers, dots, dashes, and underscores; and a legal file name
-// should not be more than MAX_NAME-1 in length
+// should not be more than MAX_NAME-1 in length (MAX_LONG_NAME-1 with
+// packed dirents)
 static int illegal_filename(char* name)
 {
   /* YOUR CODE Maurely Acosta*/
-  if(strlen(name) > MAX_NAME - 1){
+  int max_name = (sb.features & FEATURE_VARDIRENTS) ? MAX_LONG_NAME : MAX_NAME;
+  if(strlen(name) > max_name - 1){
     printf("ERROR: The file name is too long.\n");
     return 1;
   }else{
@@ -323,6 +842,258 @@ static int illegal_filename(char* name)
   return 0;
 }
 
+// the one-byte hash of a name kept in its packed dirent
+static unsigned char vardirent_tag(char* name, int len)
+{
+  unsigned char tag = 0;
+  for(int i=0; i<len; i++) tag = tag*31+(unsigned char)name[i];
+  return tag;
+}
+
+// return the offset of the entry of 'name' in a sector of packed
+// dirents, or -1 if there's none
+static int vardir_find_name(char* buf, char* name, int len, unsigned char tag)
+{
+  vardir_header_t* header = (vardir_header_t*)buf;
+  int off = sizeof(vardir_header_t);
+  for(int i=0; i<header->count; i++) {
+    vardirent_t* e = (vardirent_t*)(buf+off);
+    if(e->len == len && e->tag == tag && !memcmp(e->fname, name, len)) return off;
+    off += VARDIRENT_SIZE(e->len);
+  }
+  return -1;
+}
+
+// return the offset of the entry of 'inode' in a sector of packed
+// dirents, or -1 if there's none
+static int vardir_find_inode(char* buf, int inode)
+{
+  vardir_header_t* header = (vardir_header_t*)buf;
+  int off = sizeof(vardir_header_t);
+  for(int i=0; i<header->count; i++) {
+    vardirent_t* e = (vardirent_t*)(buf+off);
+    if(e->inode == inode) return off;
+    off += VARDIRENT_SIZE(e->len);
+  }
+  return -1;
+}
+
+// return the inode of 'name' in the directory 'parent' with packed
+// dirents, -1 if it's not there, or -2 on error
+static int vardir_find(inode_t* parent, char* name)
+{
+  int len = strlen(name);
+  unsigned char tag = vardirent_tag(name, len);
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -2;
+  for(int i=0; i<MAX_SECTORS_PER_FILE && parent->data[i]; i++) {
+    if(Disk_Read(parent->data[i], buf) < 0) return -2;
+    int off = vardir_find_name(buf, name, len, tag);
+    if(off >= 0) return ((vardirent_t*)(buf+off))->inode;
+  }
+  return -1;
+}
+
+// add the packed dirent of 'name' to the directory 'parent', in the
+// first sector with room for it or in a new sector; the caller writes
+// the parent inode (number 'parent_inode') back; return 0 if
+// successful, -1 otherwise
+static int vardir_add(inode_t* parent, int parent_inode, char* name, int inode)
+{
+  int len = strlen(name);
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  vardir_header_t* header = (vardir_header_t*)buf;
+  int i;
+  for(i=0; i<MAX_SECTORS_PER_FILE && parent->data[i]; i++) {
+    if(Disk_Read(parent->data[i], buf) < 0) return -1;
+    if(header->used+VARDIRENT_SIZE(len) <= SECTOR_SIZE) break;
+  }
+  if(i == MAX_SECTORS_PER_FILE) {
+    dprintf("... error: directory is full\n");
+    return -1;
+  }
+  if(!parent->data[i]) {
+    int newsec = alloc_sector(parent_inode, parent->data, i);
+    if(newsec < 0) {
+      dprintf("... error: disk is full\n");
+      return -1;
+    }
+    parent->data[i] = newsec;
+    memset(buf, 0, SECTOR_SIZE);
+    header->used = sizeof(vardir_header_t);
+    dprintf("... new disk sector %d for dirent group %d\n", newsec, i);
+  }
+
+  vardirent_t* e = (vardirent_t*)(buf+header->used);
+  e->inode = inode;
+  e->len = len;
+  e->tag = vardirent_tag(name, len);
+  memcpy(e->fname, name, len);
+  header->count++;
+  header->used += VARDIRENT_SIZE(len);
+  dprintf("... append dirent (name='%s', inode=%d) to group %d, update disk sector %d\n",
+	  name, inode, i, parent->data[i]);
+  return Disk_Write(parent->data[i], buf);
+}
+
+// take the packed dirent of 'inode' out of the directory 'parent';
+// the caller writes the parent inode back; return 0 if successful,
+// -1 otherwise
+static int vardir_remove(inode_t* parent, int inode)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  vardir_header_t* header = (vardir_header_t*)buf;
+  for(int i=0; i<MAX_SECTORS_PER_FILE && parent->data[i]; i++) {
+    if(Disk_Read(parent->data[i], buf) < 0) return -1;
+    int off = vardir_find_inode(buf, inode);
+    if(off < 0) continue;
+
+    int size = VARDIRENT_SIZE(((vardirent_t*)(buf+off))->len);
+    memmove(buf+off, buf+off+size, header->used-off-size);
+    header->used -= size;
+    header->count--;
+    if(header->count > 0) return Disk_Write(parent->data[i], buf);
+
+    // the sector is empty: give it back
+    dprintf("... free disk sector %d of dirent group %d\n", parent->data[i], i);
+    bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, parent->data[i]);
+    memmove(&parent->data[i], &parent->data[i+1], (MAX_SECTORS_PER_FILE-i-1)*sizeof(int));
+    parent->data[MAX_SECTORS_PER_FILE-1] = 0;
+    return 0;
+  }
+  return -1;
+}
+
+// copy the entries of the directory 'dir' to 'buffer', as an array
+// of dirent_t; return 0 if successful, -1 on a read error, and -2 if
+// a packed dirent has a name too long for a dirent_t (which can only
+// be seen through a view, see Dir_ReadView())
+static int copy_dirents(inode_t* dir, char* buffer)
+{
+  SCRATCH(sec_buf, SECTOR_SIZE);
+  if(!sec_buf) return -1;
+  if(!(sb.features & FEATURE_VARDIRENTS)) {
+    for(int i=0, left=dir->size; left>0; i++, left-=DIRENTS_PER_SECTOR) {
+      int n = left < DIRENTS_PER_SECTOR ? left : DIRENTS_PER_SECTOR;
+      if(Disk_Read(dir->data[i], sec_buf) < 0) return -1;
+      memcpy(buffer+i*DIRENTS_PER_SECTOR*sizeof(dirent_t), sec_buf, n*sizeof(dirent_t));
+    }
+    return 0;
+  }
+
+  dirent_t* out = (dirent_t*)buffer;
+  memset(buffer, 0, dir->size*sizeof(dirent_t)); // pads the names
+  for(int i=0; i<MAX_SECTORS_PER_FILE && dir->data[i]; i++) {
+    if(Disk_Read(dir->data[i], sec_buf) < 0) return -1;
+    int off = sizeof(vardir_header_t);
+    for(int k=0; k<((vardir_header_t*)sec_buf)->count; k++, out++) {
+      vardirent_t* e = (vardirent_t*)(sec_buf+off);
+      if(e->len >= MAX_NAME) {
+	dprintf("... name of inode %d is too long for a dirent_t\n", e->inode);
+	return -2;
+      }
+      memcpy(out->fname, e->fname, e->len);
+      out->inode = e->inode;
+      off += VARDIRENT_SIZE(e->len);
+    }
+  }
+  return 0;
+}
+
+// each directory looked up has a Bloom filter of the names in it, kept
+// in memory, so that most names that aren't there are turned down
+// without reading its dirent sectors (which is what every create has
+// to make sure of); a filter is built from the dirents when first
+// needed, names are added to it as they're added to the directory,
+// and it is dropped when a name is removed (to be built again later);
+// the filters only know about this process's changes, so there are
+// none when the image is used in place (FS_SHARED, and FS_RDONLY,
+// whose image the FS_SHARED mounts of other processes change)
+#define BLOOM_BITS 4096 // bits per filter (a full directory is ~7% false positives)
+#define BLOOM_HASHES 4  // bits set per name
+typedef struct _bloom {
+  unsigned char bits[BLOOM_BITS/8];
+} bloom_t;
+static bloom_t* blooms[MAX_FILES]; // by directory inode; NULL if not built
+static pool_t bloom_pool = POOL_INITIALIZER(0, bloom_t);
+
+// set (or test, if 'test' is true) the bits of 'name' in filter 'b';
+// the bits come from the two halves of a 64-bit FNV-1a hash of the name
+static int bloom_bits(bloom_t* b, char* name, int test)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for(int i=0; i<MAX_LONG_NAME && name[i]; i++)
+    h = (h ^ (unsigned char)name[i])*0x100000001b3ULL;
+  unsigned int h1 = (unsigned int)h, h2 = (unsigned int)(h >> 32) | 1;
+  for(int i=0; i<BLOOM_HASHES; i++) {
+    unsigned int bit = (h1+i*h2)%BLOOM_BITS;
+    if(!test) b->bits[bit/8] |= 1 << (bit%8);
+    else if(!(b->bits[bit/8] & (1 << (bit%8)))) return 0;
+  }
+  return 1;
+}
+
+// return the filter of directory 'dir' (whose inode is 'parent'),
+// building it if needed, or NULL if there's none
+static bloom_t* bloom_get(int dir, inode_t* parent)
+{
+  if(fs_inplace) return NULL;
+  if(blooms[dir]) return blooms[dir];
+  bloom_t* b = pool_get(&bloom_pool);
+  if(!b) return NULL;
+  memset(b, 0, sizeof(bloom_t));
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) {
+    pool_put(&bloom_pool, b);
+    return NULL;
+  }
+  if(sb.features & FEATURE_VARDIRENTS) {
+    for(int i=0; i<MAX_SECTORS_PER_FILE && parent->data[i]; i++) {
+      if(Disk_Read(parent->data[i], buf) < 0) {
+	pool_put(&bloom_pool, b);
+	return NULL;
+      }
+      int off = sizeof(vardir_header_t);
+      for(int k=0; k<((vardir_header_t*)buf)->count; k++) {
+	vardirent_t* e = (vardirent_t*)(buf+off);
+	char name[MAX_LONG_NAME];
+	memcpy(name, e->fname, e->len);
+	name[e->len] = '\0';
+	bloom_bits(b, name, 0);
+	off += VARDIRENT_SIZE(e->len);
+      }
+    }
+  }
+  else for(int i=0, left=parent->size; left>0; i++, left-=DIRENTS_PER_SECTOR) {
+    if(Disk_Read(parent->data[i], buf) < 0) {
+      pool_put(&bloom_pool, b);
+      return NULL;
+    }
+    int n = left < DIRENTS_PER_SECTOR ? left : DIRENTS_PER_SECTOR;
+    for(int k=0; k<n; k++)
+      bloom_bits(b, ((dirent_t*)buf)[k].fname, 0);
+  }
+  dprintf("... built Bloom filter of directory %d (%d entries)\n", dir, parent->size);
+  blooms[dir] = b;
+  return b;
+}
+
+// the file 'name' was added to directory 'dir'
+static void bloom_add(int dir, char* name)
+{
+  if(blooms[dir]) bloom_bits(blooms[dir], name, 0);
+}
+
+// forget the filter of directory 'dir' (when a name is removed from
+// it, or the directory itself is)
+static void bloom_drop(int dir)
+{
+  pool_put(&bloom_pool, blooms[dir]);
+  blooms[dir] = NULL;
+}
+
 // return the child inode of the given file name 'fname' from the
 // parent inode; the parent inode is currently stored in the segment
 // of inode table in the cache (we cache only one disk sector for
@@ -345,32 +1116,333 @@ static int find_child_inode(int parent_inode, char* fname,
     return -2;
   }
 
-  int nentries = parent->size; // remaining number of directory entries
-  int idx = 0;
-  while(nentries > 0) {
-    char buf[SECTOR_SIZE]; // cached content of directory entries
-    if(Disk_Read(parent->data[idx], buf) < 0) return -2;
-    for(int i=0; i<DIRENTS_PER_SECTOR; i++) {
-      if(i>nentries) break;
-      if(!strcmp(((dirent_t*)buf)[i].fname, fname)) {
-	// found the file/directory; update inode cache
-	int child_inode = ((dirent_t*)buf)[i].inode;
-	dprintf("... found child_inode=%d\n", child_inode);
-	int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-	if(sector != (*cached_inode_sector)) {
-	  *cached_inode_sector = sector;
-	  if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-	  dprintf("... load inode table for child\n");
-	}
-	return child_inode;
+  // most names that aren't in the directory need no search
+  bloom_t* bloom = bloom_get(parent_inode, parent);
+  if(bloom && !bloom_bits(bloom, fname, 1)) {
+    dprintf("... Bloom filter: no '%s' in directory %d\n", fname, parent_inode);
+    return -1;
+  }
+
+  int child_inode = -1;
+  if(sb.features & FEATURE_VARDIRENTS) {
+    child_inode = vardir_find(parent, fname);
+    if(child_inode == -2) return -2;
+  } else {
+    // the name as stored in a dirent (padded with zeros by strncpy), so
+    // that entries can be matched on all MAX_NAME bytes at once
+    char key[MAX_NAME];
+    strncpy(key, fname, MAX_NAME);
+
+    int nentries = parent->size; // remaining number of directory entries
+    int idx = 0;
+    while(nentries > 0) {
+      SCRATCH(buf, SECTOR_SIZE); // cached content of directory entries
+      if(!buf) return -2;
+      if(Disk_Read(parent->data[idx], buf) < 0) return -2;
+      int n = nentries < DIRENTS_PER_SECTOR ? nentries : DIRENTS_PER_SECTOR;
+      int i = Simd_FindKey16(buf, sizeof(dirent_t), n, key);
+      if(i >= 0) {
+	child_inode = ((dirent_t*)buf)[i].inode;
+	break;
       }
+      idx++; nentries -= DIRENTS_PER_SECTOR;
+    }
+  }
+
+  if(child_inode >= 0) {
+    // found the file/directory; update inode cache
+    dprintf("... found child_inode=%d\n", child_inode);
+    int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
+    if(sector != (*cached_inode_sector)) {
+      *cached_inode_sector = sector;
+      if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
+      dprintf("... load inode table for child\n");
     }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
+    return child_inode;
   }
   dprintf("... could not find child inode\n");
   return -1; // not found
 }
 
+// the bits of a path hash that are kept; a build with fewer (e.g.
+// -DPATHINDEX_HASH_MASK=0x7) makes paths collide all the time, to
+// try out the checks against it
+#ifndef PATHINDEX_HASH_MASK
+#define PATHINDEX_HASH_MASK (~0ULL)
+#endif
+
+// extend the hash of the path of a directory to the path of the file
+// 'name' in it (FNV-1a over '/' and the name), so that the hash of a
+// path is built one component at a time
+static unsigned long long path_hash(unsigned long long h, char* name)
+{
+  h = (h ^ '/')*0x100000001b3ULL;
+  for(; *name; name++)
+    h = (h ^ (unsigned char)*name)*0x100000001b3ULL;
+  return h & PATHINDEX_HASH_MASK;
+}
+
+// the slot of the path index where the probes for hash 'h' start
+// (the low bits of FNV are poor, so the hash is mixed first)
+static int pathindex_home(unsigned long long h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (int)(h&(PATHINDEX_SLOTS-1));
+}
+
+// where the entry of each inode is in the path index, as last seen:
+// its slot plus one, -1 if it has none, or 0 if that isn't known; it
+// is only a hint, checked before it's trusted, since another process
+// sharing the file system may have changed the index since
+static int pathindex_slots[MAX_FILES];
+
+// the parent and name of each directory whose place has been checked
+// by a search of its parent (see pathindex_chain()), or an empty name
+// if it hasn't; a directory is never moved, so that holds until it's
+// removed; like the Bloom filters, there are none when the image is
+// used in place, since other processes may remove a directory and use
+// its inode again elsewhere
+typedef struct _pathindex_place {
+  int parent;
+  char name[MAX_LONG_NAME];
+} pathindex_place_t;
+static pathindex_place_t pathindex_places[MAX_FILES];
+
+// return the inode of the entry for hash 'h' in the path index, and
+// its directory through 'parent', or -1 if there's none
+static int pathindex_find(unsigned long long h, int* parent)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  int cached = -1;
+  int slot = pathindex_home(h);
+  for(int n=0; n<PATHINDEX_SLOTS; n++, slot=(slot+1)&(PATHINDEX_SLOTS-1)) {
+    int sector = sb.pathindex_start+slot/PATHINDEX_ENTRIES_PER_SECTOR;
+    if(sector != cached) {
+      if(Disk_Read(sector, buf) < 0) return -1;
+      cached = sector;
+    }
+    pathindex_entry_t* e = (pathindex_entry_t*)buf+slot%PATHINDEX_ENTRIES_PER_SECTOR;
+    if(e->inode == 0) break; // a free slot ends the probes
+    if(e->inode > 0 && e->hash == h) {
+      if(e->inode < MAX_FILES) pathindex_slots[e->inode] = slot+1;
+      *parent = e->parent;
+      return e->inode;
+    }
+  }
+  return -1;
+}
+
+// add an entry for hash 'h' to the path index, in place of a removed
+// entry if possible, or of a stale entry for the same hash
+static void pathindex_add(unsigned long long h, int inode, int parent)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return;
+  int cached = -1, free_slot = -1;
+  int slot = pathindex_home(h);
+  for(int n=0; n<PATHINDEX_SLOTS; n++, slot=(slot+1)&(PATHINDEX_SLOTS-1)) {
+    int sector = sb.pathindex_start+slot/PATHINDEX_ENTRIES_PER_SECTOR;
+    if(sector != cached) {
+      if(Disk_Read(sector, buf) < 0) return;
+      cached = sector;
+    }
+    pathindex_entry_t* e = (pathindex_entry_t*)buf+slot%PATHINDEX_ENTRIES_PER_SECTOR;
+    if(e->inode > 0 && e->hash == h) { free_slot = slot; break; }
+    if(e->inode <= 0 && free_slot < 0) free_slot = slot;
+    if(e->inode == 0) break;
+  }
+  if(free_slot < 0) {
+    dprintf("... path index is full\n");
+    return;
+  }
+
+  int sector = sb.pathindex_start+free_slot/PATHINDEX_ENTRIES_PER_SECTOR;
+  if(sector != cached && Disk_Read(sector, buf) < 0) return;
+  pathindex_entry_t* e = (pathindex_entry_t*)buf+free_slot%PATHINDEX_ENTRIES_PER_SECTOR;
+  e->hash = h;
+  e->inode = inode;
+  e->parent = parent;
+  if(Disk_Write(sector, buf) == 0) pathindex_slots[inode] = free_slot+1;
+  dprintf("... path index slot %d: inode %d\n", free_slot, inode);
+}
+
+// find the entry of 'inode' in the path index, in the slot it was
+// last seen in, or else by going through all of it (once); return its
+// slot, with its sector left in 'buf', or -1 if there's none
+static int pathindex_locate(int inode, char* buf)
+{
+  int slot = pathindex_slots[inode]-1;
+  if(slot == -2) return -1;
+  if(slot >= 0) {
+    if(Disk_Read(sb.pathindex_start+slot/PATHINDEX_ENTRIES_PER_SECTOR, buf) < 0) return -1;
+    if(((pathindex_entry_t*)buf)[slot%PATHINDEX_ENTRIES_PER_SECTOR].inode == inode) return slot;
+  }
+
+  dprintf("... path index: scan for inode %d\n", inode);
+  slot = -1;
+  for(int i=0; i<sb.pathindex_sectors && slot<0; i++) {
+    if(Disk_Read(sb.pathindex_start+i, buf) < 0) return -1;
+    int k = Simd_FindInt(buf+offsetof(pathindex_entry_t, inode), sizeof(pathindex_entry_t),
+			 PATHINDEX_ENTRIES_PER_SECTOR, inode);
+    if(k >= 0) slot = i*PATHINDEX_ENTRIES_PER_SECTOR+k;
+  }
+  pathindex_slots[inode] = slot+1;
+  return slot;
+}
+
+// record the new file 'name' (with inode 'inode') of directory 'dir'
+// in the path index; the hash of its path comes from the entry of the
+// directory, so the files of a directory that isn't in the index
+// aren't either
+static void pathindex_insert(int dir, char* name, int inode)
+{
+  if(!(sb.features & FEATURE_PATHINDEX)) return;
+  unsigned long long h = PATHINDEX_ROOT_HASH;
+  if(dir != 0) {
+    SCRATCH(buf, SECTOR_SIZE);
+    if(!buf) return;
+    int slot = pathindex_locate(dir, buf);
+    if(slot < 0) return;
+    h = ((pathindex_entry_t*)buf)[slot%PATHINDEX_ENTRIES_PER_SECTOR].hash;
+  }
+  pathindex_add(path_hash(h, name), inode, dir);
+}
+
+// drop the entry of a removed file or directory from the path index;
+// its slot is marked as removed so that probes go on past it, unless
+// the next slot is free: then it's freed too, along with the removed
+// slots right before it, so that the marks don't pile up
+static void pathindex_delete(int inode)
+{
+  if(!(sb.features & FEATURE_PATHINDEX)) return;
+  pathindex_places[inode].name[0] = '\0';
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return;
+  int slot = pathindex_locate(inode, buf);
+  if(slot < 0) return;
+  pathindex_slots[inode] = -1;
+
+  int next = (slot+1)&(PATHINDEX_SLOTS-1);
+  SCRATCH(next_buf, SECTOR_SIZE);
+  if(!next_buf) return;
+  if(Disk_Read(sb.pathindex_start+next/PATHINDEX_ENTRIES_PER_SECTOR, next_buf) < 0) return;
+  int mark = ((pathindex_entry_t*)next_buf)[next%PATHINDEX_ENTRIES_PER_SECTOR].inode == 0 ? 0 : -1;
+  for(;;) {
+    ((pathindex_entry_t*)buf)[slot%PATHINDEX_ENTRIES_PER_SECTOR].inode = mark;
+    if(Disk_Write(sb.pathindex_start+slot/PATHINDEX_ENTRIES_PER_SECTOR, buf) < 0 || mark < 0) break;
+    slot = (slot-1)&(PATHINDEX_SLOTS-1);
+    if(Disk_Read(sb.pathindex_start+slot/PATHINDEX_ENTRIES_PER_SECTOR, buf) < 0 ||
+       ((pathindex_entry_t*)buf)[slot%PATHINDEX_ENTRIES_PER_SECTOR].inode != -1) break;
+  }
+}
+
+// whether directory 'dir' is the one at the path whose components
+// are names[0..level] (and whose prefixes hash to hashes[0..level]);
+// the path index only knows hashes, and two paths can have the same,
+// so each directory on the way up is checked to be in its parent under
+// its name, up to the root
+static int pathindex_chain(int dir, int level, unsigned long long* hashes, char** names)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  SCRATCH(inode_buf, SECTOR_SIZE);
+  if(!buf || !inode_buf) return 0;
+  int d = dir;
+  for(; level >= 0; level--) {
+    if(d <= 0 || d >= MAX_FILES) return 0;
+    pathindex_place_t* place = &pathindex_places[d];
+    if(!fs_inplace && place->name[0]) {
+      // checked before: a directory has just the one name
+      if(strcmp(place->name, names[level])) return 0;
+      d = place->parent;
+      continue;
+    }
+    int slot = pathindex_locate(d, buf);
+    if(slot < 0) return 0;
+    pathindex_entry_t* e = (pathindex_entry_t*)buf+slot%PATHINDEX_ENTRIES_PER_SECTOR;
+    if(e->hash != hashes[level]) return 0;
+    int parent = e->parent;
+    int sector = INODE_TABLE_START_SECTOR+parent/INODES_PER_SECTOR;
+    if(Disk_Read(sector, inode_buf) < 0 ||
+       find_child_inode(parent, names[level], &sector, inode_buf) != d) {
+      dprintf("... path index: inode %d isn't '%s' in directory %d\n", d, names[level], parent);
+      return 0;
+    }
+    if(!fs_inplace) {
+      place->parent = parent;
+      strcpy(place->name, names[level]);
+    }
+    d = parent;
+  }
+  return d == 0;
+}
+
+// return the inode of the entry in the path index for the path whose
+// components are names[0..level] (see pathindex_chain()), and its
+// directory through 'parent', if it checks out, or -1 otherwise
+static int pathindex_verify(int level, unsigned long long* hashes, char** names, int* parent)
+{
+  int inode = pathindex_find(hashes[level], parent);
+  if(inode < 0) return -1;
+  int sector = INODE_TABLE_START_SECTOR+(*parent)/INODES_PER_SECTOR;
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  if(Disk_Read(sector, buf) < 0) return -1;
+  if(find_child_inode(*parent, names[level], &sector, buf) != inode ||
+     !pathindex_chain(*parent, level-1, hashes, names)) {
+    dprintf("... stale path index entry for '%s'\n", names[level]);
+    return -1;
+  }
+  return inode;
+}
+
+// look up an absolute path in the path index; the results are the
+// same as follow_path(), except that -2 is returned if the index
+// doesn't know the path nor its directory
+static int pathindex_lookup(char* path, int* last_inode, char* last_fname)
+{
+  SCRATCH(pathstore, MAX_PATH);
+  if(!pathstore) return -1;
+  strncpy(pathstore, path+1, MAX_PATH-1);
+  pathstore[MAX_PATH-1] = '\0'; // for safety
+  char* lpath = pathstore;
+
+  // hash the path one component at a time, keeping each prefix's hash
+  unsigned long long h = PATHINDEX_ROOT_HASH, hashes[MAX_PATH/2];
+  char* names[MAX_PATH/2];
+  int n = 0;
+  char* token;
+  while((token = strsep(&lpath, "/")) != NULL) {
+    if(*token == '\0') continue; // multiple '/' ignored
+    if(illegal_filename(token)) return -2;
+    h = path_hash(h, token);
+    hashes[n] = h;
+    names[n++] = token;
+  }
+  if(n < 2) return -2; // the root or a file in it: a search is as good
+
+  int parent_inode, dir_parent;
+  int child_inode = pathindex_verify(n-1, hashes, names, &parent_inode);
+  if(child_inode < 0) {
+    // the file isn't in the index (it may not exist): search its
+    // directory, if that is in the index
+    parent_inode = pathindex_verify(n-2, hashes, names, &dir_parent);
+    if(parent_inode < 0) return -2;
+    int sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
+    SCRATCH(buf, SECTOR_SIZE);
+    if(!buf) return -1;
+    if(Disk_Read(sector, buf) < 0) return -1;
+    child_inode = find_child_inode(parent_inode, names[n-1], &sector, buf);
+    if(child_inode < -1) return -1;
+  }
+  dprintf("... path index: parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
+  *last_inode = child_inode;
+  if(last_fname) strcpy(last_fname, names[n-1]);
+  return parent_inode;
+}
+
 // follow the absolute path; if successful, return the inode of the
 // parent directory immediately before the last file/directory in the
 // path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
@@ -391,9 +1463,16 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
     return -1;
   }
 
+  // a path that the path index knows needs no walk
+  if(sb.features & FEATURE_PATHINDEX) {
+    int parent_inode = pathindex_lookup(path, last_inode, last_fname);
+    if(parent_inode != -2) return parent_inode;
+  }
+
   // make a copy of the path (skip leading '/'); this is necessary
   // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH];
+  SCRATCH(pathstore, MAX_PATH);
+  if(!pathstore) return -1;
   strncpy(pathstore, path+1, MAX_PATH-1);
   pathstore[MAX_PATH-1] = '\0'; // for safety
   char* lpath = pathstore;
@@ -401,7 +1480,8 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
   int parent_inode = -1, child_inode = 0; // start from root
   // cache the disk sector containing the root inode
   int cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
+  SCRATCH(cached_buffer, SECTOR_SIZE);
+  if(!cached_buffer) return -1;
   if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
   dprintf("... load inode table for root from disk sector %d\n", cached_sector);
 
@@ -441,11 +1521,16 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
 }
 
 // add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
+// 'file' under parent directory represented by 'parent_inode'; return
+// the inode of the new file or directory
 int add_inode(int type, int parent_inode, char* file)
 {
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  SCRATCH(dirent_buffer, SECTOR_SIZE);
+  if(!inode_buffer || !dirent_buffer) return -1;
+
   // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
+  int child_inode = alloc_inode(parent_inode, type);
   if(child_inode < 0) {
     dprintf("... error: inode table is full\n");
     return -1;
@@ -454,7 +1539,6 @@ int add_inode(int type, int parent_inode, char* file)
 
   // load the disk sector containing the child inode
   int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
   if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
 
@@ -467,7 +1551,7 @@ int add_inode(int type, int parent_inode, char* file)
   // update the new child inode and write to disk
   memset(child, 0, sizeof(inode_t));
   child->type = type;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
+  if(write_inodes(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
 	 child_inode, child->size, child->type, inode_sector);
 
@@ -487,43 +1571,48 @@ int add_inode(int type, int parent_inode, char* file)
 
   // get the dirent sector
   if(parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return -2; // parent not directory
-  }
-  int group = parent->size/DIRENTS_PER_SECTOR;
-  char dirent_buffer[SECTOR_SIZE];
-  if(group*DIRENTS_PER_SECTOR == parent->size) {
-    // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    if(newsec < 0) {
-      dprintf("... error: disk is full\n");
-      return -1;
-    }
-    parent->data[group] = newsec;
-    memset(dirent_buffer, 0, SECTOR_SIZE);
-    dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
-  } else {
-    if(Disk_Read(parent->data[group], dirent_buffer) < 0)
-      return -1;
-    dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+    dprintf("... error: parent inode is not directory\n");
+    return -2; // parent not directory
   }
+  if(sb.features & FEATURE_VARDIRENTS) {
+    if(vardir_add(parent, parent_inode, file, child_inode) < 0) return -1;
+  } else {
+    int group = parent->size/DIRENTS_PER_SECTOR;
+    if(group*DIRENTS_PER_SECTOR == parent->size) {
+      // new disk sector is needed
+      int newsec = alloc_sector(parent_inode, parent->data, group);
+      if(newsec < 0) {
+	dprintf("... error: disk is full\n");
+	return -1;
+      }
+      parent->data[group] = newsec;
+      memset(dirent_buffer, 0, SECTOR_SIZE);
+      dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
+    } else {
+      if(Disk_Read(parent->data[group], dirent_buffer) < 0)
+	return -1;
+      dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+    }
 
-  // add the dirent and write to disk
-  int start_entry = group*DIRENTS_PER_SECTOR;
-  offset = parent->size-start_entry;
-  dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
-  strncpy(dirent->fname, file, MAX_NAME);
-  dirent->inode = child_inode;
-  if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
-  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
-	  parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
+    // add the dirent and write to disk
+    int start_entry = group*DIRENTS_PER_SECTOR;
+    offset = parent->size-start_entry;
+    dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
+    strncpy(dirent->fname, file, MAX_NAME);
+    dirent->inode = child_inode;
+    if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
+    dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
+	    parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
+  }
 
   // update parent inode and write to disk
   parent->size++;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
+  if(write_inodes(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... update parent inode on disk sector %d\n", inode_sector);
 
-  return 0;
+  bloom_add(parent_inode, file);
+  pathindex_insert(parent_inode, file, child_inode);
+  return child_inode;
 }
 
 // used by both File_Create() and Dir_Create(); type=0 is file, type=1
@@ -531,7 +1620,7 @@ int add_inode(int type, int parent_inode, char* file)
 int create_file_or_directory(int type, char* pathname)
 {
   int child_inode;
-  char last_fname[MAX_NAME];
+  char last_fname[MAX_LONG_NAME];
   int parent_inode = follow_path(pathname, &child_inode, last_fname);
   if(parent_inode >= 0) {
     if(child_inode >= 0) {
@@ -564,7 +1653,10 @@ int remove_inode(int type, int parent_inode, int child_inode)
   //load the child inode sector
   int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
 
-  char inode_buffer[SECTOR_SIZE];
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  SCRATCH(dirent_buffer, SECTOR_SIZE);
+  SCRATCH(last_dirent_buffer, SECTOR_SIZE);
+  if(!inode_buffer || !dirent_buffer || !last_dirent_buffer) return -1;
   if(Disk_Read(inode_sector, inode_buffer) < 0){
     return -1;
   }
@@ -601,11 +1693,15 @@ int remove_inode(int type, int parent_inode, int child_inode)
   // Clear the child inode and write to disk
   memset(child, 0, sizeof(inode_t));
 
-  if(Disk_Write(inode_sector, inode_buffer) < 0){
+  if(write_inodes(inode_sector, inode_buffer) < 0){
     return -1;
   }
   dprintf("Update the disk sector %d\n", inode_sector);
   bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
+  synced_size[child_inode] = -1;
+  pathindex_delete(child_inode);
+  bloom_drop(child_inode);
+  bloom_drop(parent_inode);
 
   //Update the parent inode
   inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
@@ -628,15 +1724,19 @@ int remove_inode(int type, int parent_inode, int child_inode)
 
   //Find in the parent inode the dirent structure that contains the child inode
   //Then swap it with the last dirent entry in the parent inode and decrement the size
-   char dirent_buffer[SECTOR_SIZE];
     int group = 0;
     int entry = 0;
     dirent_t* current_dirent;
 
+  //Packed dirents are simply taken out of their sector
+  if(sb.features & FEATURE_VARDIRENTS){
+    if(vardir_remove(parent, child_inode) < 0){
+      return -1;
+    }
+  }
   //Look for the last dirent entry in the parent inode
-  if(parent->size > 1){ // if there are more files and directories in the parent inode
-    int last_group = parent->size / DIRENTS_PER_SECTOR;
-    char last_dirent_buffer[SECTOR_SIZE];
+  else if(parent->size > 1){ // if there are more files and directories in the parent inode
+    int last_group = (parent->size - 1) / DIRENTS_PER_SECTOR;
     int last_sector = parent->data[last_group];
     if(Disk_Read(last_sector, last_dirent_buffer) < 0){ //Read the sector used by the last entry
       return -1;
@@ -652,43 +1752,44 @@ int remove_inode(int type, int parent_inode, int child_inode)
     dirent_t* last_dirent = (dirent_t*)(last_dirent_buffer + offset * sizeof(dirent_t));
 
     //Find the sector where the child dirent is
-    for(group = 0; group<MAX_SECTORS_PER_FILE; group++){ //Iterate through all the groups in the parent inode
+    int nentries = parent->size; //remaining number of dirents to look at
+    for(group = 0; nentries > 0; group++){ //Iterate through the groups in use by the parent inode
       if(Disk_Read(parent->data[group], dirent_buffer) < 0){ //Read the sector in this group
           return -1;
       }
-      dprintf("Loading the disk sector %d for the dirent group %d\n", parent->data[last_group], group);
-      for(entry = 0; entry<DIRENTS_PER_SECTOR; entry++){ //All the dirents inside this group
-         current_dirent = (dirent_t*)(dirent_buffer+entry * sizeof(dirent_t));
-         if(current_dirent->inode == child_inode){
-
-            strncpy(current_dirent->fname, last_dirent->fname, MAX_NAME);
-            current_dirent->inode = last_dirent->inode;
-
-            char * temp = "";
-            strncpy(last_dirent->fname, temp, MAX_NAME);
-            last_dirent->inode = -1;
-
-            memset(last_dirent, 0 , sizeof(dirent_t));
-            //Update the sector with the removed node
-            if(Disk_Write(parent->data[group], dirent_buffer) < 0){
-              return -1;
-            }
-            dprintf("Updating the dirent %d (name='%s', inode=%d) to group %d, updating the disk sector %d\n",
-            (group * 30) + entry, current_dirent->fname, current_dirent->inode, group, parent->data[group]);
-
-            if(Disk_Write(inode_sector, inode_buffer) < 0){ //Update the parent inode sector
-              return -1;
-            }
-            group = MAX_SECTORS_PER_FILE; //exit the outer loop
-            break;
-         }
+      dprintf("Loading the disk sector %d for the dirent group %d\n", parent->data[group], group);
+      int n = nentries < DIRENTS_PER_SECTOR ? nentries : DIRENTS_PER_SECTOR;
+      nentries -= DIRENTS_PER_SECTOR;
+
+      //Compare the inode field of all the dirents in this group at once
+      entry = Simd_FindInt(dirent_buffer + offsetof(dirent_t, inode), sizeof(dirent_t), n, child_inode);
+      if(entry < 0) continue;
+
+      current_dirent = (dirent_t*)(dirent_buffer+entry * sizeof(dirent_t));
+      strncpy(current_dirent->fname, last_dirent->fname, MAX_NAME);
+      current_dirent->inode = last_dirent->inode;
+      memset(last_dirent, 0 , sizeof(dirent_t));
+
+      //Update the sector with the removed node
+      if(Disk_Write(parent->data[group], dirent_buffer) < 0){
+        return -1;
       }
+      dprintf("Updating the dirent %d (name='%s', inode=%d) to group %d, updating the disk sector %d\n",
+      (group * DIRENTS_PER_SECTOR) + entry, current_dirent->fname, current_dirent->inode, group, parent->data[group]);
+      break;
     }
   }
 
   // update parent inode and write to disk
   parent->size--;
-  if(Disk_Write(inode_sector, inode_buffer) < 0){
+  if(!(sb.features & FEATURE_VARDIRENTS) && parent->size % DIRENTS_PER_SECTOR == 0){
+    //The last dirent sector is empty now: give it back
+    int last_group = parent->size / DIRENTS_PER_SECTOR;
+    dprintf("Freeing the disk sector %d of the dirent group %d\n", parent->data[last_group], last_group);
+    bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, parent->data[last_group]);
+    parent->data[last_group] = 0;
+  }
+  if(write_inodes(inode_sector, inode_buffer) < 0){
     return -1;
   }
   dprintf("Updating the parent inode on the disk sector %d\n", inode_sector);
@@ -701,9 +1802,21 @@ typedef struct _open_file {
   int inode; // pointing to the inode of the file (0 means entry not used)
   int size;  // file size cached here for convenience
   int pos;   // read/write position
+  int parent; // the inode of the directory holding the file
 } open_file_t;
 static open_file_t open_files[MAX_OPEN_FILES];
 
+// return true (and set osErrno) if the file system can't be modified
+static int is_read_only()
+{
+  if(fs_readonly) {
+    dprintf("... file system is read-only\n");
+    osErrno = E_READ_ONLY;
+    return 1;
+  }
+  return 0;
+}
+
 // return true if the file pointed to by inode has already been open
 int is_file_open(int inode)
 {
@@ -724,11 +1837,582 @@ int new_file_fd()
   return -1;
 }
 
+// take a shared lock; if its owner died while holding it, what the
+// owner was doing may be half done, but the lock is usable again
+static void lock(pthread_mutex_t* m)
+{
+  if(pthread_mutex_lock(m) == EOWNERDEAD) {
+    dprintf("... previous lock owner died, recovering lock\n");
+    pthread_mutex_consistent(m);
+  }
+}
+
+// the lock for the bitmaps and directories; it's held by all
+// operations that walk paths or allocate and free inodes or sectors
+static void init_local_locks()
+{
+  pthread_mutex_init(&local_locks.fs, NULL);
+  for(int i=0; i<MAX_FILES; i++)
+    pthread_mutex_init(&local_locks.inode[i], NULL);
+}
+
+// the locks in use: the shared ones, or else this process's own
+static shared_locks_t* the_locks()
+{
+  if(locks) return locks;
+  pthread_once(&local_locks_once, init_local_locks);
+  return &local_locks;
+}
+
+static void fs_lock()
+{
+  lock(&the_locks()->fs);
+}
+
+static void fs_unlock()
+{
+  pthread_mutex_unlock(&the_locks()->fs);
+}
+
+// the lock for the content (data sectors and size) of a file; it's
+// taken after the fs lock when both are needed (a bad inode number
+// takes no lock, and is left for the caller to reject)
+static void inode_lock(int inode)
+{
+  if(0 <= inode && inode < MAX_FILES) lock(&the_locks()->inode[inode]);
+}
+
+static void inode_unlock(int inode)
+{
+  if(0 <= inode && inode < MAX_FILES) pthread_mutex_unlock(&the_locks()->inode[inode]);
+}
+
+// count a file opened on 'inode' (n=1) or closed (n=-1); the count is
+// taken under the fs lock when it goes up, so that an unlink, which
+// holds it too, sees every open that got there first
+static void count_open(int inode, int n)
+{
+  __atomic_add_fetch(&the_locks()->opens[inode], n, __ATOMIC_SEQ_CST);
+}
+
+// return true if file 'inode' is open, in any process with FS_SHARED
+static int file_in_use(int inode)
+{
+  return __atomic_load_n(&the_locks()->opens[inode], __ATOMIC_SEQ_CST) > 0;
+}
+
+// close every file this process has open (a child forked off a shared
+// mount has copies of its parent's files, which aren't its own to
+// take off the counts)
+static void close_all_files()
+{
+  for(int i=0; i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode > 0 && (!locks || locks_pid == getpid()))
+      count_open(open_files[i].inode, -1);
+    open_files[i].inode = 0;
+  }
+}
+
+// clear 'num' sectors starting from 'start' and mark them as used
+static int format_region(int start, int num)
+{
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  memset(buf, 0, SECTOR_SIZE);
+  for(int i=0; i<num; i++) {
+    if(Disk_Write(start+i, buf) < 0 ||
+       bitmap_set(SECTOR_BITMAP_START_SECTOR, start+i) < 0) return -1;
+  }
+  dprintf("... formatted region (start=%d, num=%d)\n", start, num);
+  return 0;
+}
+
+// format a new file system on the (in-memory) disk: the superblock,
+// both bitmaps and the inode table with the root directory in it, and
+// the optional parts selected by 'features' (FEATURE_* flags)
+static int format_disk(int features)
+{
+  // format superblock
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  memset(buf, 0, SECTOR_SIZE);
+  superblock_t* super = (superblock_t*)buf;
+  super->magic = OS_MAGIC;
+  super->features = features | FEATURE_CHECKPOINTS;
+  super->sector_size = SECTOR_SIZE;
+  int end = TOTAL_SECTORS-1; // the optional parts go at the end
+  if(features & FEATURE_PATHINDEX) {
+    end -= PATHINDEX_SECTORS;
+    super->pathindex_start = end;
+    super->pathindex_sectors = PATHINDEX_SECTORS;
+  }
+  if(features & FEATURE_HOTINODES) {
+    end -= HOT_INODE_SECTORS;
+    super->hotinode_start = end;
+    super->hotinode_sectors = HOT_INODE_SECTORS;
+  }
+  super->checksum = sb_checksum(super);
+  memcpy(&sb, super, sizeof(sb));
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+    dprintf("... failed to format superblock\n");
+    return -1;
+  }
+  dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+
+  // format inode bitmap (reserve the first inode to root)
+  if(bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1) < 0) return -1;
+  dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
+	 (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+
+  // format sector bitmap (reserve the first few sectors to
+  // superblock, inode bitmap, sector bitmap, and inode table)
+  if(bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+		 DATABLOCK_START_SECTOR) < 0) return -1;
+  dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
+	 (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+
+  // the optional parts start out empty, and their sectors are taken
+  // (the other copy of the superblock too, until the first checkpoint)
+  if(format_region(SHADOW_SUPERBLOCK_SECTOR, 1) < 0 ||
+     format_region(sb.pathindex_start, sb.pathindex_sectors) < 0 ||
+     format_region(sb.hotinode_start, sb.hotinode_sectors) < 0) {
+    dprintf("... failed to format path index or hot inode table\n");
+    return -1;
+  }
+
+  // format inode tables
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) {
+    memset(buf, 0, SECTOR_SIZE);
+    if(i==0) {
+      // the first inode table entry is the root directory
+      ((inode_t*)buf)->size = 0;
+      ((inode_t*)buf)->type = 1;
+    }
+    if(write_inodes(INODE_TABLE_START_SECTOR+i, buf) < 0) {
+      dprintf("... failed to format inode table\n");
+      return -1;
+    }
+  }
+  dprintf("... formatted inode table (start=%d, num=%d)\n",
+	 (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+  return 0;
+}
+
+// set up the lock file of a shared mount and map the locks; the
+// first process to get there initializes them
+static int map_shared_locks(int fd)
+{
+  struct stat st;
+  if(fstat(fd, &st) < 0) return -1;
+  if(st.st_size < sizeof(shared_locks_t) && ftruncate(fd, sizeof(shared_locks_t)) < 0)
+    return -1;
+  void* p = mmap(NULL, sizeof(shared_locks_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED) return -1;
+  locks = (shared_locks_t*)p;
+
+  if(locks->magic != LOCKS_MAGIC) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&locks->fs, &attr);
+    for(int i=0; i<MAX_FILES; i++)
+      pthread_mutex_init(&locks->inode[i], &attr);
+    pthread_mutexattr_destroy(&attr);
+    locks->magic = LOCKS_MAGIC;
+    dprintf("... initialized shared locks\n");
+  }
+  return 0;
+}
+
+// let go of the lock on the log, if it's held
+static void unlock_log()
+{
+  if(log_lock_fd >= 0) close(log_lock_fd);
+  log_lock_fd = -1;
+}
+
+// take the lock on the log, creating the log file if 'create' is set
+// (otherwise there's nothing to lock if there's no log); return 0 if
+// successful, -1 if another process has it
+static int lock_log(int create)
+{
+  unlock_log();
+  log_lock_fd = open(log_filename, O_RDWR|(create ? O_CREAT : 0), 0666);
+  if(log_lock_fd < 0) return !create && errno == ENOENT ? 0 : -1;
+  if(flock(log_lock_fd, LOCK_EX|LOCK_NB) < 0) {
+    dprintf("... log '%s' is in use by another process\n", log_filename);
+    unlock_log();
+    return -1;
+  }
+  return 0;
+}
+
+// fold whatever is in the log into the backstore file, so that the
+// file can be used in place; return 0 if successful, -1 otherwise
+static int fold_log()
+{
+  struct stat st;
+  if(stat(log_filename, &st) < 0 || st.st_size == 0) return 0;
+  if(lock_log(0) < 0) return -1;
+  dprintf("... fold log '%s' into file '%s'\n", log_filename, bs_filename);
+  int ret = 0;
+  if(Disk_Init() < 0 || Disk_Load(bs_filename) < 0 ||
+     Disk_LoadLog(log_filename) < 0 || Disk_CleanLog(bs_filename, log_filename) < 0)
+    ret = -1;
+  unlock_log();
+  return ret;
+}
+
+// mount the backstore shared with other processes: the image file is
+// mapped writable and used in place (formatted first if it doesn't
+// exist yet, with the given features); return 0 if successful, -1
+// otherwise
+static int mount_shared(int features)
+{
+  char lockname[1030];
+  snprintf(lockname, sizeof(lockname), "%s.lock", bs_filename);
+  int fd = open(lockname, O_RDWR|O_CREAT, 0666);
+  if(fd < 0) {
+    dprintf("... couldn't open lock file '%s'\n", lockname);
+    return -1;
+  }
+
+  // one process at a time sets up the locks and the image; the first
+  // one to mount clears the open counts, which processes that died
+  // with files open may have left behind
+  flock(fd, LOCK_EX);
+  int ret = map_shared_locks(fd);
+  struct flock mounted = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1 };
+  if(ret == 0 && fcntl(fd, F_GETLK, &mounted) < 0) ret = -1;
+  if(ret == 0 && mounted.l_type == F_UNLCK) {
+    dprintf("... first mount, clear the open counts\n");
+    memset(locks->opens, 0, sizeof(locks->opens));
+  }
+  mounted = (struct flock){ .l_type = F_RDLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1 };
+  if(ret == 0 && fcntl(fd, F_SETLK, &mounted) < 0) ret = -1;
+  if(ret == 0 && access(bs_filename, F_OK) != 0) {
+    dprintf("... couldn't find file, create new file system\n");
+    unlink(log_filename); // left from an older file system
+    if(format_disk(features) < 0 || Disk_Save(bs_filename) < 0) ret = -1;
+  }
+  if(ret == 0 && fold_log() < 0) ret = -1;
+  if(ret == 0 && (Disk_MapShared(bs_filename) < 0 || !check_magic())) ret = -1;
+  flock(fd, LOCK_UN);
+
+  if(ret < 0) {
+    close(fd);
+    if(locks) munmap(locks, sizeof(shared_locks_t));
+    locks = NULL;
+    return -1;
+  }
+  shared_lock_fd = fd;
+  locks_pid = getpid();
+  return 0;
+}
+
+// write the superblock as the next checkpoint, to the copy not written
+// last time, and make it durable (see FEATURE_CHECKPOINTS); return 0
+// if successful, -1 otherwise; the fs lock is held
+static int checkpoint()
+{
+  if(!(sb.features & FEATURE_CHECKPOINTS)) return 0;
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) return -1;
+  // another process sharing the image may have written one since
+  superblock_t latest;
+  memcpy(&latest, &sb, sizeof(sb));
+  if(fs_inplace && check_magic() && sb.sequence < latest.sequence)
+    memcpy(&sb, &latest, sizeof(sb));
+
+  memset(buf, 0, SECTOR_SIZE);
+  superblock_t* super = (superblock_t*)buf;
+  memcpy(super, &sb, sizeof(sb));
+  super->sequence++;
+  super->checksum = sb_checksum(super);
+  int sector = SUPERBLOCK_SECTOR(super->sequence);
+  int ret = Disk_Write(sector, buf);
+  if(ret == 0) ret = Disk_SyncSectors(bs_filename, fs_logged ? log_filename : NULL, &sector, 1);
+  if(ret == 0) memcpy(&sb, super, sizeof(sb));
+  dprintf("... checkpoint %d to sector %d\n", super->sequence, sector);
+  return ret;
+}
+
+// maintenance work (see FS_Check()) is split into small tasks that run
+// on a pool of threads: each thread has a deque of tasks, takes the
+// latest task from its own deque, and when that's empty, steals the
+// oldest from another one; a task can spawn more tasks (which go to
+// the deque of the thread running it), and the thread that started
+// the work takes part until all of it is done
+typedef struct _task {
+  void (*fn)(void* arg, int a, int b);
+  void* arg;
+  int a, b;
+} task_t;
+
+#define TASK_DEQUE_SIZE 4096 // a power of 2
+
+typedef struct _task_deque {
+  pthread_mutex_t lock;
+  int top, bottom; // stolen from the top, taken by its owner from the bottom
+  task_t task[TASK_DEQUE_SIZE];
+} task_deque_t;
+
+static task_deque_t* deques; // the first is for the thread that starts the work
+static pthread_t* task_threads;
+static int task_nthreads;       // how many threads work, that one included
+static int task_threads_wanted; // see FS_Threads()
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+// held by the call using the pool, from starting its threads until its
+// work is done, so that one call at a time has the pool, and it isn't
+// resized under it
+static pthread_mutex_t task_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_wake = PTHREAD_COND_INITIALIZER;
+static int tasks_queued, tasks_unfinished, tasks_stop;
+static __thread int my_deque; // 0 but in the pool's threads
+
+// take a task from deque 'i', the latest one if it's the owner's
+static int task_pop(int i, int own, task_t* t)
+{
+  task_deque_t* d = &deques[i];
+  int ok = 0;
+  pthread_mutex_lock(&d->lock);
+  if(d->bottom > d->top) {
+    if(own) *t = d->task[--d->bottom & (TASK_DEQUE_SIZE-1)];
+    else *t = d->task[d->top++ & (TASK_DEQUE_SIZE-1)];
+    ok = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  if(ok) __atomic_sub_fetch(&tasks_queued, 1, __ATOMIC_SEQ_CST);
+  return ok;
+}
+
+// take a task from the deque of this thread, or steal one
+static int task_take(task_t* t)
+{
+  if(task_pop(my_deque, 1, t)) return 1;
+  for(int n=1; n<task_nthreads; n++)
+    if(task_pop((my_deque+n)%task_nthreads, 0, t)) return 1;
+  return 0;
+}
+
+static void task_run(task_t* t)
+{
+  t->fn(t->arg, t->a, t->b);
+  if(__atomic_sub_fetch(&tasks_unfinished, 1, __ATOMIC_SEQ_CST) == 0) {
+    pthread_mutex_lock(&task_lock);
+    pthread_cond_broadcast(&task_wake);
+    pthread_mutex_unlock(&task_lock);
+  }
+}
+
+static void task_spawn(void (*fn)(void*, int, int), void* arg, int a, int b)
+{
+  task_t t = { fn, arg, a, b };
+  __atomic_add_fetch(&tasks_unfinished, 1, __ATOMIC_SEQ_CST);
+  task_deque_t* d = &deques[my_deque];
+  pthread_mutex_lock(&d->lock);
+  int full = d->bottom - d->top == TASK_DEQUE_SIZE;
+  if(!full) {
+    d->task[d->bottom++ & (TASK_DEQUE_SIZE-1)] = t;
+    __atomic_add_fetch(&tasks_queued, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&d->lock);
+  if(full) {
+    task_run(&t);
+    return;
+  }
+  if(task_nthreads > 1) {
+    pthread_mutex_lock(&task_lock);
+    pthread_cond_signal(&task_wake);
+    pthread_mutex_unlock(&task_lock);
+  }
+}
+
+static void* task_main(void* arg)
+{
+  my_deque = (int)(long)arg;
+  task_t t;
+  for(;;) {
+    if(task_take(&t)) {
+      task_run(&t);
+      continue;
+    }
+    pthread_mutex_lock(&task_lock);
+    while(!tasks_stop && __atomic_load_n(&tasks_queued, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_wait(&task_wake, &task_lock);
+    int stop = tasks_stop;
+    pthread_mutex_unlock(&task_lock);
+    if(stop) return NULL;
+  }
+}
+
+// run the tasks spawned so far (and those they spawn) to the end
+static void task_wait()
+{
+  task_t t;
+  while(__atomic_load_n(&tasks_unfinished, __ATOMIC_SEQ_CST) > 0) {
+    if(task_take(&t)) {
+      task_run(&t);
+      continue;
+    }
+    pthread_mutex_lock(&task_lock);
+    while(__atomic_load_n(&tasks_unfinished, __ATOMIC_SEQ_CST) > 0 &&
+	  __atomic_load_n(&tasks_queued, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_wait(&task_wake, &task_lock);
+    pthread_mutex_unlock(&task_lock);
+  }
+}
+
+// the pool lock is held
+static void task_stop_threads()
+{
+  if(!deques) return;
+  pthread_mutex_lock(&task_lock);
+  tasks_stop = 1;
+  pthread_cond_broadcast(&task_wake);
+  pthread_mutex_unlock(&task_lock);
+  for(int i=1; i<task_nthreads; i++)
+    pthread_join(task_threads[i], NULL);
+  free(task_threads);
+  free(deques);
+  task_threads = NULL;
+  deques = NULL;
+  task_nthreads = 0;
+  tasks_stop = 0;
+}
+
+// have the pool's threads ready; return 0 if successful, -1 otherwise;
+// the pool lock is held
+static int task_start_threads()
+{
+  if(deques) return 0;
+  int n = task_threads_wanted > 0 ? task_threads_wanted : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(n < 1) n = 1;
+  deques = calloc(n, sizeof(task_deque_t));
+  task_threads = calloc(n, sizeof(pthread_t));
+  if(!deques || !task_threads) {
+    free(deques);
+    free(task_threads);
+    deques = NULL;
+    task_threads = NULL;
+    return -1;
+  }
+  for(int i=0; i<n; i++)
+    pthread_mutex_init(&deques[i].lock, NULL);
+  task_nthreads = 1;
+  for(int i=1; i<n; i++) {
+    if(pthread_create(&task_threads[i], NULL, task_main, (void*)(long)i) != 0) break;
+    task_nthreads++;
+  }
+  dprintf("... started %d maintenance threads\n", task_nthreads-1);
+  return 0;
+}
+
+// what FS_Check() finds out, filled in by its tasks
+typedef struct _check {
+  unsigned char inode_used[INODE_BITMAP_SECTORS*SECTOR_SIZE];   // the bitmap on disk
+  unsigned char sector_used[SECTOR_BITMAP_SECTORS*SECTOR_SIZE]; // as it should be
+  int refs[MAX_FILES]; // the directory entries of each inode
+  int problems;
+  int failed; // a task couldn't get the memory it needed
+} check_t;
+
+static void check_count(check_t* c, int n, char* what, int which)
+{
+  dprintf("... check: %s (%d)\n", what, which);
+  __atomic_add_fetch(&c->problems, n, __ATOMIC_SEQ_CST);
+}
+
+static int check_inode_used(check_t* c, int inode)
+{
+  return 0 <= inode && inode < MAX_FILES && (c->inode_used[inode/8] & (0x80 >> (inode%8)));
+}
+
+// a sector is in use, by some inode or else
+static void check_sector(check_t* c, int sector, int inode)
+{
+  if(sector < 0 || sector >= TOTAL_SECTORS) {
+    check_count(c, 1, "sector out of range in inode", inode);
+    return;
+  }
+  unsigned char bit = 0x80 >> (sector%8);
+  if(__atomic_fetch_or(&c->sector_used[sector/8], bit, __ATOMIC_SEQ_CST) & bit)
+    check_count(c, 1, "sector used twice, again by inode", inode);
+}
+
+// the entries in dirent sector 'sector', which holds 'n' fixed-size
+// entries (or packed ones, if 'n' is negative)
+static void check_dirents(void* arg, int sector, int n)
+{
+  check_t* c = arg;
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) {
+    __atomic_store_n(&c->failed, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if(Disk_Read(sector, buf) < 0) {
+    check_count(c, 1, "can't read dirent sector", sector);
+    return;
+  }
+  if(n < 0) n = ((vardir_header_t*)buf)->count;
+  for(int k=0, off=sizeof(vardir_header_t); k<n; k++) {
+    int inode;
+    if(sb.features & FEATURE_VARDIRENTS) {
+      vardirent_t* e = (vardirent_t*)(buf+off);
+      if(off+VARDIRENT_SIZE(0) > SECTOR_SIZE || off+VARDIRENT_SIZE(e->len) > SECTOR_SIZE) {
+	check_count(c, 1, "bad packed dirent sector", sector);
+	return;
+      }
+      inode = e->inode;
+      off += VARDIRENT_SIZE(e->len);
+    } else inode = ((dirent_t*)buf)[k].inode;
+    if(!check_inode_used(c, inode)) check_count(c, 1, "entry of unused inode", inode);
+    else if(__atomic_add_fetch(&c->refs[inode], 1, __ATOMIC_SEQ_CST) > 1)
+      check_count(c, 1, "inode in more than one entry", inode);
+  }
+}
+
+// the inodes in inode table sector 'i'
+static void check_inodes(void* arg, int i, int unused)
+{
+  check_t* c = arg;
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) {
+    __atomic_store_n(&c->failed, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if(Disk_Read(INODE_TABLE_START_SECTOR+i, buf) < 0) {
+    check_count(c, 1, "can't read inode table sector", i);
+    return;
+  }
+  for(int k=0; k<INODES_PER_SECTOR; k++) {
+    int inode = i*INODES_PER_SECTOR+k;
+    if(!check_inode_used(c, inode)) continue;
+    inode_t* node = (inode_t*)buf+k;
+    for(int j=0; j<MAX_SECTORS_PER_FILE; j++)
+      if(node->data[j]) check_sector(c, node->data[j], inode);
+    if(node->type != 1) continue;
+
+    // the entries of a directory are checked by tasks of their own
+    if(sb.features & FEATURE_VARDIRENTS) {
+      for(int j=0; j<MAX_SECTORS_PER_FILE && node->data[j]; j++)
+	task_spawn(check_dirents, c, node->data[j], -1);
+    } else for(int j=0, left=node->size; left>0 && j<MAX_SECTORS_PER_FILE; j++, left-=DIRENTS_PER_SECTOR)
+      task_spawn(check_dirents, c, node->data[j], left < DIRENTS_PER_SECTOR ? left : DIRENTS_PER_SECTOR);
+  }
+}
+
 /* end of internal helper functions, start of API functions */
 
 int FS_Boot(char* backstore_fname)
 {
-  dprintf("FS_Boot('%s'):\n", backstore_fname);
+  return FS_Mount(backstore_fname, 0);
+}
+
+int FS_Mount(char* backstore_fname, int flags)
+{
+  dprintf("FS_Mount('%s', %d):\n", backstore_fname, flags);
   // initialize a new disk (this is a simulated disk)
   if(Disk_Init() < 0) {
     dprintf("... disk init failed\n");
@@ -741,6 +2425,76 @@ int FS_Boot(char* backstore_fname)
   // content pointed to by 'backstore_fname' after calling this function
   strncpy(bs_filename, backstore_fname, 1024);
   bs_filename[1023] = '\0'; // for safety
+  snprintf(log_filename, sizeof(log_filename), "%s.log", bs_filename);
+
+  // the optional features of a file system formatted here
+  int features = ((flags & FS_PATHINDEX) ? FEATURE_PATHINDEX : 0) |
+    ((flags & FS_VARDIRENTS) ? FEATURE_VARDIRENTS : 0) |
+    ((flags & FS_HOTINODES) ? FEATURE_HOTINODES : 0);
+
+  // forget about a previous file system
+  for(int i=0; i<MAX_FILES; i++) {
+    bloom_drop(i);
+    synced_size[i] = -1;
+    pathindex_slots[i] = 0;
+    pathindex_places[i].name[0] = '\0';
+  }
+  // and the files this process has open in it
+  close_all_files();
+  if(locks) {
+    munmap(locks, sizeof(shared_locks_t));
+    locks = NULL;
+  }
+  if(shared_lock_fd >= 0) close(shared_lock_fd);
+  shared_lock_fd = -1;
+  unlock_log();
+
+  // an archive made by FS_Export() is used as it is, read-only; its
+  // sectors are decompressed when they're first needed
+  fs_readonly = 0;
+  fs_inplace = 0;
+  fs_logged = 0;
+  if(Disk_IsArchive(bs_filename)) {
+    if(Disk_MountArchive(bs_filename) < 0 || !check_magic()) {
+      dprintf("... couldn't mount archive '%s', boot failed\n", bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    dprintf("... mounted archive '%s' read-only, boot successful\n", bs_filename);
+    fs_readonly = 1;
+    memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+    return 0;
+  }
+
+  // a read-only image is used in place (shared with every other
+  // reader of the file), and there's nothing to format; a log is
+  // applied to private copies of its sectors, not folded into it
+  if(flags & FS_RDONLY) {
+    if(Disk_Map(bs_filename) < 0 || Disk_LoadLog(log_filename) < 0 || !check_magic()) {
+      dprintf("... couldn't map file '%s', boot failed\n", bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    dprintf("... mapped file '%s' read-only, boot successful\n", bs_filename);
+    fs_readonly = 1;
+    fs_inplace = 1;
+    memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+    return 0;
+  }
+
+  // a shared image is used in place by all the processes that mount
+  // it this way, so changes are seen by all of them right away
+  if(flags & FS_SHARED) {
+    if(mount_shared(features) < 0) {
+      dprintf("... couldn't mount file '%s' shared, boot failed\n", bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    dprintf("... mapped file '%s' shared, boot successful\n", bs_filename);
+    fs_inplace = 1;
+    memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+    return 0;
+  }
 
   // we first try to load disk from this file
   if(Disk_Load(bs_filename) < 0) {
@@ -751,45 +2505,16 @@ int FS_Boot(char* backstore_fname)
     if(diskErrno == E_OPENING_FILE) {
       dprintf("... couldn't open file, create new file system\n");
 
-      // format superblock
-      char buf[SECTOR_SIZE];
-      memset(buf, 0, SECTOR_SIZE);
-      *(int*)buf = OS_MAGIC;
-      if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
-	dprintf("... failed to format superblock\n");
+      if(format_disk(features) < 0) {
 	osErrno = E_GENERAL;
 	return -1;
       }
-      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
-
-      // format inode bitmap (reserve the first inode to root)
-      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
-      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
-	     (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
-
-      // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-		  DATABLOCK_START_SECTOR);
-      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
-	     (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
-
-      // format inode tables
-      for(int i=0; i<INODE_TABLE_SECTORS; i++) {
-	memset(buf, 0, SECTOR_SIZE);
-	if(i==0) {
-	  // the first inode table entry is the root directory
-	  ((inode_t*)buf)->size = 0;
-	  ((inode_t*)buf)->type = 1;
-	}
-	if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
-	  dprintf("... failed to format inode table\n");
-	  osErrno = E_GENERAL;
-	  return -1;
-	}
+      unlink(log_filename); // left from an older file system
+      fs_logged = (flags & FS_LOGGED) != 0;
+      if(fs_logged && lock_log(1) < 0) {
+	osErrno = E_GENERAL;
+	return -1;
       }
-      dprintf("... formatted inode table (start=%d, num=%d)\n",
-	     (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
 
       // we need to synchronize the disk to the backstore file (so
       // that we don't lose the formatted disk)
@@ -830,6 +2555,21 @@ int FS_Boot(char* backstore_fname)
     }
     dprintf("... check size of file '%s' successful\n", bs_filename);
 
+    // the changes saved to the log since the file was last written
+    // go on top of it; unless more are to be logged, the log is
+    // folded into the file, which is then written in place
+    struct stat st;
+    if(lock_log(flags & FS_LOGGED) < 0 || Disk_LoadLog(log_filename) < 0 ||
+       (!(flags & FS_LOGGED) && stat(log_filename, &st) == 0 && st.st_size > 0 &&
+	Disk_CleanLog(bs_filename, log_filename) < 0)) {
+      dprintf("... couldn't read log '%s', boot failed\n", log_filename);
+      unlock_log();
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    fs_logged = (flags & FS_LOGGED) != 0;
+    if(!fs_logged) unlock_log();
+
     // check magic
     if(check_magic()) {
       // everything's good by now, boot is successful
@@ -845,9 +2585,40 @@ int FS_Boot(char* backstore_fname)
   }
 }
 
+// save the changes to the backstore (see FS_Sync()); the fs lock is
+// held, so that they're saved between operations, never in the middle
+// of one; return 0 if successful, -1 otherwise
+static int sync_fs()
+{
+  int ret;
+  if(fs_logged) {
+    // the changes go at the end of the log, which is folded into the
+    // backstore file once it gets big
+    ret = Disk_SaveLog(log_filename);
+    if(ret > LOG_CLEAN_SIZE) {
+      dprintf("FS_Sync():\n... log '%s' is %d bytes, fold it\n", log_filename, ret);
+      ret = Disk_CleanLog(bs_filename, log_filename);
+    }
+  } else {
+    // the changes are committed at once, and the log is gone after
+    ret = Disk_Commit(bs_filename, log_filename);
+  }
+  // then the superblock, to the copy not written last time
+  if(ret >= 0) ret = checkpoint();
+  return ret < 0 ? -1 : 0;
+}
+
 int FS_Sync()
 {
-  if(Disk_Save(bs_filename) < 0) {
+  if(fs_readonly) {
+    // nothing could have changed
+    dprintf("FS_Sync():\n... read-only, nothing to save\n");
+    return 0;
+  }
+  fs_lock();
+  int ret = sync_fs();
+  fs_unlock();
+  if(ret < 0) {
     // if can't write to file, something's wrong with the backstore
     dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
     osErrno = E_GENERAL;
@@ -859,10 +2630,192 @@ int FS_Sync()
   }
 }
 
+int FS_Flusher(int ratio, int age)
+{
+  dprintf("FS_Flusher(%d, %d):\n", ratio, age);
+  if(ratio <= 0 && age <= 0) {
+    Disk_StopFlusher();
+    return 0;
+  }
+  if(!fs_logged) {
+    // the flusher only appends to the log; written in place behind
+    // FS_Sync()'s back, the backstore could be caught half-changed
+    dprintf("... the file system isn't mounted with FS_LOGGED\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  // it takes the changes between operations, like FS_Sync() does
+  if(Disk_StartFlusher(log_filename, ratio, age, fs_lock, fs_unlock) < 0) {
+    dprintf("... couldn't start the flusher\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int FS_AllocPolicy(int policy)
+{
+  dprintf("FS_AllocPolicy(%d):\n", policy);
+  int old = alloc_policy;
+  if(policy == FS_ALLOC_FIRST || policy == FS_ALLOC_NEAR || policy == FS_ALLOC_ORLOV)
+    alloc_policy = policy;
+  return old;
+}
+
+int FS_Threads(int n)
+{
+  dprintf("FS_Threads(%d):\n", n);
+  pthread_mutex_lock(&task_pool_lock); // not while FS_Check() runs
+  int old = task_threads_wanted;
+  if(n >= 0 && n != old) {
+    task_stop_threads(); // started again when next needed
+    task_threads_wanted = n;
+  }
+  pthread_mutex_unlock(&task_pool_lock);
+  return old;
+}
+
+int FS_Check(int repair)
+{
+  dprintf("FS_Check(%d):\n", repair);
+  if(repair && is_read_only()) return -1;
+  check_t* c = calloc(1, sizeof(check_t));
+  pthread_mutex_lock(&task_pool_lock);
+  if(!c || task_start_threads() < 0) {
+    pthread_mutex_unlock(&task_pool_lock);
+    free(c);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  fs_lock();
+  int ret = 0;
+  for(int i=0; i<INODE_BITMAP_SECTORS; i++)
+    if(Disk_Read(INODE_BITMAP_START_SECTOR+i, (char*)c->inode_used+i*SECTOR_SIZE) < 0) ret = -1;
+  if(ret == 0 && !check_inode_used(c, 0)) check_count(c, 1, "root directory not in use", 0);
+
+  // the sectors that aren't data blocks are in use
+  for(int i=0; i<DATABLOCK_START_SECTOR; i++) check_sector(c, i, -1);
+  if(sb.features & FEATURE_CHECKPOINTS) check_sector(c, SHADOW_SUPERBLOCK_SECTOR, -1);
+  for(int i=0; i<sb.pathindex_sectors; i++) check_sector(c, sb.pathindex_start+i, -1);
+  for(int i=0; i<sb.hotinode_sectors; i++) check_sector(c, sb.hotinode_start+i, -1);
+
+  // the inodes, and then the directories, in parallel
+  if(ret == 0) {
+    for(int i=0; i<INODE_TABLE_SECTORS; i++)
+      task_spawn(check_inodes, c, i, 0);
+    task_wait();
+  }
+
+  // every inode in use but the root is in exactly one directory
+  for(int i=1; ret == 0 && i<MAX_FILES; i++)
+    if(check_inode_used(c, i) && c->refs[i] == 0) check_count(c, 1, "inode in no directory", i);
+
+  if(c->failed) ret = -1;
+
+  // the sector bitmap must be what the inodes say
+  SCRATCH(buf, SECTOR_SIZE);
+  if(!buf) ret = -1;
+  for(int i=0; ret == 0 && i<SECTOR_BITMAP_SECTORS; i++) {
+    char* want = (char*)c->sector_used+i*SECTOR_SIZE;
+    if(Disk_Read(SECTOR_BITMAP_START_SECTOR+i, buf) < 0) {
+      ret = -1;
+      break;
+    }
+    for(int k=0; k<SECTOR_SIZE && (i*SECTOR_SIZE+k)*8 < TOTAL_SECTORS; k++)
+      if(buf[k] != want[k])
+	check_count(c, __builtin_popcount((unsigned char)(buf[k] ^ want[k])),
+		    "sector bitmap differs, at sector", (i*SECTOR_SIZE+k)*8);
+    if(repair && memcmp(buf, want, SECTOR_SIZE) && Disk_Write(SECTOR_BITMAP_START_SECTOR+i, want) < 0)
+      ret = -1;
+  }
+  fs_unlock();
+  pthread_mutex_unlock(&task_pool_lock);
+
+  if(ret == 0) ret = c->problems;
+  else osErrno = E_GENERAL;
+  free(c);
+  dprintf("... %d problems found\n", ret);
+  return ret;
+}
+
+// compress the chunks of an archive (see Disk_SaveArchive()) on the
+// pool's threads; the pool lock is held
+typedef struct _export_call {
+  void (*fn)(void* arg, int k);
+  void* arg;
+} export_call_t;
+
+static void export_task(void* arg, int k, int b)
+{
+  export_call_t* call = arg;
+  call->fn(call->arg, k);
+}
+
+static void export_each(int n, void (*fn)(void* arg, int k), void* arg)
+{
+  export_call_t call = { fn, arg };
+  for(int k=0; k<n; k++)
+    task_spawn(export_task, &call, k, 0);
+  task_wait();
+}
+
+int FS_Export(char* archive)
+{
+  dprintf("FS_Export('%s'):\n", archive);
+
+  // the sector bitmap tells which sectors are worth keeping; they're
+  // taken between operations, and compressed on the pool's threads
+  // (on the caller's alone if they can't be started)
+  char map[SECTOR_BITMAP_SECTORS*SECTOR_SIZE];
+  pthread_mutex_lock(&task_pool_lock);
+  int threads = task_start_threads() == 0;
+  fs_lock();
+  int ret = 0;
+  for(int i=0; ret == 0 && i<SECTOR_BITMAP_SECTORS; i++)
+    ret = Disk_Read(SECTOR_BITMAP_START_SECTOR+i, map+i*SECTOR_SIZE);
+  if(ret == 0) ret = Disk_SaveArchive(archive, map, threads ? export_each : NULL);
+  fs_unlock();
+  pthread_mutex_unlock(&task_pool_lock);
+  if(ret < 0) {
+    dprintf("... failed to save archive '%s'\n", archive);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... successfully saved archive '%s'\n", archive);
+  return 0;
+}
+
+int FS_Import(char* archive)
+{
+  dprintf("FS_Import('%s'):\n", archive);
+  if(is_read_only()) return -1;
+
+  // the archive replaces the whole disk; it is saved to the
+  // backstore file with the next FS_Sync()
+  for(int i=0; i<MAX_FILES; i++) {
+    bloom_drop(i);
+    synced_size[i] = -1;
+    pathindex_slots[i] = 0;
+    pathindex_places[i].name[0] = '\0';
+  }
+  if(Disk_LoadArchive(archive) < 0 || !check_magic()) {
+    dprintf("... failed to load archive '%s'\n", archive);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  close_all_files();
+  dprintf("... successfully loaded archive '%s'\n", archive);
+  return 0;
+}
+
 int File_Create(char* file)
 {
   dprintf("File_Create('%s'):\n", file);
-  return create_file_or_directory(0, file);
+  if(is_read_only()) return -1;
+  fs_lock();
+  int ret = create_file_or_directory(0, file);
+  fs_unlock();
+  return ret;
 }
 
 /*
@@ -872,26 +2825,26 @@ int File_Create(char* file)
  * - removes its name from the directory
  * - frees up any data blocks and inodes used by the file
  */
- int File_Unlink(char* file)
+ static int unlink_file(char* file)
  {
    /* YOUR CODE */
-   dprintf("File_Unlink('%s'):\n", file);
-
    int child_inode;
-   char last_fname[MAX_NAME];
+   char last_fname[MAX_LONG_NAME];
    int parent_inode = follow_path(file, &child_inode, last_fname); //Get the father inode
 
    if(parent_inode >= 0) {
 
      if(child_inode >= 0) {
 
-       if(is_file_open(child_inode)==1){
+       if(file_in_use(child_inode)){
          osErrno = E_FILE_IN_USE;
          return -1;
        }
 
        int result;
+       inode_lock(child_inode); //wait for readers of the file in other processes
        result  = remove_inode(0, parent_inode, child_inode); //remove the inode representing a file
+       inode_unlock(child_inode);
 
        switch(result){
          case 0:   dprintf("Succefully removed the inode representing a file\n");
@@ -926,9 +2879,18 @@ int File_Create(char* file)
 
  }
 
-int File_Open(char* file)
+int File_Unlink(char* file)
+{
+  dprintf("File_Unlink('%s'):\n", file);
+  if(is_read_only()) return -1;
+  fs_lock();
+  int ret = unlink_file(file);
+  fs_unlock();
+  return ret;
+}
+
+static int open_file(char* file)
 {
-  dprintf("File_Open('%s'):\n", file);
   int fd = new_file_fd();
   if(fd < 0) {
     dprintf("... max open files reached\n");
@@ -937,23 +2899,14 @@ int File_Open(char* file)
   }
 
   int child_inode;
-  follow_path(file, &child_inode, NULL);
+  int parent_inode = follow_path(file, &child_inode, NULL);
   if(child_inode >= 0) { // child is the one
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-
-    if(Disk_Read(inode_sector, inode_buffer) < 0) {
+    // only the size and type of the inode are needed here
+    hot_inode_t child_attrs, *child = &child_attrs;
+    if(load_hot_inode(child_inode, child) < 0) {
        osErrno = E_GENERAL;
        return -1;
      }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
-    // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
     dprintf("... inode %d (size=%d, type=%d)\n",
 	    child_inode, child->size, child->type);
 
@@ -967,6 +2920,8 @@ int File_Open(char* file)
     open_files[fd].inode = child_inode;
     open_files[fd].size = child->size;
     open_files[fd].pos = 0;
+    open_files[fd].parent = parent_inode;
+    count_open(child_inode, 1);
     return fd;
   }
   else {
@@ -977,7 +2932,16 @@ int File_Open(char* file)
   return -1;
 }
 
-int File_Read(int fd, void* buffer, int size)
+int File_Open(char* file)
+{
+  dprintf("File_Open('%s'):\n", file);
+  fs_lock();
+  int fd = open_file(file);
+  fs_unlock();
+  return fd;
+}
+
+static int read_file(int fd, void* buffer, int size)
 {
   /* YOUR CODE */
   if (!is_file_open(fd)) {
@@ -987,14 +2951,11 @@ int File_Read(int fd, void* buffer, int size)
 
   open_file_t *f = &open_files[fd];
 
-  if (f->pos == f->size) {
-    return 0;
-  }
-
 
   // Load the disk sector containing the inode
   int  inode_sector = INODE_TABLE_START_SECTOR + f->inode / INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
 
   if (Disk_Read(inode_sector, inode_buffer) < 0) {
     osErrno = E_GENERAL;
@@ -1007,13 +2968,18 @@ int File_Read(int fd, void* buffer, int size)
   int offset            = f->inode - inode_start_entry;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
+  f->size = child->size; // it may have been changed through another fd or process
 
+  if (f->pos == f->size) {
+    return 0;
+  }
 
   int  left            = size;
   int  current_position_in_sector = f->pos % SECTOR_SIZE;
   int  current_sector        = f->pos / SECTOR_SIZE;
   int  out_pos         = 0;
-  char data_buf[SECTOR_SIZE];
+  SCRATCH(data_buf, SECTOR_SIZE);
+  if(!data_buf) return -1;
 
 
   while (left > 0 && f->pos < f->size) {
@@ -1043,11 +3009,20 @@ int File_Read(int fd, void* buffer, int size)
   return -1;
 }
 
+int File_Read(int fd, void* buffer, int size)
+{
+  int inode = (0 <= fd && fd < MAX_OPEN_FILES) ? open_files[fd].inode : 0;
+  inode_lock(inode);
+  int ret = read_file(fd, buffer, size);
+  inode_unlock(inode);
+  return ret;
+}
+
 /*
 This method writes the size bytes from the buffer and writes them into the file
 referenced by fd.
 */
-int File_Write(int fd, void* buffer, int size)
+static int write_file(int fd, void* buffer, int size)
 {
   /* YOUR CODE */
   if (!is_file_open(fd)) {
@@ -1055,6 +3030,7 @@ int File_Write(int fd, void* buffer, int size)
     osErrno = E_BAD_FD;
     return -1;
   }
+  if (is_read_only()) return -1;
   open_file_t *f = &open_files[fd];
   if (f->pos + size > MAX_SECTORS_PER_FILE * SECTOR_SIZE) {
     dprintf("Error: The file is too big to write to.\n");
@@ -1065,7 +3041,9 @@ int File_Write(int fd, void* buffer, int size)
 
   // Load the disk sector containing the inode
   int  inode_sector = INODE_TABLE_START_SECTOR + f->inode / INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  SCRATCH(data_buf, SECTOR_SIZE);
+  if (!inode_buffer || !data_buf) return -1;
 
   if (Disk_Read(inode_sector, inode_buffer) < 0) {
     osErrno = E_GENERAL;
@@ -1078,13 +3056,14 @@ int File_Write(int fd, void* buffer, int size)
   int offset = f->inode - inode_start_entry;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t *child = (inode_t *)(inode_buffer + offset * sizeof(inode_t));
+  f->size = child->size; // it may have been changed through another fd or process
 
   int allocated_sectors = (f->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
   int needed_sectors = (size - (allocated_sectors * SECTOR_SIZE - f->pos) + SECTOR_SIZE - 1) / SECTOR_SIZE;
 
   for (int i = allocated_sectors; i < allocated_sectors + needed_sectors; i++) {
 
-    int next = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
+    int next = alloc_sector(f->inode, child->data, i);
     dprintf("Assigning  the block %d, to the file for writing\n", next);
 
     if (next < 0) {
@@ -1094,17 +3073,16 @@ int File_Write(int fd, void* buffer, int size)
     }
     child->data[i] = next;
   }
-  Disk_Write(inode_sector, inode_buffer);
 
   allocated_sectors += needed_sectors;
   f->size = f->pos + size;
   child->size = f->size;
+  write_inodes(inode_sector, inode_buffer);
 
   int  left = size;
   int  current_position_in_sector = f->pos % SECTOR_SIZE;
   int  current_sector = f->pos / SECTOR_SIZE;
   int  in_pos = 0;
-  char data_buf[SECTOR_SIZE];
 
   // Write out while still in allocated sectors
   while (left > 0 && current_sector < allocated_sectors) {
@@ -1132,6 +3110,17 @@ int File_Write(int fd, void* buffer, int size)
   return result;
 }
 
+int File_Write(int fd, void* buffer, int size)
+{
+  int inode = (0 <= fd && fd < MAX_OPEN_FILES) ? open_files[fd].inode : 0;
+  fs_lock();
+  inode_lock(inode);
+  int ret = write_file(fd, buffer, size);
+  inode_unlock(inode);
+  fs_unlock();
+  return ret;
+}
+
 int File_Seek(int fd, int offset)
 {
   /* YOUR CODE */
@@ -1151,7 +3140,7 @@ int File_Seek(int fd, int offset)
 int File_Close(int fd)
 {
   dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
+  if(0 > fd || fd >= MAX_OPEN_FILES) {
     dprintf("... fd=%d out of bound\n", fd);
     osErrno = E_BAD_FD;
     return -1;
@@ -1163,21 +3152,114 @@ int File_Close(int fd)
   }
 
   dprintf("... file closed successfully\n");
+  count_open(open_files[fd].inode, -1);
   open_files[fd].inode = 0;
   return 0;
 }
 
+// load the sector of the inode table holding 'inode' into 'buffer'
+// and return the inode in it, or NULL on error (the inode number is
+// checked, not whether the inode is in use); the sector is returned
+// through 'sector' so that the caller can write the inode back
+static inode_t* load_inode(int inode, int* sector, char* buffer)
+{
+  if(inode < 0 || inode >= MAX_FILES) {
+    dprintf("... inode %d out of bound\n", inode);
+    osErrno = E_NO_SUCH_FILE;
+    return NULL;
+  }
+  *sector = INODE_TABLE_START_SECTOR+inode/INODES_PER_SECTOR;
+  if(Disk_Read(*sector, buffer) < 0) {
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  dprintf("... load inode table for inode %d from disk sector %d\n", inode, *sector);
+  return (inode_t*)(buffer+(inode%INODES_PER_SECTOR)*sizeof(inode_t));
+}
+
+// make the data of file 'inode' durable, along with its inode and
+// whatever else it takes to find the file again, unless 'data_only'
+// is set and the size is the same as when this was last done; the fs
+// lock is held; return 0 if successful, -1 otherwise
+static int sync_file(int inode, int data_only)
+{
+  int inode_sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  inode_t* child = load_inode(inode, &inode_sector, inode_buffer);
+  if(!child) return -1;
+
+  // the metadata sectors (bitmaps, directories, the path index) hold
+  // other files' changes too, which must be saved along with all of
+  // theirs, or a crash could leave half of them; so the metadata goes
+  // with everything else, as FS_Sync() saves it
+  if(!data_only || child->size != synced_size[inode]) {
+    dprintf("... sync all to make inode %d durable\n", inode);
+    if(sync_fs() < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    synced_size[inode] = child->size;
+    return 0;
+  }
+
+  // the data sectors are the file's own: they're written by themselves
+  // (only those that changed)
+  int sectors[MAX_SECTORS_PER_FILE], n = 0;
+  for(int i=0; i<(child->size+SECTOR_SIZE-1)/SECTOR_SIZE; i++)
+    sectors[n++] = child->data[i];
+  dprintf("... sync %d data sectors of inode %d\n", n, inode);
+  if(Disk_SyncSectors(bs_filename, fs_logged ? log_filename : NULL, sectors, n) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+static int file_sync(int fd, int data_only)
+{
+  if(0 > fd || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(fs_readonly) return 0; // nothing could have changed
+  fs_lock();
+  inode_lock(open_files[fd].inode);
+  int ret = sync_file(open_files[fd].inode, data_only);
+  inode_unlock(open_files[fd].inode);
+  fs_unlock();
+  return ret;
+}
+
+int File_Sync(int fd)
+{
+  dprintf("File_Sync(%d):\n", fd);
+  return file_sync(fd, 0);
+}
+
+int File_DataSync(int fd)
+{
+  dprintf("File_DataSync(%d):\n", fd);
+  return file_sync(fd, 1);
+}
+
 int Dir_Create(char* path)
 {
   dprintf("Dir_Create('%s'):\n", path);
-  return create_file_or_directory(1, path);
+  if(is_read_only()) return -1;
+  fs_lock();
+  int ret = create_file_or_directory(1, path);
+  fs_unlock();
+  return ret;
 }
 
-int Dir_Unlink(char* path)
+static int unlink_dir(char* path)
 {
   /* YOUR CODE */
   int child_inode; // maybe just child
-  char path_name[MAX_PATH];
+  SCRATCH(path_name, MAX_PATH);
+  if(!path_name) return -1;
   int parent_inode = follow_path(path, &child_inode, path_name);
   if(strcmp("/", path) == 0){
     osErrno = E_ROOT_DIR;
@@ -1195,10 +3277,21 @@ int Dir_Unlink(char* path)
   return 0;
 }
 
-int Dir_Size(char* path)
+int Dir_Unlink(char* path)
+{
+  dprintf("Dir_Unlink('%s'):\n", path);
+  if(is_read_only()) return -1;
+  fs_lock();
+  int ret = unlink_dir(path);
+  fs_unlock();
+  return ret;
+}
+
+static int dir_size(char* path)
 {
   /* YOUR CODE */
-  char path_name[MAX_PATH];
+  SCRATCH(path_name, MAX_PATH);
+  if(!path_name) return -1;
   int child_inode;
   int parent_inode = follow_path(path, &child_inode, path_name);
   int result = 0;
@@ -1207,20 +3300,12 @@ int Dir_Size(char* path)
     return -1;
   }
   if(child_inode >= 0){
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) {
+    // only the size and type of the inode are needed here
+    hot_inode_t child_attrs, *child = &child_attrs;
+    if(load_hot_inode(child_inode, child) < 0) {
       osErrno = E_GENERAL;
       return -1;
     }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
-    // get the inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = child_inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
     dprintf("... inode %d (size=%d, type=%d)\n", child_inode, child->size, child->type);
 
     if(child->type != 1){
@@ -1234,10 +3319,18 @@ int Dir_Size(char* path)
   return result;
 }
 
-int Dir_Read(char* path, void* buffer, int size)
+int Dir_Size(char* path)
+{
+  fs_lock();
+  int ret = dir_size(path);
+  fs_unlock();
+  return ret;
+}
+
+static int read_dir(char* path, void* buffer, int size)
 {
   /* YOUR CODE */
-  char child_name[16]; child_name[15] = '\0';
+  char child_name[MAX_LONG_NAME];
   int  child_node;
   int  parent_node = follow_path(path, &child_node, child_name);
 
@@ -1249,7 +3342,8 @@ int Dir_Read(char* path, void* buffer, int size)
   }
 
   int  inode_sector = INODE_TABLE_START_SECTOR + child_node / INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
 
   if (Disk_Read(inode_sector, inode_buffer) < 0) {
     return -1;
@@ -1264,28 +3358,526 @@ int Dir_Read(char* path, void* buffer, int size)
     return -1;
   }
 
-  int out_pos = 0;
   // Read sectors into buffer
-  // copy all dirents in full sectors
-  char sec_buf[SECTOR_SIZE];
+  int ret = copy_dirents(child, buffer);
+  if (ret < 0) {
+    osErrno = ret == -2 ? E_BUFFER_TOO_SMALL : E_GENERAL;
+    return -1;
+  }
+  return child->size;
+}
+
+int Dir_Read(char* path, void* buffer, int size)
+{
+  fs_lock();
+  int ret = read_dir(path, buffer, size);
+  fs_unlock();
+  return ret;
+}
+
+/* the following are the inode-level calls */
+
+// the views handed out by Dir_OpenView()
+static pool_t view_pool = POOL_INITIALIZER(1, Dir_View_t);
+
+static void release_view(Dir_View_t* view)
+{
+  for(int i=0; i<view->sectors; i++)
+    Disk_Unpin(view->sector[i]);
+  view->sectors = 0;
+  view->count = 0;
+}
+
+// pin the dirent sectors of directory 'inode' and point the entries
+// of 'view' into them
+static int view_dir_inode(int inode, Dir_View_t* view)
+{
+  int sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  view->sectors = view->count = 0;
+  inode_t* dir = load_inode(inode, &sector, inode_buffer);
+  if(!dir) return -1;
+  if(dir->type != 1) {
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  int vardirents = (sb.features & FEATURE_VARDIRENTS) != 0;
+  for(int i=0, left=dir->size; i<MAX_SECTORS_PER_FILE && dir->data[i] && left>0; i++) {
+    const char* buf = Disk_Pin(dir->data[i]);
+    if(!buf) {
+      release_view(view);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    view->sector[view->sectors++] = dir->data[i];
+    if(!vardirents) {
+      int n = left < DIRENTS_PER_SECTOR ? left : DIRENTS_PER_SECTOR;
+      for(int k=0; k<n; k++) {
+	dirent_t* e = (dirent_t*)buf+k;
+	Dir_Entry_t* out = &view->entry[view->count++];
+	out->name = e->fname;
+	out->len = strnlen(e->fname, MAX_NAME);
+	out->inode = e->inode;
+      }
+      left -= n;
+      continue;
+    }
+    int off = sizeof(vardir_header_t);
+    for(int k=0; k<((vardir_header_t*)buf)->count; k++) {
+      vardirent_t* e = (vardirent_t*)(buf+off);
+      Dir_Entry_t* out = &view->entry[view->count++];
+      out->name = e->fname;
+      out->len = e->len;
+      out->inode = e->inode;
+      off += VARDIRENT_SIZE(e->len);
+      left--;
+    }
+  }
+  return view->count;
+}
+
+static int read_dir_view(char* path, Dir_View_t* view)
+{
+  char name[MAX_LONG_NAME];
+  int inode;
+  view->sectors = view->count = 0;
+  if(follow_path(path, &inode, name) < 0 || inode < 0) {
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  return view_dir_inode(inode, view);
+}
+
+int Dir_ReadView(char* path, Dir_View_t* view)
+{
+  fs_lock();
+  int ret = read_dir_view(path, view);
+  fs_unlock();
+  return ret;
+}
+
+void Dir_ReleaseView(Dir_View_t* view)
+{
+  fs_lock();
+  release_view(view);
+  fs_unlock();
+}
+
+Dir_View_t* Dir_OpenView(char* path)
+{
+  Dir_View_t* view = pool_get(&view_pool);
+  if(!view) {
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  if(Dir_ReadView(path, view) < 0) {
+    pool_put(&view_pool, view);
+    return NULL;
+  }
+  return view;
+}
+
+void Dir_CloseView(Dir_View_t* view)
+{
+  if(!view) return;
+  Dir_ReleaseView(view);
+  pool_put(&view_pool, view);
+}
+
+static int lookup_inode(int dir, char* name)
+{
+  if(illegal_filename(name)) {
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  int sector;
+  SCRATCH(buffer, SECTOR_SIZE);
+  if(!buffer) return -1;
+  if(!load_inode(dir, &sector, buffer)) return -1;
+  int child_inode = find_child_inode(dir, name, &sector, buffer);
+  if(child_inode < 0) {
+    osErrno = child_inode == -1 ? E_NO_SUCH_FILE : E_NO_SUCH_DIR;
+    return -1;
+  }
+  return child_inode;
+}
+
+int Inode_Lookup(int dir, char* name)
+{
+  dprintf("Inode_Lookup(%d, '%s'):\n", dir, name);
+  fs_lock();
+  int ret = lookup_inode(dir, name);
+  fs_unlock();
+  return ret;
+}
+
+static int stat_inode(int inode, int* type, int* size)
+{
+  if(inode < 0 || inode >= MAX_FILES) {
+    dprintf("... inode %d out of bound\n", inode);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  hot_inode_t child;
+  if(load_hot_inode(inode, &child) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  *type = child.type;
+  *size = child.size;
+  return 0;
+}
+
+int Inode_Stat(int inode, int* type, int* size)
+{
+  inode_lock(inode);
+  int ret = stat_inode(inode, type, size);
+  inode_unlock(inode);
+  return ret;
+}
+
+static int create_inode(int dir, char* name, int type)
+{
+  if(illegal_filename(name)) {
+    dprintf("... illegal file name: '%s'\n", name);
+    int max_name = (sb.features & FEATURE_VARDIRENTS) ? MAX_LONG_NAME : MAX_NAME;
+    osErrno = strlen(name) > max_name-1 ? E_NAME_TOO_LONG : E_CREATE;
+    return -1;
+  }
+  int sector;
+  SCRATCH(buffer, SECTOR_SIZE);
+  if(!buffer) return -1;
+  if(!load_inode(dir, &sector, buffer)) return -1;
+  int child_inode = find_child_inode(dir, name, &sector, buffer);
+  if(child_inode != -1) {
+    dprintf("... '%s' already exists or %d is not a directory\n", name, dir);
+    osErrno = child_inode >= 0 ? E_CREATE : E_NO_SUCH_DIR;
+    return -1;
+  }
+  child_inode = add_inode(type, dir, name);
+  if(child_inode < 0) {
+    osErrno = child_inode == -2 ? E_NO_SUCH_DIR : E_NO_SPACE;
+    return -1;
+  }
+  return child_inode;
+}
+
+int Inode_Create(int dir, char* name, int type)
+{
+  dprintf("Inode_Create(%d, '%s', %d):\n", dir, name, type);
+  if(is_read_only()) return -1;
+  fs_lock();
+  int ret = create_inode(dir, name, type);
+  fs_unlock();
+  return ret;
+}
+
+static int unlink_inode(int dir, char* name, int type)
+{
+  int child_inode = lookup_inode(dir, name);
+  if(child_inode < 0) return -1;
+  if(type == 0 && file_in_use(child_inode)) {
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
 
-  for (int i = 0; i < child->size / DIRENTS_PER_SECTOR; i++) {
+  inode_lock(child_inode);
+  int result = remove_inode(type, dir, child_inode);
+  inode_unlock(child_inode);
+  switch(result) {
+  case 0:  return 0;
+  case -2: osErrno = E_DIR_NOT_EMPTY; return -1;
+  case -3: osErrno = type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE; return -1;
+  default: osErrno = E_GENERAL; return -1;
+  }
+}
+
+int Inode_Unlink(int dir, char* name, int type)
+{
+  dprintf("Inode_Unlink(%d, '%s', %d):\n", dir, name, type);
+  if(is_read_only()) return -1;
+  fs_lock();
+  int ret = unlink_inode(dir, name, type);
+  fs_unlock();
+  return ret;
+}
+
+// load the inode of a regular file, for reading or writing its content
+static inode_t* load_file_inode(int inode, int* sector, char* buffer)
+{
+  inode_t* child = load_inode(inode, sector, buffer);
+  if(child && child->type != 0) {
+    dprintf("... inode %d is not a file\n", inode);
+    osErrno = E_NO_SUCH_FILE;
+    return NULL;
+  }
+  return child;
+}
 
-    if (Disk_Read(child->data[i], sec_buf) < 0) {
+static int read_inode(int inode, int offset, void* buffer, int size)
+{
+  int sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  inode_t* child = load_file_inode(inode, &sector, inode_buffer);
+  if(!child) return -1;
+  if(offset < 0 || size < 0) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(offset >= child->size) return 0;
+  if(size > child->size-offset) size = child->size-offset;
+
+  SCRATCH(data_buf, SECTOR_SIZE);
+  if(!data_buf) return -1;
+  int done = 0;
+  while(done < size) {
+    int pos = offset+done;
+    int in_sector = pos%SECTOR_SIZE;
+    int n = SECTOR_SIZE-in_sector;
+    if(n > size-done) n = size-done;
+    if(Disk_Read(child->data[pos/SECTOR_SIZE], data_buf) < 0) {
+      osErrno = E_GENERAL;
       return -1;
     }
-    memcpy(buffer + out_pos, sec_buf, DIRENTS_PER_SECTOR * sizeof(dirent_t));
+    memcpy((char*)buffer+done, data_buf+in_sector, n);
+    done += n;
+  }
+  return done;
+}
+
+int Inode_Read(int inode, int offset, void* buffer, int size)
+{
+  inode_lock(inode);
+  int ret = read_inode(inode, offset, buffer, size);
+  inode_unlock(inode);
+  return ret;
+}
 
-    out_pos += DIRENTS_PER_SECTOR * sizeof(dirent_t);
+// write 'size' bytes at 'offset' of a file whose inode is at hand,
+// growing it as needed; bytes between the old end of the file and
+// 'offset' read back as zeros; a NULL 'buffer' writes zeros
+static int write_loaded_inode(inode_t* child, int inode_sector, char* inode_buffer,
+			      int offset, const void* buffer, int size)
+{
+  if(offset < 0 || size < 0) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(offset+size > MAX_FILE_SIZE) {
+    dprintf("... file too big\n");
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
   }
-  //copy over the last, partially filled sector
-  int left = child->size % DIRENTS_PER_SECTOR;
 
-  if (left > 0) {
-    if (Disk_Read(child->data[child->size / DIRENTS_PER_SECTOR], sec_buf) < 0) {
+  // get the new sectors first, so that running out of space leaves
+  // the file as it was
+  SCRATCH(data_buf, SECTOR_SIZE);
+  if(!data_buf) return -1;
+  int end = offset+size > child->size ? offset+size : child->size;
+  int allocated = (child->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  int needed = (end+SECTOR_SIZE-1)/SECTOR_SIZE;
+  int inode = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR+(child-(inode_t*)inode_buffer);
+  for(int i=allocated; i<needed; i++) {
+    int next = alloc_sector(inode, child->data, i);
+    if(next < 0) {
+      dprintf("... error: disk is full\n");
+      while(--i >= allocated)
+	bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]);
+      osErrno = E_NO_SPACE;
       return -1;
     }
-    memcpy(buffer + out_pos, sec_buf, left * sizeof(dirent_t));
+    child->data[i] = next;
+  }
+
+  // clear whatever the sectors hold past the old end of the file, up
+  // to where the new data starts
+  for(int pos=child->size; pos<offset; ) {
+    int in_sector = pos%SECTOR_SIZE;
+    int n = offset-pos < SECTOR_SIZE-in_sector ? offset-pos : SECTOR_SIZE-in_sector;
+    if(in_sector == 0) memset(data_buf, 0, SECTOR_SIZE);
+    else if(Disk_Read(child->data[pos/SECTOR_SIZE], data_buf) < 0) goto error;
+    memset(data_buf+in_sector, 0, n);
+    if(Disk_Write(child->data[pos/SECTOR_SIZE], data_buf) < 0) goto error;
+    pos += n;
+  }
+
+  for(int done=0; done<size; ) {
+    int pos = offset+done;
+    int in_sector = pos%SECTOR_SIZE;
+    int n = SECTOR_SIZE-in_sector;
+    if(n > size-done) n = size-done;
+    // keep the rest of a sector that is written in part, unless it
+    // lies past the end of the file (and wasn't just cleared above)
+    if(n < SECTOR_SIZE) {
+      if(pos-in_sector < child->size || in_sector > 0) {
+	if(Disk_Read(child->data[pos/SECTOR_SIZE], data_buf) < 0) goto error;
+      } else memset(data_buf, 0, SECTOR_SIZE);
+    }
+    if(buffer) memcpy(data_buf+in_sector, (const char*)buffer+done, n);
+    else memset(data_buf+in_sector, 0, n);
+    if(Disk_Write(child->data[pos/SECTOR_SIZE], data_buf) < 0) goto error;
+    done += n;
+  }
+
+  child->size = end;
+  if(write_inodes(inode_sector, inode_buffer) < 0) goto error;
+  return size;
+
+ error:
+  osErrno = E_GENERAL;
+  return -1;
+}
+
+static int write_inode(int inode, int offset, const void* buffer, int size)
+{
+  int sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  inode_t* child = load_file_inode(inode, &sector, inode_buffer);
+  if(!child) return -1;
+  return write_loaded_inode(child, sector, inode_buffer, offset, buffer, size);
+}
+
+int Inode_Write(int inode, int offset, void* buffer, int size)
+{
+  if(is_read_only()) return -1;
+  fs_lock();
+  inode_lock(inode);
+  int ret = write_inode(inode, offset, buffer, size);
+  inode_unlock(inode);
+  fs_unlock();
+  return ret;
+}
+
+static int truncate_inode(int inode, int size)
+{
+  int sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  inode_t* child = load_file_inode(inode, &sector, inode_buffer);
+  if(!child) return -1;
+  if(size >= child->size) // grow with zeros
+    return write_loaded_inode(child, sector, inode_buffer, child->size,
+			      NULL, size-child->size) < 0 ? -1 : 0;
+
+  // shrink, giving back the sectors no longer used (so that the next
+  // File_DataSync() saves the metadata too, even at the same size)
+  synced_size[inode] = -1;
+  for(int i=(size+SECTOR_SIZE-1)/SECTOR_SIZE; i<MAX_SECTORS_PER_FILE; i++) {
+    if(child->data[i] > 0)
+      bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]);
+    child->data[i] = 0;
+  }
+  child->size = size;
+  if(write_inodes(sector, inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int Inode_Truncate(int inode, int size)
+{
+  dprintf("Inode_Truncate(%d, %d):\n", inode, size);
+  if(is_read_only()) return -1;
+  fs_lock();
+  inode_lock(inode);
+  int ret = truncate_inode(inode, size);
+  inode_unlock(inode);
+  fs_unlock();
+  return ret;
+}
+
+int Inode_Sync(int inode, int data_only)
+{
+  dprintf("Inode_Sync(%d, %d):\n", inode, data_only);
+  if(fs_readonly) return 0; // nothing could have changed
+  fs_lock();
+  inode_lock(inode);
+  int ret = sync_file(inode, data_only);
+  inode_unlock(inode);
+  fs_unlock();
+  return ret;
+}
+
+static int read_dir_inode(int inode, void* buffer, int size)
+{
+  int sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  inode_t* child = load_inode(inode, &sector, inode_buffer);
+  if(!child) return -1;
+  if(child->type != 1) {
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  if(size < child->size*sizeof(dirent_t)) {
+    osErrno = E_BUFFER_TOO_SMALL;
+    return -1;
+  }
+
+  int ret = copy_dirents(child, buffer);
+  if(ret < 0) {
+    osErrno = ret == -2 ? E_BUFFER_TOO_SMALL : E_GENERAL;
+    return -1;
   }
   return child->size;
 }
+
+int Inode_ReadDir(int inode, void* buffer, int size)
+{
+  fs_lock();
+  int ret = read_dir_inode(inode, buffer, size);
+  fs_unlock();
+  return ret;
+}
+
+int Inode_ReadView(int inode, Dir_View_t* view)
+{
+  fs_lock();
+  int ret = view_dir_inode(inode, view);
+  fs_unlock();
+  return ret;
+}
+
+static int locate_inode(int inode, int offset, int size, int* fd, long* pos)
+{
+  *fd = Disk_Fd();
+  if(*fd < 0) {
+    dprintf("... the disk is not a file in place\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int sector;
+  SCRATCH(inode_buffer, SECTOR_SIZE);
+  if(!inode_buffer) return -1;
+  inode_t* child = load_file_inode(inode, &sector, inode_buffer);
+  if(!child) return -1;
+  if(offset < 0 || size < 0) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(offset >= child->size) return 0;
+  if(size > child->size-offset) size = child->size-offset;
+
+  // follow the run of consecutive sectors starting at 'offset'
+  int idx = offset/SECTOR_SIZE;
+  *pos = (long)child->data[idx]*SECTOR_SIZE+offset%SECTOR_SIZE;
+  int n = SECTOR_SIZE-offset%SECTOR_SIZE;
+  while(n < size && child->data[idx+1] == child->data[idx]+1) {
+    n += SECTOR_SIZE;
+    idx++;
+  }
+  return n < size ? n : size;
+}
+
+int Inode_Locate(int inode, int offset, int size, int* fd, long* pos)
+{
+  inode_lock(inode);
+  int ret = locate_inode(inode, offset, size, fd, pos);
+  inode_unlock(inode);
+  return ret;
+}
@@ -5,6 +5,10 @@
 #ifndef __LibFS_h__
 #define __LibFS_h__
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // error types
 typedef enum {
     E_GENERAL,      // general
@@ -20,10 +24,12 @@ typedef enum {
     E_DIR_NOT_EMPTY,
     E_ROOT_DIR,
     E_BUFFER_TOO_SMALL, 
+    E_READ_ONLY,
+    E_NAME_TOO_LONG, // from Inode_Create() (File_Create() gives E_CREATE)
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors; each thread has its own
+extern __thread int osErrno;
 
 // a few file system parameters
 
@@ -38,10 +44,90 @@ extern int osErrno;
 // the size of a file or directory is limited
 #define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
 
+// flags for FS_Mount()
+
+// mount read-only: the backstore is used in place and shared with
+// other readers, and it is never written (FS_Sync() does nothing)
+#define FS_RDONLY 0x1
+
+// mount shared: the backstore is used in place, and all processes
+// mounting it this way see each other's changes right away; they are
+// kept apart by locks kept in the file '<path>.lock', which also
+// counts the open files of all of them, so that no process unlinks a
+// file another has open (the files a process had open when it died
+// count until no process has it mounted); a process forked off a
+// shared mount mounts it again before using it
+#define FS_SHARED 0x2
+
+// when a new file system is formatted, keep a path index in it: any
+// path in the index is then looked up with a single probe, instead of
+// a search of every directory on the way
+#define FS_PATHINDEX 0x4
+
+// when a new file system is formatted, pack its directory entries:
+// each takes only the room its name needs, and names can be up to 63
+// characters long (Dir_Read() still gives fixed-size entries, so it
+// fails with E_BUFFER_TOO_SMALL on a directory with a name longer
+// than 15 characters; Dir_ReadView() gives them all)
+#define FS_VARDIRENTS 0x8
+
+// when a new file system is formatted, keep the size and type of all
+// inodes in a dense table as well, which is all that stat-like calls
+// (Dir_Size(), Inode_Stat()) need to read
+#define FS_HOTINODES 0x10
+
+// keep a log next to the backstore file ('<path>.log'): FS_Sync()
+// appends the sectors changed since the last sync to it, instead of
+// rewriting the whole file, and folds it back into the file once it
+// gets big; the log is applied by any later mount (a read-only one
+// applies it in memory only); while a process is mounted this way,
+// others can only mount the backstore read-only
+#define FS_LOGGED 0x20
+
 // file system generic calls
 int FS_Boot(char *path);
+int FS_Mount(char *path, int flags); // FS_Boot() is FS_Mount(path, 0)
 int FS_Sync();
 
+// append the changes to the log (see FS_LOGGED, which the file system
+// must be mounted with) from a background thread, without waiting for
+// FS_Sync(), once 'ratio' percent of the disk is dirty or the oldest
+// change is 'age' milliseconds old (a limit that isn't positive is
+// ignored, and both stop the flusher); like FS_Sync(), it only takes
+// the changes between calls, never halfway through one, so a crash
+// leaves the log with what some call left; the flusher lasts until
+// the next mount
+int FS_Flusher(int ratio, int age);
+
+// how new inodes and data sectors are picked: the lowest free ones
+// (the default), or ones close to the parent directory's, so that the
+// files of a directory sit together on disk (see Disk_GetStats() to
+// measure it); FS_ALLOC_ORLOV does the same, except that top-level
+// directories are spread out to the emptier parts of the disk, each
+// with its subtree packed around it; returns the policy in use before
+#define FS_ALLOC_FIRST 0
+#define FS_ALLOC_NEAR 1
+#define FS_ALLOC_ORLOV 2
+int FS_AllocPolicy(int policy);
+
+// check the file system: that every inode in use is in exactly one
+// directory, that directories only hold inodes in use, that no sector
+// is used twice, and that the sector bitmap says which sectors are in
+// use; with 'repair', the sector bitmap is written as it should be;
+// returns the number of problems found
+int FS_Check(int repair);
+
+// the number of threads that FS_Check() and FS_Export() spread their
+// work over, the caller's included; 0 is one per core (the default);
+// it waits for either call under way to finish; returns the number set
+// before (the other calls run on the caller's thread alone)
+int FS_Threads(int n);
+
+// compressed archives of the file system: only the sectors in use are
+// stored; FS_Boot() on an archive mounts it directly, read-only
+int FS_Export(char *archive);
+int FS_Import(char *archive);
+
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
@@ -49,6 +135,14 @@ int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
 int File_Seek(int fd, int offset);
 int File_Close(int fd);
+
+// make one file durable: its data, its inode and whatever it takes to
+// find it again; the metadata is shared with other files, so it's
+// saved as FS_Sync() saves it, with everything else; File_DataSync()
+// only writes the file's data when the size hasn't changed since it
+// was last synced, which is what makes it cheaper than FS_Sync()
+int File_Sync(int fd);
+int File_DataSync(int fd);
 int File_Unlink(char *file);
 
 // directory ops
@@ -57,4 +151,57 @@ int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// the entries of a directory as they are on disk, without copying
+// them out: the names point into the directory's sectors, which stay
+// in memory until Dir_ReleaseView() (FS_Mount() fails until every
+// view is released); the names aren't a snapshot, and change if the
+// directory does before then; a name is not null-terminated, and is
+// never cut short; the view is big, so it's best kept around rather
+// than put on the stack
+typedef struct _Dir_Entry {
+  const char *name;
+  int len;   // the length of the name
+  int inode;
+} Dir_Entry_t;
+
+typedef struct _Dir_View {
+  int count; // entries in entry[]
+  Dir_Entry_t entry[MAX_FILES];
+  int sectors; // the sectors pinned for the entries
+  int sector[MAX_SECTORS_PER_FILE];
+} Dir_View_t;
+
+int Dir_ReadView(char *path, Dir_View_t *view); // returns the count
+void Dir_ReleaseView(Dir_View_t *view);
+
+// the same, with the view taken from a pool kept by the library, and
+// given back by Dir_CloseView(); returns NULL if it can't be read
+Dir_View_t *Dir_OpenView(char *path);
+void Dir_CloseView(Dir_View_t *view);
+
+// inode-level ops, for front-ends that keep track of files by their
+// inode numbers rather than paths (e.g. the FUSE daemon); the root
+// directory is inode 0, and type 0 is a file and 1 a directory
+int Inode_Lookup(int dir, char *name); // the inode of 'name' in 'dir'
+int Inode_Stat(int inode, int *type, int *size);
+int Inode_Create(int dir, char *name, int type); // returns the new inode
+int Inode_Unlink(int dir, char *name, int type);
+int Inode_Read(int inode, int offset, void *buffer, int size);
+int Inode_Write(int inode, int offset, void *buffer, int size);
+int Inode_Truncate(int inode, int size);
+int Inode_Sync(int inode, int data_only); // same as File_Sync() (or File_DataSync())
+int Inode_ReadDir(int inode, void *buffer, int size); // same as Dir_Read()
+int Inode_ReadView(int inode, Dir_View_t *view); // same as Dir_ReadView()
+
+// where the data at 'offset' of a file lives in the disk image, when
+// the image is used in place (FS_RDONLY or FS_SHARED): returns how
+// many of the 'size' bytes there are stored contiguously from byte
+// 'pos' of the image file 'fd' (0 at the end of the file), so that
+// they can be sent without copying them
+int Inode_Locate(int inode, int offset, int size, int *fd, long *pos);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __LibFS_h__ */
@@ -0,0 +1,327 @@
+//
+// LibFS.hpp
+//
+// A header-only C++ (C++20) layer over LibFS: files and directories
+// are move-only handles that close themselves, reads and writes take
+// spans of the caller's memory (which LibFS copies to and from the
+// disk directly), directories are iterated in place over the sectors
+// they're stored in (see Dir_OpenView()), and failures are reported
+// as std::error_code values of libfs::category(), mapped from osErrno.
+//
+// Like std::filesystem, each call comes in two forms: one that throws
+// std::system_error, and one that takes a std::error_code& and sets it
+// instead.
+//
+
+#ifndef __LibFS_hpp__
+#define __LibFS_hpp__
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+namespace libfs {
+
+// the errors of LibFS (FS_Error_t), as std::error_code values; the
+// value of a code is its FS_Error_t plus one, since a code of value 0
+// means success and E_GENERAL is 0
+class error_category : public std::error_category {
+public:
+  const char* name() const noexcept override { return "libfs"; }
+  std::string message(int v) const override {
+    switch(v-1) {
+    case E_GENERAL: return "general error";
+    case E_CREATE: return "can't create";
+    case E_NO_SUCH_FILE: return "no such file";
+    case E_TOO_MANY_OPEN_FILES: return "too many open files";
+    case E_BAD_FD: return "bad file descriptor";
+    case E_NO_SPACE: return "no space left";
+    case E_FILE_TOO_BIG: return "file too big";
+    case E_SEEK_OUT_OF_BOUNDS: return "seek out of bounds";
+    case E_FILE_IN_USE: return "file in use";
+    case E_NO_SUCH_DIR: return "no such directory";
+    case E_DIR_NOT_EMPTY: return "directory not empty";
+    case E_ROOT_DIR: return "root directory";
+    case E_BUFFER_TOO_SMALL: return "buffer too small";
+    case E_READ_ONLY: return "read-only file system";
+    case E_NAME_TOO_LONG: return "name too long";
+    default: return "unknown error";
+    }
+  }
+  std::error_condition default_error_condition(int v) const noexcept override {
+    switch(v-1) {
+    case E_NO_SUCH_FILE: case E_NO_SUCH_DIR:
+      return std::errc::no_such_file_or_directory;
+    case E_TOO_MANY_OPEN_FILES: return std::errc::too_many_files_open;
+    case E_BAD_FD: return std::errc::bad_file_descriptor;
+    case E_NO_SPACE: return std::errc::no_space_on_device;
+    case E_FILE_TOO_BIG: return std::errc::file_too_large;
+    case E_SEEK_OUT_OF_BOUNDS: return std::errc::invalid_seek;
+    case E_FILE_IN_USE: return std::errc::device_or_resource_busy;
+    case E_DIR_NOT_EMPTY: return std::errc::directory_not_empty;
+    case E_ROOT_DIR: return std::errc::permission_denied;
+    case E_BUFFER_TOO_SMALL: return std::errc::value_too_large;
+    case E_READ_ONLY: return std::errc::read_only_file_system;
+    case E_NAME_TOO_LONG: return std::errc::filename_too_long;
+    default: return std::error_condition(v, *this);
+    }
+  }
+};
+
+inline const std::error_category& category()
+{
+  static error_category c;
+  return c;
+}
+
+} // namespace libfs
+
+// so that FS_Error_t values convert to (and compare with) error codes
+template<> struct std::is_error_code_enum<FS_Error_t> : std::true_type {};
+
+inline std::error_code make_error_code(FS_Error_t e)
+{
+  return std::error_code((int)e+1, libfs::category());
+}
+
+namespace libfs {
+
+namespace detail {
+
+// the error of the LibFS call that just failed
+inline std::error_code last_error()
+{
+  return make_error_code((FS_Error_t)osErrno);
+}
+
+// the size of a span as LibFS takes it; one of more than INT_MAX bytes
+// is cut short (no file is nearly that big), so a read or write of it
+// is short too
+inline int span_size(std::size_t size)
+{
+  return (int)std::min<std::size_t>(size, INT_MAX);
+}
+
+// 'ret' from a LibFS call: set 'ec' from osErrno if it failed
+inline int check(int ret, std::error_code& ec)
+{
+  if(ret < 0) ec = last_error();
+  else ec.clear();
+  return ret;
+}
+
+// the throwing form of a call made with an error_code
+template<typename F>
+inline auto or_throw(const char* what, F&& call)
+{
+  std::error_code ec;
+  auto ret = call(ec);
+  if(ec) throw std::system_error(ec, what);
+  return ret;
+}
+
+} // namespace detail
+
+// file system calls
+inline void mount(const char* path, int flags, std::error_code& ec)
+{
+  detail::check(FS_Mount(const_cast<char*>(path), flags), ec);
+}
+
+inline void mount(const char* path, int flags = 0)
+{
+  detail::or_throw("FS_Mount", [&](std::error_code& ec) { mount(path, flags, ec); return 0; });
+}
+
+inline void sync(std::error_code& ec)
+{
+  detail::check(FS_Sync(), ec);
+}
+
+inline void sync()
+{
+  detail::or_throw("FS_Sync", [&](std::error_code& ec) { sync(ec); return 0; });
+}
+
+// an open file; it's closed when the handle goes away
+class File {
+public:
+  File() = default;
+  explicit File(int fd) : fd_(fd) {}
+  File(File&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+  File& operator=(File&& other) noexcept {
+    if(this != &other) {
+      close();
+      fd_ = std::exchange(other.fd_, -1);
+    }
+    return *this;
+  }
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+  ~File() { close(); }
+
+  static File open(const char* path, std::error_code& ec) {
+    return File(detail::check(File_Open(const_cast<char*>(path)), ec));
+  }
+  static File open(const char* path) {
+    return detail::or_throw("File_Open", [&](std::error_code& ec) { return open(path, ec); });
+  }
+
+  // create the file, and open it
+  static File create(const char* path, std::error_code& ec) {
+    if(detail::check(File_Create(const_cast<char*>(path)), ec) < 0) return File();
+    return open(path, ec);
+  }
+  static File create(const char* path) {
+    return detail::or_throw("File_Create", [&](std::error_code& ec) { return create(path, ec); });
+  }
+
+  // read into (or write from) the caller's memory; return the number
+  // of bytes read (0 at the end of the file) or written
+  std::size_t read(std::span<std::byte> buf, std::error_code& ec) {
+    int n = detail::check(File_Read(fd_, buf.data(), detail::span_size(buf.size())), ec);
+    return n < 0 ? 0 : n;
+  }
+  std::size_t read(std::span<std::byte> buf) {
+    return detail::or_throw("File_Read", [&](std::error_code& ec) { return read(buf, ec); });
+  }
+  std::size_t write(std::span<const std::byte> buf, std::error_code& ec) {
+    int n = detail::check(File_Write(fd_, const_cast<std::byte*>(buf.data()),
+				     detail::span_size(buf.size())), ec);
+    return n < 0 ? 0 : n;
+  }
+  std::size_t write(std::span<const std::byte> buf) {
+    return detail::or_throw("File_Write", [&](std::error_code& ec) { return write(buf, ec); });
+  }
+
+  void seek(int offset, std::error_code& ec) { detail::check(File_Seek(fd_, offset), ec); }
+  void seek(int offset) {
+    detail::or_throw("File_Seek", [&](std::error_code& ec) { seek(offset, ec); return 0; });
+  }
+
+  void sync(std::error_code& ec) { detail::check(File_Sync(fd_), ec); }
+  void sync() { detail::or_throw("File_Sync", [&](std::error_code& ec) { sync(ec); return 0; }); }
+  void data_sync(std::error_code& ec) { detail::check(File_DataSync(fd_), ec); }
+  void data_sync() {
+    detail::or_throw("File_DataSync", [&](std::error_code& ec) { data_sync(ec); return 0; });
+  }
+
+  void close() {
+    if(fd_ >= 0) File_Close(fd_);
+    fd_ = -1;
+  }
+
+  // give up the descriptor without closing it
+  int release() { return std::exchange(fd_, -1); }
+
+  int fd() const { return fd_; }
+  explicit operator bool() const { return fd_ >= 0; }
+
+private:
+  int fd_ = -1;
+};
+
+// the entries of a directory, read in place (see Dir_OpenView()); the
+// names are views into the directory's sectors, good for as long as
+// the handle is (they change if the directory does, see Dir_View_t)
+class Dir {
+public:
+  struct entry {
+    std::string_view name;
+    int inode;
+  };
+
+  class iterator {
+  public:
+    using value_type = entry;
+    using difference_type = std::ptrdiff_t;
+    iterator() = default;
+    explicit iterator(const Dir_Entry_t* e) : e_(e) {}
+    entry operator*() const { return entry{std::string_view(e_->name, e_->len), e_->inode}; }
+    iterator& operator++() { ++e_; return *this; }
+    iterator operator++(int) { iterator old = *this; ++e_; return old; }
+    bool operator==(const iterator& other) const = default;
+  private:
+    const Dir_Entry_t* e_ = nullptr;
+  };
+
+  Dir() = default;
+  explicit Dir(Dir_View_t* view) : view_(view) {}
+  Dir(Dir&& other) noexcept : view_(std::exchange(other.view_, nullptr)) {}
+  Dir& operator=(Dir&& other) noexcept {
+    if(this != &other) {
+      close();
+      view_ = std::exchange(other.view_, nullptr);
+    }
+    return *this;
+  }
+  Dir(const Dir&) = delete;
+  Dir& operator=(const Dir&) = delete;
+  ~Dir() { close(); }
+
+  static Dir open(const char* path, std::error_code& ec) {
+    Dir_View_t* view = Dir_OpenView(const_cast<char*>(path));
+    detail::check(view ? 0 : -1, ec);
+    return Dir(view);
+  }
+  static Dir open(const char* path) {
+    return detail::or_throw("Dir_OpenView", [&](std::error_code& ec) { return open(path, ec); });
+  }
+
+  iterator begin() const { return iterator(view_ ? view_->entry : nullptr); }
+  iterator end() const { return iterator(view_ ? view_->entry+view_->count : nullptr); }
+  std::size_t size() const { return view_ ? view_->count : 0; }
+  bool empty() const { return size() == 0; }
+
+  void close() {
+    if(view_) Dir_CloseView(view_);
+    view_ = nullptr;
+  }
+
+  explicit operator bool() const { return view_ != nullptr; }
+
+private:
+  Dir_View_t* view_ = nullptr;
+};
+
+// directory calls
+inline void create_directory(const char* path, std::error_code& ec)
+{
+  detail::check(Dir_Create(const_cast<char*>(path)), ec);
+}
+
+inline void create_directory(const char* path)
+{
+  detail::or_throw("Dir_Create", [&](std::error_code& ec) { create_directory(path, ec); return 0; });
+}
+
+inline void remove_directory(const char* path, std::error_code& ec)
+{
+  detail::check(Dir_Unlink(const_cast<char*>(path)), ec);
+}
+
+inline void remove_directory(const char* path)
+{
+  detail::or_throw("Dir_Unlink", [&](std::error_code& ec) { remove_directory(path, ec); return 0; });
+}
+
+inline void remove_file(const char* path, std::error_code& ec)
+{
+  detail::check(File_Unlink(const_cast<char*>(path)), ec);
+}
+
+inline void remove_file(const char* path)
+{
+  detail::or_throw("File_Unlink", [&](std::error_code& ec) { remove_file(path, ec); return 0; });
+}
+
+} // namespace libfs
+
+#endif // __LibFS_hpp__
@@ -0,0 +1,236 @@
+//
+// LibFSAsync.hpp
+//
+// C++20 coroutines over LibFS: 'co_await fs.read(fd, buf)' and the
+// like hand the call to an I/O thread and suspend the coroutine until
+// it's done, so any number of file operations can be under way at
+// once from a few threads, none of which ever waits on the disk (on
+// FS_Sync(), say).
+//
+// The calls of an async_fs run one at a time on its I/O thread, in the
+// order they were submitted. The I/O thread takes all the calls queued
+// at once, and when there are several FS_Sync() among them, it makes
+// one (after all the others) that counts for them all.
+//
+// Where a coroutine resumes is up to the executor the async_fs is
+// given: by default it's on the I/O thread, right after its call. An
+// executor must keep running for as long as the async_fs does, since
+// the async_fs waits for the coroutines it has handed to it before it
+// goes.
+//
+
+#ifndef __LibFSAsync_hpp__
+#define __LibFSAsync_hpp__
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "LibFS.hpp"
+
+namespace libfs {
+
+// where coroutines are resumed once their call is done
+class executor {
+public:
+  virtual ~executor() = default;
+  virtual void post(std::function<void()> fn) = 0;
+};
+
+// a coroutine that starts right away and owns itself; it's what a
+// function that co_awaits LibFS calls can return when nothing waits
+// for its result (an exception that escapes it ends the program)
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+class async_fs {
+  // a call waiting in the queue; it lives in the awaitable, and so in
+  // the frame of the coroutine that waits for it
+  struct request {
+    virtual int run() = 0;
+    bool is_sync = false; // FS_Sync(), which can be shared
+    int ret = 0, err = 0; // what it returned, and osErrno
+    std::coroutine_handle<> waiter;
+    request* next = nullptr;
+  };
+
+public:
+  // the awaitable of a LibFS call 'F'; it gives the call's return
+  // value, and throws std::system_error if it failed (or sets 'ec' if
+  // one was given)
+  template<typename F>
+  class op : request {
+  public:
+    op(async_fs* fs, F f, std::error_code* ec, bool is_sync) : fs_(fs), f_(std::move(f)), ec_(ec) {
+      this->is_sync = is_sync;
+    }
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      this->waiter = h;
+      if(fs_->submit(this)) return true; // it may be resumed before this returns
+      // the I/O thread is gone
+      this->ret = -1;
+      this->err = E_GENERAL;
+      return false;
+    }
+    int await_resume() {
+      if(this->ret >= 0) {
+	if(ec_) ec_->clear();
+	return this->ret;
+      }
+      std::error_code e = make_error_code((FS_Error_t)this->err);
+      if(!ec_) throw std::system_error(e, "libfs::async_fs");
+      *ec_ = e;
+      return this->ret;
+    }
+  private:
+    int run() override { return f_(); }
+    async_fs* fs_;
+    F f_;
+    std::error_code* ec_;
+  };
+
+  explicit async_fs(executor* ex = nullptr) : ex_(ex), io_([this] { io_main(); }) {}
+
+  // the calls still queued are made before it goes, and so are those
+  // that their coroutines make once resumed, until none of them is
+  // left; a call made after that fails (with E_GENERAL)
+  ~async_fs() {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    io_.join();
+  }
+
+  async_fs(const async_fs&) = delete;
+  async_fs& operator=(const async_fs&) = delete;
+
+  // any LibFS call, as a function returning what it does
+  template<typename F>
+  op<F> call(F f, std::error_code* ec = nullptr) { return op<F>(this, std::move(f), ec, false); }
+
+  auto open(const char* path, std::error_code* ec = nullptr) {
+    return call([path] { return File_Open(const_cast<char*>(path)); }, ec);
+  }
+  auto close(int fd, std::error_code* ec = nullptr) {
+    return call([fd] { return File_Close(fd); }, ec);
+  }
+  auto read(int fd, std::span<std::byte> buf, std::error_code* ec = nullptr) {
+    return call([fd, buf] { return File_Read(fd, buf.data(), detail::span_size(buf.size())); }, ec);
+  }
+  auto write(int fd, std::span<const std::byte> buf, std::error_code* ec = nullptr) {
+    return call([fd, buf] {
+      return File_Write(fd, const_cast<std::byte*>(buf.data()), detail::span_size(buf.size()));
+    }, ec);
+  }
+  auto file_sync(int fd, std::error_code* ec = nullptr) {
+    return call([fd] { return File_Sync(fd); }, ec);
+  }
+  auto sync(std::error_code* ec = nullptr) {
+    auto f = [] { return FS_Sync(); };
+    return op<decltype(f)>(this, f, ec, true);
+  }
+
+private:
+  // queue a call; return false if the I/O thread is gone
+  bool submit(request* r) {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      if(closed_) return false;
+      pending_++;
+      if(tail_) tail_->next = r;
+      else head_ = r;
+      tail_ = r;
+    }
+    wake_.notify_one();
+    return true;
+  }
+
+  // the call is done: resume its coroutine (after which the request
+  // may be gone)
+  void complete(request* r) {
+    std::coroutine_handle<> h = r->waiter;
+    auto resume = [this, h] {
+      h.resume();
+      resumed();
+    };
+    if(ex_) ex_->post(resume);
+    else resume();
+  }
+
+  // a coroutine whose call was done has run until its next suspension
+  void resumed() {
+    bool last;
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      last = --pending_ == 0;
+    }
+    if(last) wake_.notify_one();
+  }
+
+  void io_main() {
+    for(;;) {
+      request* batch;
+      {
+	std::unique_lock<std::mutex> l(lock_);
+	wake_.wait(l, [this] { return head_ || (stop_ && pending_ == 0); });
+	if(!head_) {
+	  closed_ = true;
+	  return;
+	}
+	batch = head_;
+	head_ = tail_ = nullptr;
+      }
+
+      // make the calls in order, but the syncs only once, at the end
+      request *syncs = nullptr, **last_sync = &syncs;
+      for(request* r = batch; r; ) {
+	request* next = r->next;
+	r->next = nullptr;
+	if(r->is_sync) {
+	  *last_sync = r;
+	  last_sync = &r->next;
+	} else {
+	  r->ret = r->run();
+	  r->err = osErrno;
+	  complete(r);
+	}
+	r = next;
+      }
+      if(syncs) {
+	int ret = syncs->run(), err = osErrno;
+	for(request* r = syncs; r; ) {
+	  request* next = r->next;
+	  r->ret = ret;
+	  r->err = err;
+	  complete(r);
+	  r = next;
+	}
+      }
+    }
+  }
+
+  executor* ex_;
+  std::mutex lock_;
+  std::condition_variable wake_;
+  request *head_ = nullptr, *tail_ = nullptr;
+  int pending_ = 0;     // calls submitted whose coroutines haven't run since
+  bool stop_ = false;   // set once the async_fs is going
+  bool closed_ = false; // set once the I/O thread is done
+  std::thread io_; // last, so that it starts after the rest is set up
+};
+
+} // namespace libfs
+
+#endif // __LibFSAsync_hpp__
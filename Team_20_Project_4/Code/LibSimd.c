@@ -0,0 +1,362 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibSimd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+
+// the kernel variant in use; filled in by simd_init() when the
+// library is loaded
+typedef struct _simd_ops {
+  const char* name;
+  int (*is_zero)(const void* src, int n);
+  int (*popcount)(const void* src, int n);
+  int (*first_not_ff)(const void* src, int n);
+  int (*find_key16)(const char* base, int stride, int n, const void* key);
+  int (*find_int)(const char* base, int stride, int n, int value);
+} simd_ops_t;
+
+/* scalar kernels; these are also used for the tails of the vector ones */
+
+static int scalar_is_zero(const void* src, int n)
+{
+  const unsigned char* p = (const unsigned char*)src;
+  int i = 0;
+  for(; i+8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p+i, 8);
+    if(w) return 0;
+  }
+  for(; i < n; i++)
+    if(p[i]) return 0;
+  return 1;
+}
+
+static int scalar_popcount(const void* src, int n)
+{
+  const unsigned char* p = (const unsigned char*)src;
+  int count = 0, i = 0;
+  for(; i+8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p+i, 8);
+    count += __builtin_popcountll(w);
+  }
+  for(; i < n; i++)
+    count += __builtin_popcount(p[i]);
+  return count;
+}
+
+// return the index of the first byte that is not 0xff, or -1
+static int scalar_first_not_ff(const void* src, int n)
+{
+  const unsigned char* p = (const unsigned char*)src;
+  int i = 0;
+  for(; i+8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p+i, 8);
+    if(w != ~(uint64_t)0) break;
+  }
+  for(; i < n; i++)
+    if(p[i] != 0xff) return i;
+  return -1;
+}
+
+static int scalar_find_key16(const char* base, int stride, int n, const void* key)
+{
+  for(int i=0; i<n; i++)
+    if(!memcmp(base+i*stride, key, 16)) return i;
+  return -1;
+}
+
+static int scalar_find_int(const char* base, int stride, int n, int value)
+{
+  for(int i=0; i<n; i++) {
+    int v;
+    memcpy(&v, base+i*stride, sizeof(int));
+    if(v == value) return i;
+  }
+  return -1;
+}
+
+static const simd_ops_t scalar_ops = {
+  "scalar", scalar_is_zero, scalar_popcount, scalar_first_not_ff,
+  scalar_find_key16, scalar_find_int
+};
+
+#if SIMD_X86
+
+/* AVX2 kernels (32 bytes per step) */
+
+__attribute__((target("avx2")))
+static int avx2_is_zero(const void* src, int n)
+{
+  const char* s = (const char*)src;
+  int i = 0;
+  for(; i+128 <= n; i += 128) {
+    __m256i acc = _mm256_or_si256(
+      _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(s+i)),
+		      _mm256_loadu_si256((const __m256i*)(s+i+32))),
+      _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(s+i+64)),
+		      _mm256_loadu_si256((const __m256i*)(s+i+96))));
+    if(!_mm256_testz_si256(acc, acc)) return 0;
+  }
+  for(; i+32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(s+i));
+    if(!_mm256_testz_si256(v, v)) return 0;
+  }
+  return scalar_is_zero(s+i, n-i);
+}
+
+// nibble lookup popcount (Mula); the per-byte counts are summed into
+// four 64-bit lanes with psadbw
+__attribute__((target("avx2")))
+static int avx2_popcount(const void* src, int n)
+{
+  const char* s = (const char*)src;
+  const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+				       0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for(; i+32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(s+i));
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+				  _mm256_shuffle_epi8(lut, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+  }
+  int count = (int)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+		    _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+  return count + scalar_popcount(s+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static int avx2_first_not_ff(const void* src, int n)
+{
+  const char* s = (const char*)src;
+  const __m256i ones = _mm256_set1_epi8((char)0xff);
+  int i = 0;
+  for(; i+32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(s+i));
+    unsigned int m = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones));
+    if(m) return i + __builtin_ctz(m);
+  }
+  int r = scalar_first_not_ff(s+i, n-i);
+  return r < 0 ? -1 : i + r;
+}
+
+// two records per step: each 128-bit half holds one record's key, so
+// a record matches when its 16 bits of the byte mask are all set
+__attribute__((target("avx2")))
+static int avx2_find_key16(const char* base, int stride, int n, const void* key)
+{
+  __m128i k = _mm_loadu_si128((const __m128i*)key);
+  __m256i kk = _mm256_set_m128i(k, k);
+  int i = 0;
+  for(; i+2 <= n; i += 2) {
+    __m256i v = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(base+(i+1)*stride)),
+				 _mm_loadu_si128((const __m128i*)(base+i*stride)));
+    unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, kk));
+    if((m & 0xffff) == 0xffff) return i;
+    if((m >> 16) == 0xffff) return i+1;
+  }
+  if(i < n) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(base+i*stride));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, k)) == 0xffff) return i;
+  }
+  return -1;
+}
+
+// eight records per step with a strided gather
+__attribute__((target("avx2")))
+static int avx2_find_int(const char* base, int stride, int n, int value)
+{
+  __m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7),
+				   _mm256_set1_epi32(stride));
+  __m256i val = _mm256_set1_epi32(value);
+  int i = 0;
+  for(; i+8 <= n; i += 8) {
+    __m256i v = _mm256_i32gather_epi32((const int*)(base+i*stride), idx, 1);
+    int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, val)));
+    if(m) return i + __builtin_ctz(m);
+  }
+  int r = scalar_find_int(base+i*stride, stride, n-i, value);
+  return r < 0 ? -1 : i + r;
+}
+
+static const simd_ops_t avx2_ops = {
+  "avx2", avx2_is_zero, avx2_popcount, avx2_first_not_ff,
+  avx2_find_key16, avx2_find_int
+};
+
+/* AVX-512 kernels (64 bytes per step; byte ops need AVX-512BW) */
+
+#define AVX512 "avx512f,avx512bw,bmi2"
+
+__attribute__((target(AVX512)))
+static int avx512_is_zero(const void* src, int n)
+{
+  const char* s = (const char*)src;
+  int i = 0;
+  for(; i+256 <= n; i += 256) {
+    __m512i acc = _mm512_or_si512(
+      _mm512_or_si512(_mm512_loadu_si512(s+i), _mm512_loadu_si512(s+i+64)),
+      _mm512_or_si512(_mm512_loadu_si512(s+i+128), _mm512_loadu_si512(s+i+192)));
+    if(_mm512_test_epi64_mask(acc, acc)) return 0;
+  }
+  for(; i+64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512(s+i);
+    if(_mm512_test_epi64_mask(v, v)) return 0;
+  }
+  return scalar_is_zero(s+i, n-i);
+}
+
+__attribute__((target(AVX512)))
+static int avx512_popcount(const void* src, int n)
+{
+  const char* s = (const char*)src;
+  const __m512i lut = _mm512_set4_epi32(0x04030302, 0x03020201,
+					0x03020201, 0x02010100);
+  const __m512i low = _mm512_set1_epi8(0x0f);
+  __m512i acc = _mm512_setzero_si512();
+  int i = 0;
+  for(; i+64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512(s+i);
+    __m512i lo = _mm512_and_si512(v, low);
+    __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low);
+    __m512i cnt = _mm512_add_epi8(_mm512_shuffle_epi8(lut, lo),
+				  _mm512_shuffle_epi8(lut, hi));
+    acc = _mm512_add_epi64(acc, _mm512_sad_epu8(cnt, _mm512_setzero_si512()));
+  }
+  return (int)_mm512_reduce_add_epi64(acc) + scalar_popcount(s+i, n-i);
+}
+
+__attribute__((target(AVX512)))
+static int avx512_first_not_ff(const void* src, int n)
+{
+  const char* s = (const char*)src;
+  const __m512i ones = _mm512_set1_epi8((char)0xff);
+  int i = 0;
+  for(; i+64 <= n; i += 64) {
+    __mmask64 m = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(s+i), ones);
+    if(m) return i + __builtin_ctzll(m);
+  }
+  int r = scalar_first_not_ff(s+i, n-i);
+  return r < 0 ? -1 : i + r;
+}
+
+// four records per step, one per 128-bit lane
+__attribute__((target(AVX512)))
+static int avx512_find_key16(const char* base, int stride, int n, const void* key)
+{
+  __m512i kk = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)key));
+  int i = 0;
+  for(; i+4 <= n; i += 4) {
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)(base+i*stride)));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(base+(i+1)*stride)), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(base+(i+2)*stride)), 2);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(base+(i+3)*stride)), 3);
+    __mmask64 m = _mm512_cmpeq_epi8_mask(v, kk);
+    for(int j=0; j<4; j++)
+      if(((m >> (16*j)) & 0xffff) == 0xffff) return i+j;
+  }
+  int r = avx2_find_key16(base+i*stride, stride, n-i, key);
+  return r < 0 ? -1 : i + r;
+}
+
+// sixteen records per step with a strided gather
+__attribute__((target(AVX512)))
+static int avx512_find_int(const char* base, int stride, int n, int value)
+{
+  __m512i idx = _mm512_mullo_epi32(_mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15),
+				   _mm512_set1_epi32(stride));
+  __m512i val = _mm512_set1_epi32(value);
+  int i = 0;
+  for(; i+16 <= n; i += 16) {
+    __m512i v = _mm512_i32gather_epi32(idx, base+i*stride, 1);
+    __mmask16 m = _mm512_cmpeq_epi32_mask(v, val);
+    if(m) return i + __builtin_ctz(m);
+  }
+  int r = avx2_find_int(base+i*stride, stride, n-i, value);
+  return r < 0 ? -1 : i + r;
+}
+
+static const simd_ops_t avx512_ops = {
+  "avx512", avx512_is_zero, avx512_popcount, avx512_first_not_ff,
+  avx512_find_key16, avx512_find_int
+};
+
+#endif // SIMD_X86
+
+static const simd_ops_t* ops = &scalar_ops;
+
+// pick the kernel variant when the library is loaded; the variant can
+// be forced (e.g., for benchmarking) with the environment variable
+// LIBSIMD=scalar|avx2|avx512, as long as the CPU supports it
+__attribute__((constructor))
+static void simd_init()
+{
+#if SIMD_X86
+  __builtin_cpu_init();
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  int has_avx512 = __builtin_cpu_supports("avx512f") &&
+    __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("bmi2");
+
+  const char* want = getenv("LIBSIMD");
+  if(want && !strcmp(want, "scalar")) has_avx2 = has_avx512 = 0;
+  else if(want && !strcmp(want, "avx2")) has_avx512 = 0;
+
+  if(has_avx512) ops = &avx512_ops;
+  else if(has_avx2) ops = &avx2_ops;
+#endif
+}
+
+/* the exported kernels */
+
+int Simd_IsZero(const void* src, int n)
+{
+  return ops->is_zero(src, n);
+}
+
+int Simd_Popcount(const void* src, int n)
+{
+  return ops->popcount(src, n);
+}
+
+int Simd_FirstZeroBit(const void* src, int nbits)
+{
+  const unsigned char* p = (const unsigned char*)src;
+  int nbytes = nbits/8;
+  int idx = ops->first_not_ff(p, nbytes);
+  if(idx < 0) {
+    // all whole bytes are full; look at the leading bits of the
+    // partially used last byte, if any
+    if(nbits%8 == 0) return -1;
+    idx = nbytes;
+    if(p[idx] == 0xff) return -1;
+  }
+  int bit = __builtin_clz((~p[idx]) & 0xff) - 24; // msb first
+  if(idx == nbytes && bit >= nbits%8) return -1;
+  return idx*8 + bit;
+}
+
+int Simd_FindKey16(const void* base, int stride, int n, const void* key)
+{
+  return ops->find_key16((const char*)base, stride, n, key);
+}
+
+int Simd_FindInt(const void* base, int stride, int n, int value)
+{
+  return ops->find_int((const char*)base, stride, n, value);
+}
+
+const char* Simd_Variant()
+{
+  return ops->name;
+}
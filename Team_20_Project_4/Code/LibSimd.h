@@ -0,0 +1,41 @@
+//
+// LibSimd.h
+//
+// Scan kernels used on the sector paths of LibDisk and LibFS (zero
+// test, bitmap popcount and scan, record search). Copies and fills
+// are left to memcpy and memset, which glibc does at least as fast on
+// a sector. Each kernel has a scalar version plus AVX2 and AVX-512
+// versions; the fastest one supported by the CPU is picked once at
+// load time via CPUID.
+//
+
+#ifndef __LibSimd_h__
+#define __LibSimd_h__
+
+// return 1 if all 'n' bytes at 'src' are zero, and 0 otherwise
+int Simd_IsZero(const void* src, int n);
+
+// return the number of bits set to one in the 'n' bytes at 'src'
+int Simd_Popcount(const void* src, int n);
+
+// return the position of the first zero bit among the first 'nbits'
+// bits of the bitmap at 'src', or -1 if there is none; bits are
+// numbered from the most significant bit of each byte, the same way
+// the file system bitmaps are laid out
+int Simd_FirstZeroBit(const void* src, int nbits);
+
+// search 'n' records laid out 'stride' bytes apart starting at 'base'
+// and return the index of the first record whose leading 16 bytes are
+// equal to 'key', or -1 if there is none ('stride' must be at least 16)
+int Simd_FindKey16(const void* base, int stride, int n, const void* key);
+
+// same as above, but compare the int at the start of each record
+// against 'value'; pass the address of the int field of the first
+// record as 'base' ('stride' must be at least 4)
+int Simd_FindInt(const void* base, int stride, int n, int value);
+
+// return the name of the kernel variant in use ("scalar", "avx2" or
+// "avx512"); mostly for debugging and benchmarking
+const char* Simd_Variant();
+
+#endif /* __LibSimd_h__ */
@@ -0,0 +1,121 @@
+//
+// alloc-test.c
+//
+// Builds the same files in two directories at once with each
+// allocation policy, on a file system whose inodes right after the
+// first directory were freed again, and checks that FS_ALLOC_NEAR
+// gives the new files of a directory the inodes after it (where
+// FS_ALLOC_FIRST hands out the lowest free ones to either), and that
+// the data of each directory's files is stored as one run (where
+// FS_ALLOC_FIRST interleaves them); the files are the same either way.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define FILES 6
+#define SECTORS 2 // per file
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the sectors from the first to the last one holding the data of the
+// files of directory 'dir' (the image is used in place, so the data
+// can be located in it)
+static int span(int dir, char *prefix)
+{
+  char name[16];
+  int first = TOTAL_SECTORS, last = -1;
+  for(int i=0; i<FILES; i++) {
+    sprintf(name, "%s%d", prefix, i);
+    int inode = Inode_Lookup(dir, name);
+    for(int k=0; k<SECTORS; k++) {
+      int fd;
+      long pos;
+      CHECK(Inode_Locate(inode, k*SECTOR_SIZE, SECTOR_SIZE, &fd, &pos) > 0);
+      if(pos/SECTOR_SIZE < first) first = pos/SECTOR_SIZE;
+      if(pos/SECTOR_SIZE > last) last = pos/SECTOR_SIZE;
+    }
+  }
+  return last-first+1;
+}
+
+static void build(char *disk, int policy, int *a_span, int *b_span)
+{
+  char lock[1100];
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(lock);
+  if(FS_Mount(disk, FS_SHARED) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    exit(1);
+  }
+  CHECK(FS_AllocPolicy(policy) >= 0);
+  CHECK(FS_AllocPolicy(42) == policy);
+
+  // the inodes after /a are taken, and freed once /b is made
+  char name[16], buf[SECTORS*SECTOR_SIZE];
+  CHECK(Dir_Create("/a") == 0);
+  int a = Inode_Lookup(0, "a");
+  for(int i=0; i<20; i++) {
+    sprintf(name, "t%d", i);
+    CHECK(Inode_Create(a, name, 0) > 0);
+  }
+  CHECK(Dir_Create("/b") == 0);
+  int b = Inode_Lookup(0, "b");
+  for(int i=0; i<20; i++) {
+    sprintf(name, "t%d", i);
+    CHECK(Inode_Unlink(a, name, 0) == 0);
+  }
+
+  // then files are added to both, by turns
+  for(int i=0; i<FILES; i++) {
+    memset(buf, 'a'+i, sizeof(buf));
+    sprintf(name, "x%d", i);
+    int x = Inode_Create(a, name, 0);
+    CHECK(x > 0 && Inode_Write(x, 0, buf, sizeof(buf)) == sizeof(buf));
+    sprintf(name, "y%d", i);
+    int y = Inode_Create(b, name, 0);
+    CHECK(y > 0 && Inode_Write(y, 0, buf, sizeof(buf)) == sizeof(buf));
+    CHECK(policy == FS_ALLOC_FIRST ? y < b : (x > a && x < b && y > b));
+  }
+  *a_span = span(a, "x");
+  *b_span = span(b, "y");
+
+  for(int i=0; i<FILES; i++) {
+    sprintf(name, "y%d", i);
+    CHECK(Inode_Read(Inode_Lookup(b, name), 0, buf, sizeof(buf)) == sizeof(buf) && buf[0] == 'a'+i);
+  }
+  CHECK(FS_Check(0) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  int a_span, b_span;
+  build(argv[1], FS_ALLOC_FIRST, &a_span, &b_span);
+  CHECK(a_span > FILES*SECTORS && b_span > FILES*SECTORS);
+  build(argv[1], FS_ALLOC_NEAR, &a_span, &b_span);
+  CHECK(a_span == FILES*SECTORS && b_span == FILES*SECTORS);
+  FS_AllocPolicy(FS_ALLOC_FIRST);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("files of a directory kept together on file '%s'\n", argv[1]);
+  return 0;
+}
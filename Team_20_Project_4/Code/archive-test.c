@@ -0,0 +1,128 @@
+//
+// archive-test.c
+//
+// Exports a file system to a compressed archive, and checks that the
+// archive is much smaller than the image, that it mounts read-only with
+// everything in it, that it imports into another file system which
+// then saves it as its own, and that a damaged archive is turned down.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the content of file /dI/fJ
+static void content(char *buf, int size, int i, int j)
+{
+  for(int k=0; k<size; k++) buf[k] = 'a'+(i+j*k)%26;
+}
+
+// return true if the files made by main() are all there
+static int tree_holds()
+{
+  char path[64], buf[2000], got[2000];
+  for(int i=0; i<5; i++)
+    for(int j=0; j<5; j++) {
+      sprintf(path, "/d%d/f%d", i, j);
+      int fd = File_Open(path);
+      if(fd < 0) return 0;
+      File_Close(fd);
+      sprintf(path, "d%d", i);
+      int dir = Inode_Lookup(0, path);
+      sprintf(path, "f%d", j);
+      int file = Inode_Lookup(dir, path);
+      content(buf, sizeof(buf), i, j);
+      if(file < 0 || Inode_Read(file, 0, got, sizeof(got)) != 100*j ||
+	 memcmp(got, buf, 100*j)) return 0;
+    }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], archive[1100], other[1100], damaged[1100];
+  snprintf(archive, sizeof(archive), "%s.arch", disk);
+  snprintf(other, sizeof(other), "%s.other", disk);
+  snprintf(damaged, sizeof(damaged), "%s.damaged", disk);
+  unlink(disk);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  char path[64], buf[2000];
+  for(int i=0; i<5; i++) {
+    sprintf(path, "/d%d", i);
+    CHECK(Dir_Create(path) == 0);
+    sprintf(path, "d%d", i);
+    int dir = Inode_Lookup(0, path);
+    for(int j=0; j<5; j++) {
+      sprintf(path, "f%d", j);
+      content(buf, sizeof(buf), i, j);
+      CHECK(Inode_Write(Inode_Create(dir, path, 0), 0, buf, 100*j) == 100*j);
+    }
+  }
+  CHECK(tree_holds());
+  CHECK(FS_Export(archive) == 0);
+  struct stat st;
+  CHECK(stat(archive, &st) == 0 && st.st_size < (long)TOTAL_SECTORS*SECTOR_SIZE/20);
+
+  // mounted as it is, read-only
+  CHECK(FS_Boot(archive) == 0);
+  CHECK(tree_holds());
+  CHECK(FS_Check(0) == 0);
+  CHECK(File_Create("/new") < 0 && osErrno == E_READ_ONLY);
+  CHECK(File_Unlink("/d0/f0") < 0 && osErrno == E_READ_ONLY);
+  CHECK(FS_Sync() == 0);
+
+  // imported into another file system, which saves it
+  unlink(other);
+  CHECK(FS_Boot(other) == 0);
+  CHECK(File_Create("/gone") == 0);
+  CHECK(FS_Import(archive) == 0);
+  CHECK(File_Open("/gone") < 0);
+  CHECK(tree_holds());
+  CHECK(File_Create("/new") == 0);
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(other) == 0);
+  CHECK(tree_holds());
+  CHECK(Inode_Lookup(0, "new") > 0);
+  CHECK(FS_Check(0) == 0);
+
+  // a damaged archive is turned down, and leaves the mount as it was
+  FILE *in = fopen(archive, "r"), *out = fopen(damaged, "w");
+  CHECK(in && out);
+  for(long k=0; in && out && k<st.st_size/2; k++) fputc(fgetc(in), out);
+  if(in) fclose(in);
+  if(out) fclose(out);
+  CHECK(FS_Import(damaged) < 0);
+  CHECK(tree_holds());
+  CHECK(FS_Boot(damaged) < 0);
+
+  unlink(archive);
+  unlink(other);
+  unlink(damaged);
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("archives checked out on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,120 @@
+//
+// bloom-test.c
+//
+// Looks up names that aren't in a directory, and checks that the
+// directory's Bloom filter turns most of them down without reading its
+// entries, and that the filter never turns down a name that's there:
+// one added since it was built, one removed and added again, one in a
+// directory made again under the same inode, one brought in by
+// FS_Import(), or one added by another process sharing the image.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define NAMES 60   // spread over a few sectors of entries
+#define MISSES 100
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], archive[1100], lock[1100];
+  snprintf(archive, sizeof(archive), "%s.arch", disk);
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(lock);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+  CHECK(Dir_Create("/d") == 0);
+  int dir = Inode_Lookup(0, "d");
+  char name[64];
+  for(int i=0; i<NAMES; i++) {
+    sprintf(name, "f%d", i);
+    CHECK(Inode_Create(dir, name, 0) > 0);
+  }
+
+  // most misses read nothing of the directory
+  CHECK(Inode_Lookup(dir, "warm") < 0);
+  Disk_Stats_t stats;
+  Disk_ResetStats();
+  for(int i=0; i<MISSES; i++) {
+    sprintf(name, "g%d", i);
+    CHECK(Inode_Lookup(dir, name) < 0);
+  }
+  Disk_GetStats(&stats);
+  CHECK(stats.reads < 2*MISSES);
+
+  // names added since the filter was built, or removed and added back
+  CHECK(Inode_Create(dir, "g0", 0) > 0);
+  CHECK(Inode_Lookup(dir, "g0") > 0);
+  CHECK(File_Create("/d/g1") == 0);
+  CHECK(Inode_Lookup(dir, "g1") > 0);
+  CHECK(Inode_Unlink(dir, "f0", 0) == 0);
+  CHECK(Inode_Lookup(dir, "f0") < 0);
+  CHECK(Inode_Lookup(dir, "f1") > 0);
+  CHECK(File_Create("/d/f0") == 0);
+  CHECK(Inode_Lookup(dir, "f0") > 0);
+
+  // a directory made again in the same inode has none of the old names
+  CHECK(Dir_Create("/e") == 0);
+  int e = Inode_Lookup(0, "e");
+  CHECK(Inode_Create(e, "old", 0) > 0);
+  CHECK(Inode_Lookup(e, "new") < 0);
+  CHECK(Inode_Unlink(e, "old", 0) == 0);
+  CHECK(Dir_Unlink("/e") == 0);
+  CHECK(Inode_Create(0, "e", 1) == e);
+  CHECK(Inode_Lookup(e, "old") < 0);
+  CHECK(Inode_Create(e, "new", 0) > 0);
+  CHECK(Inode_Lookup(e, "new") > 0);
+
+  // an imported file system brings its own names
+  CHECK(FS_Export(archive) == 0);
+  CHECK(Inode_Unlink(dir, "g0", 0) == 0);
+  CHECK(Inode_Lookup(dir, "g0") < 0);
+  CHECK(FS_Import(archive) == 0);
+  CHECK(Inode_Lookup(dir, "g0") > 0);
+  CHECK(FS_Check(0) == 0);
+  CHECK(FS_Sync() == 0);
+  unlink(archive);
+
+  // another process sharing the image adds a name looked up here
+  CHECK(FS_Mount(disk, FS_SHARED) == 0);
+  CHECK(Inode_Lookup(dir, "h") < 0);
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0) {
+    if(FS_Mount(disk, FS_SHARED) < 0) _exit(1);
+    _exit(File_Create("/d/h") == 0 ? 0 : 1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(Inode_Lookup(dir, "h") > 0);
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("Bloom filters checked out on file '%s'\n", disk);
+  return 0;
+}
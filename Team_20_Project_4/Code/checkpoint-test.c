@@ -0,0 +1,165 @@
+//
+// checkpoint-test.c
+//
+// Syncs a file system a few times and checks that the two copies of
+// the superblock, in the first and the last sector of the image, take
+// turns with rising sequence numbers; that a mount uses the newer copy,
+// or the other one when the newer is torn (as a crash while it was
+// written would leave it) or the older is, and writes the torn one
+// over at the next sync; that a mount fails with both torn; and that
+// processes sharing the image never reuse a sequence number.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// the superblock as LibFS.c lays it out: the magic number first, the
+// checkpoint sequence number and the checksum after seven ints
+#define MAGIC 0
+#define SEQUENCE 7
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the sequence number of the copy of the superblock in sector
+// 'sector' of image 'disk', -1 if it doesn't look like one
+static int sequence(char *disk, int sector)
+{
+  int buf[SECTOR_SIZE/sizeof(int)];
+  int fd = open(disk, O_RDONLY);
+  int n = fd < 0 ? -1 : pread(fd, buf, sizeof(buf), (off_t)sector*SECTOR_SIZE);
+  if(fd >= 0) close(fd);
+  return n == sizeof(buf) && buf[MAGIC] == 0xdeadbeef ? buf[SEQUENCE] : -1;
+}
+
+// the sequence number of the newer copy of the superblock of 'disk'
+static int latest(char *disk)
+{
+  int a = sequence(disk, 0), b = sequence(disk, TOTAL_SECTORS-1);
+  return a > b ? a : b;
+}
+
+// write over sector 'sector' of image 'disk' from just after the magic
+// number, as a write cut short would leave it
+static void tear(char *disk, int sector)
+{
+  char junk[SECTOR_SIZE/2];
+  memset(junk, 0x5a, sizeof(junk));
+  int fd = open(disk, O_WRONLY);
+  CHECK(fd >= 0 && pwrite(fd, junk, sizeof(junk), (off_t)sector*SECTOR_SIZE+sizeof(int)) == sizeof(junk));
+  if(fd >= 0) close(fd);
+}
+
+// whether file 'name', in the root directory, holds 'size' bytes of
+// 'c' and nothing else
+static int holds(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE+1];
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0 || Inode_Read(inode, 0, buf, sizeof(buf)) != size) return 0;
+  for(int i=0; i<size; i++)
+    if(buf[i] != c) return 0;
+  return 1;
+}
+
+// add file 'name' holding 'size' bytes of 'c' to the root directory
+static int add(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE];
+  memset(buf, c, size);
+  int inode = Inode_Create(0, name, 0);
+  return inode < 0 ? -1 : Inode_Write(inode, 0, buf, size);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], lock[1100];
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(lock);
+  if(FS_Boot(disk) < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // the copies take turns, each sync writing the one not written last
+  int first = latest(disk);
+  CHECK(first > 0);
+  for(int i=1; i<=4; i++) {
+    CHECK(FS_Sync() == 0);
+    int last = first+i;
+    CHECK(latest(disk) == last);
+    CHECK(sequence(disk, last%2 ? TOTAL_SECTORS-1 : 0) == last);
+    CHECK(sequence(disk, last%2 ? 0 : TOTAL_SECTORS-1) == last-1);
+  }
+
+  // the newer copy torn, the other one is used, and written over next
+  CHECK(add("a", 'a', 1000) == 1000);
+  CHECK(FS_Sync() == 0);
+  int last = latest(disk);
+  int newer = last%2 ? TOTAL_SECTORS-1 : 0, older = TOTAL_SECTORS-1-newer;
+  tear(disk, newer);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("a", 'a', 1000));
+  CHECK(FS_Check(0) == 0);
+  CHECK(add("b", 'b', 2000) == 2000);
+  CHECK(FS_Sync() == 0);
+  CHECK(sequence(disk, newer) == last);
+  CHECK(sequence(disk, older) == last-1);
+
+  // the older copy torn, the newer one is used
+  tear(disk, older);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("a", 'a', 1000) && holds("b", 'b', 2000));
+  CHECK(FS_Check(0) == 0);
+  CHECK(FS_Sync() == 0);
+  CHECK(sequence(disk, older) == last+1);
+
+  // both torn, there's nothing to mount
+  tear(disk, 0);
+  tear(disk, TOTAL_SECTORS-1);
+  CHECK(FS_Boot(disk) < 0 && osErrno == E_GENERAL);
+
+  // processes sharing an image take the sequence numbers in turn
+  unlink(disk);
+  CHECK(FS_Mount(disk, FS_SHARED) == 0);
+  CHECK(FS_Sync() == 0);
+  last = latest(disk);
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0)
+    _exit(FS_Mount(disk, FS_SHARED) < 0 || add("c", 'c', 100) < 0 || FS_Sync() < 0);
+  int status;
+  waitpid(child, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(latest(disk) == last+1);
+  CHECK(FS_Sync() == 0);
+  CHECK(latest(disk) == last+2);
+  CHECK(sequence(disk, 0) != sequence(disk, TOTAL_SECTORS-1));
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("c", 'c', 100));
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("superblock checkpoints checked out on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,172 @@
+//
+// commit-test.c
+//
+// Kills a process at random points while it changes a file system
+// mounted the plain way and calls FS_Sync() after each change, most
+// small (committed through the log and written in place), some after
+// an FS_Import() (saved whole to a temporary file renamed over the
+// image, as too much of the disk is new to go through the log), and
+// checks each time that the image mounts, passes FS_Check(), and holds
+// the last change synced or the one after it, whole; a temporary file
+// left over from a crash, or from anything else, is no harm.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define CRASHES 12
+#define BIG 20 // files changed by every fourth change, after an import
+#define SMALL 1000 // bytes of the file changed every time
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// write 'size' bytes to file 'name', in the root directory, creating
+// it if needed: the number 'n' over and over
+static int fill(char *name, int n, int size)
+{
+  int buf[MAX_FILE_SIZE/sizeof(int)];
+  for(int i=0; i<size/sizeof(int); i++) buf[i] = n;
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0) inode = Inode_Create(0, name, 0);
+  return Inode_Write(inode, 0, (char*)buf, size);
+}
+
+// the number file 'name', in the root directory, holds 'size' bytes
+// of (see fill()), and nothing else; -1 if it holds anything else, 0
+// if there's no file
+static int held(char *name, int size)
+{
+  int buf[MAX_FILE_SIZE/sizeof(int)+1];
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0) return 0;
+  if(Inode_Read(inode, 0, (char*)buf, sizeof(buf)) != size) return -1;
+  for(int i=1; i<size/sizeof(int); i++)
+    if(buf[i] != buf[0]) return -1;
+  return buf[0];
+}
+
+// make change after change, from change 'first' on, syncing each, and
+// tell 'out' the number of each one synced, until killed; every fourth
+// one starts with the file system exported to 'archive' and imported
+// back, which makes all of the disk new
+static void change(char *disk, char *archive, int first, int out)
+{
+  if(FS_Boot(disk) < 0) _exit(1);
+  char name[16];
+  for(int n=first; ; n++) {
+    if(n%4 == 0 && (FS_Export(archive) < 0 || FS_Import(archive) < 0)) _exit(1);
+    if(n%4 == 0)
+      for(int i=0; i<BIG; i++) {
+	sprintf(name, "b%d", i);
+	if(fill(name, n, MAX_FILE_SIZE) != MAX_FILE_SIZE) _exit(1);
+      }
+    if(fill("s", n, SMALL) != SMALL || FS_Sync() < 0) _exit(1);
+    if(write(out, &n, sizeof(n)) != sizeof(n)) _exit(1);
+  }
+}
+
+// check what a crash left, after change 'synced' was; return the last
+// change made
+static int check_crash(char *disk, int synced)
+{
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(FS_Check(0) == 0);
+  int n = held("s", SMALL);
+  CHECK(n == synced || n == synced+1);
+
+  // the big files all hold the last fourth change up to it, if any
+  char name[16];
+  int big = held("b0", MAX_FILE_SIZE);
+  CHECK(big >= 0 && big%4 == 0 && big <= n && big > n-4);
+  for(int i=1; i<BIG; i++) {
+    sprintf(name, "b%d", i);
+    CHECK(held(name, MAX_FILE_SIZE) == big);
+  }
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], log[1100], tmp[1100], archive[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  snprintf(archive, sizeof(archive), "%s.arch", disk);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", disk);
+  unlink(disk);
+  unlink(log);
+  if(FS_Boot(disk) < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // a temporary file that has nothing to do with the image
+  int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  CHECK(fd >= 0 && write(fd, "junk", 4) == 4);
+  if(fd >= 0) close(fd);
+
+  int image = open(disk, O_RDONLY);
+  CHECK(image >= 0);
+  srand(getpid());
+  int last = 0;
+  for(int crash=0; crash<CRASHES; crash++) {
+    int pipes[2];
+    CHECK(pipe(pipes) == 0);
+    fflush(stdout);
+    pid_t child = fork();
+    if(child == 0) {
+      close(pipes[0]);
+      change(disk, archive, last+1, pipes[1]);
+    }
+    close(pipes[1]);
+
+    // let it sync a few changes, then kill it at some point after
+    int synced = last, n, wait = 1+rand()%6;
+    while(wait-- > 0 && read(pipes[0], &n, sizeof(n)) == sizeof(n)) synced = n;
+    usleep(rand()%20000);
+    kill(child, SIGKILL);
+    while(read(pipes[0], &n, sizeof(n)) == sizeof(n)) synced = n;
+    close(pipes[0]);
+    waitpid(child, NULL, 0);
+    CHECK(synced > last);
+    last = check_crash(disk, synced);
+  }
+
+  // the image was replaced by the imports (this is the old one)
+  struct stat st;
+  CHECK(fstat(image, &st) == 0 && st.st_nlink == 0);
+  close(image);
+
+  // and a clean sync lasts
+  CHECK(fill("s", last+1, SMALL) == SMALL);
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(held("s", SMALL) == last+1);
+  CHECK(FS_Check(0) == 0);
+
+  unlink(tmp);
+  unlink(archive);
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("%d crashes in the middle of syncs survived on file '%s'\n", CRASHES, disk);
+  return 0;
+}
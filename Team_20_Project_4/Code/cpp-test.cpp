@@ -0,0 +1,189 @@
+//
+// cpp-test.cpp
+//
+// Goes through the C++ layers over LibFS (LibFS.hpp and
+// LibFSAsync.hpp) on a new disk image: files, directories and errors,
+// both the throwing and the error_code forms, and a few coroutines on
+// an async_fs. Prints what fails; 'make test-cpp' builds and runs it.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <unistd.h>
+#include "LibFS.hpp"
+#include "LibFSAsync.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+// write a file, sync and read it back through the async_fs, all from
+// one coroutine; 'done' is set when it's over
+static libfs::detached copy_async(libfs::async_fs& fs, std::promise<int>& done)
+{
+  std::error_code ec;
+  int fd = co_await fs.open("/async-file");
+  std::byte out[100], in[100];
+  memset(out, 7, sizeof(out));
+  int n = co_await fs.write(fd, out);
+  co_await fs.sync();
+  co_await fs.close(fd);
+  fd = co_await fs.open("/async-file");
+  int m = co_await fs.read(fd, in);
+  co_await fs.close(fd);
+  co_await fs.open("/no-such-file", &ec);
+  done.set_value(n == 100 && m == 100 && !memcmp(in, out, 100) &&
+		 ec == std::errc::no_such_file_or_directory);
+}
+
+// resumes the coroutines on a thread of its own
+class thread_executor : public libfs::executor {
+public:
+  thread_executor() : thread_([this] { run(); }) {}
+  ~thread_executor() {
+    post(nullptr);
+    thread_.join();
+  }
+  void post(std::function<void()> fn) override {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      queue_.push_back(std::move(fn));
+    }
+    wake_.notify_one();
+  }
+private:
+  void run() {
+    for(;;) {
+      std::unique_lock<std::mutex> l(lock_);
+      wake_.wait(l, [this] { return !queue_.empty(); });
+      std::function<void()> fn = std::move(queue_.front());
+      queue_.pop_front();
+      l.unlock();
+      if(!fn) return;
+      fn();
+    }
+  }
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> queue_;
+  std::thread thread_;
+};
+
+// make 'n' calls one after the other, counting those that were made
+// (a call that's turned down returns -1 instead)
+static libfs::detached many_calls(libfs::async_fs& fs, int n, int& made)
+{
+  for(int i=0; i<n; i++) {
+    std::error_code ec;
+    if(co_await fs.call([] { return 1; }, &ec) == 1) made++;
+  }
+}
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  unlink(argv[1]);
+
+  try {
+    libfs::mount(argv[1]);
+
+    // files
+    {
+      libfs::File f = libfs::File::create("/first-file");
+      const char text[] = "hello from C++";
+      CHECK(f.write(std::as_bytes(std::span(text))) == sizeof(text));
+      f.seek(0);
+      std::byte back[sizeof(text)];
+      CHECK(f.read(back) == sizeof(text));
+      CHECK(!memcmp(back, text, sizeof(text)));
+      CHECK(f.read(back) == 0);
+      f.sync();
+    }
+
+    // directories
+    libfs::create_directory("/first-dir");
+    libfs::File::create("/first-dir/a");
+    libfs::File::create("/first-dir/b");
+    {
+      libfs::Dir d = libfs::Dir::open("/first-dir");
+      std::string names;
+      for(auto e : d) names += std::string(e.name) + " ";
+      CHECK(d.size() == 2);
+      CHECK(names == "a b ");
+    }
+
+    // errors, as error codes and as exceptions
+    std::error_code ec;
+    libfs::File::open("/no-such-file", ec);
+    CHECK(ec == std::errc::no_such_file_or_directory);
+    libfs::remove_directory("/first-dir", ec);
+    CHECK(ec == std::errc::directory_not_empty);
+    bool thrown = false;
+    try {
+      libfs::create_directory("/first-dir");
+    } catch(const std::system_error& e) {
+      thrown = e.code() == make_error_code(E_CREATE);
+    }
+    CHECK(thrown);
+
+    // E_GENERAL is 0 in FS_Error_t, but is still an error as a code
+    int fd = libfs::File::open("/first-dir", ec).fd();
+    CHECK(fd < 0 && ec && ec == E_GENERAL);
+    CHECK(ec.message() == "general error");
+    thrown = false;
+    try {
+      libfs::File::open("/first-dir");
+    } catch(const std::system_error& e) {
+      thrown = e.code() == E_GENERAL;
+    }
+    CHECK(thrown);
+
+    // coroutines
+    libfs::File::create("/async-file");
+    {
+      libfs::async_fs fs;
+      std::promise<int> done;
+      std::future<int> ok = done.get_future();
+      copy_async(fs, done);
+      CHECK(ok.get());
+    }
+
+    // an async_fs that goes while a coroutine on another thread still
+    // has calls to make waits for all of them
+    int made = 0;
+    {
+      thread_executor ex;
+      {
+	libfs::async_fs fs(&ex);
+	many_calls(fs, 50, made);
+      }
+      CHECK(made == 50);
+    }
+
+    libfs::remove_file("/first-dir/a");
+    libfs::remove_file("/first-dir/b");
+    libfs::remove_directory("/first-dir");
+    libfs::sync();
+  } catch(const std::system_error& e) {
+    printf("ERROR: %s: %s\n", e.what(), e.code().message().c_str());
+    failures++;
+  }
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("C++ layers checked out on file '%s'\n", argv[1]);
+  return 0;
+}
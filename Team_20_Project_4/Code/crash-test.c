@@ -0,0 +1,155 @@
+//
+// crash-test.c
+//
+// Kills a process at random points while it changes a file system
+// mounted with FS_LOGGED (with the flusher on, and an FS_Sync() now
+// and then), and checks each time that what it left behind, the
+// image plus the log, mounts again and passes FS_Check(); so does the
+// image with the log cut short at a few random points, as a crash at
+// an earlier flush would have left it. Every other round places the
+// new directories with FS_ALLOC_ORLOV.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "LibFS.h"
+
+#define ROUNDS 50
+#define CUTS 10
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file> [rounds]\n", prog);
+  exit(1);
+}
+
+// make and remove files and directories until killed
+static void churn(char *disk, int seed)
+{
+  if(FS_Mount(disk, FS_LOGGED) < 0 || FS_Flusher(1, 1) < 0) {
+    printf("ERROR: can't mount '%s' logged in the child\n", disk);
+    exit(1);
+  }
+  FS_AllocPolicy(seed%2 ? FS_ALLOC_ORLOV : FS_ALLOC_FIRST);
+  srand(seed);
+  char path[64], buf[2000];
+  memset(buf, 'x', sizeof(buf));
+  for(int op=0; ; op++) {
+    int d = rand()%8, f = rand()%8;
+    sprintf(path, "/d%d", d);
+    Dir_Create(path);
+    sprintf(path, "/d%d/f%d", d, f);
+    switch(rand()%4) {
+    case 0: case 1:
+      if(File_Create(path) == 0) {
+	int fd = File_Open(path);
+	File_Write(fd, buf, rand()%sizeof(buf));
+	File_Close(fd);
+      }
+      break;
+    case 2:
+      File_Unlink(path);
+      break;
+    case 3:
+      for(int i=0; i<8; i++) {
+	sprintf(path, "/d%d/f%d", d, i);
+	File_Unlink(path);
+      }
+      sprintf(path, "/d%d", d);
+      Dir_Unlink(path);
+      break;
+    }
+    if(op%500 == 499) FS_Sync();
+  }
+}
+
+// copy the first 'size' bytes of file 'from' to file 'to' (all of it
+// if 'size' is negative); return 0 if successful, -1 otherwise
+static int copy_file(char *from, char *to, long size)
+{
+  int in = open(from, O_RDONLY);
+  int out = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  char buf[65536];
+  int ret = in < 0 || out < 0 ? -1 : 0;
+  while(ret == 0 && size != 0) {
+    long n = read(in, buf, size < 0 || size > sizeof(buf) ? sizeof(buf) : size);
+    if(n <= 0) break;
+    if(write(out, buf, n) != n) ret = -1;
+    if(size > 0) size -= n;
+  }
+  if(in >= 0) close(in);
+  if(out >= 0) close(out);
+  return ret;
+}
+
+// mount 'disk' (replaying its log) and check it; return the number of
+// problems, or -1 if it can't be mounted
+static int replay(char *disk)
+{
+  if(FS_Boot(disk) < 0) return -1;
+  return FS_Check(0);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  char *disk = argv[1];
+  int rounds = argc == 3 ? atoi(argv[2]) : ROUNDS;
+  char log[1100], cut[1100], cut_log[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  snprintf(cut, sizeof(cut), "%s.cut", disk);
+  snprintf(cut_log, sizeof(cut_log), "%s.cut.log", disk);
+
+  int failures = 0, checks = 0;
+  srand(getpid());
+  for(int round=0; round<rounds; round++) {
+    unlink(disk);
+    unlink(log);
+    if(FS_Boot(disk) < 0 || FS_Sync() < 0) {
+      printf("ERROR: can't format '%s'\n", disk);
+      return -1;
+    }
+    pid_t child = fork();
+    if(child == 0) churn(disk, round);
+    usleep(5000+rand()%100000);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    // the log cut short, as an earlier crash would have left it
+    struct stat st;
+    for(int i=0; i<CUTS && stat(log, &st) == 0; i++) {
+      int problems;
+      checks++;
+      if(copy_file(disk, cut, -1) < 0 || copy_file(log, cut_log, rand()%(st.st_size+1)) < 0) {
+	printf("ERROR: round %d: can't copy '%s'\n", round, disk);
+	failures++;
+      } else if((problems = replay(cut)) != 0) {
+	printf("ERROR: round %d: %d problem(s) with the log cut short\n", round, problems);
+	failures++;
+      }
+    }
+
+    // and the whole log; the mount folds it into the image
+    int problems = replay(disk);
+    checks++;
+    if(problems != 0) {
+      printf("ERROR: round %d: %d problem(s) after the crash\n", round, problems);
+      failures++;
+    }
+  }
+  unlink(cut);
+  unlink(cut_log);
+
+  if(failures) {
+    printf("%d of %d check(s) failed\n", failures, checks);
+    return -1;
+  }
+  printf("%d crashes replayed cleanly on file '%s'\n", rounds, disk);
+  return 0;
+}
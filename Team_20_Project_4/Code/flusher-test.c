@@ -0,0 +1,121 @@
+//
+// flusher-test.c
+//
+// Changes a file system mounted with FS_LOGGED with the flusher on,
+// without ever calling FS_Sync(), kills the process, and checks that
+// the changes were flushed to the log once they were old enough, or
+// once enough of the disk was dirty, and that they're gone once the
+// flusher is stopped; the flusher needs FS_LOGGED.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// write 'size' bytes of 'c' to file 'name', in the root directory,
+// creating it if needed
+static int fill(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE];
+  memset(buf, c, size);
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0) inode = Inode_Create(0, name, 0);
+  return Inode_Write(inode, 0, buf, size);
+}
+
+// whether file 'name', in the root directory, holds 'size' bytes of
+// 'c' and nothing else
+static int holds(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE+1];
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0 || Inode_Read(inode, 0, buf, sizeof(buf)) != size) return 0;
+  for(int i=0; i<size; i++)
+    if(buf[i] != c) return 0;
+  return 1;
+}
+
+// with the flusher started, then set to 'ratio' and 'age', make files
+// called 'prefix'N, of 'files' times MAX_FILE_SIZE bytes in all, wait
+// long enough for the flusher, and die
+static void change_and_die(char *disk, int ratio, int age, char *prefix, int files)
+{
+  if(FS_Mount(disk, FS_LOGGED) < 0 || FS_Flusher(1, 1) < 0 || FS_Flusher(ratio, age) < 0)
+    _exit(1);
+  char name[16];
+  for(int i=0; i<files; i++) {
+    sprintf(name, "%s%d", prefix, i);
+    fill(name, 'a'+i, MAX_FILE_SIZE);
+  }
+  usleep(300*1000);
+  raise(SIGKILL);
+}
+
+// run change_and_die() in another process, then mount the image and
+// return the number of its files that were flushed
+static int flushed(char *disk, int ratio, int age, char *prefix, int files)
+{
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0) change_and_die(disk, ratio, age, prefix, files);
+  waitpid(child, NULL, 0);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(FS_Check(0) == 0);
+  CHECK(FS_Sync() == 0);
+  char name[16];
+  int n = 0;
+  for(int i=0; i<files; i++) {
+    sprintf(name, "%s%d", prefix, i);
+    if(holds(name, 'a'+i, MAX_FILE_SIZE)) n++;
+  }
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], log[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  unlink(disk);
+  unlink(log);
+  if(FS_Boot(disk) < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // only with FS_LOGGED
+  CHECK(FS_Flusher(1, 1) < 0 && osErrno == E_GENERAL);
+  CHECK(FS_Flusher(0, 0) == 0);
+
+  // changes old enough, or a dirty enough disk
+  CHECK(flushed(disk, 0, 20, "a", 1) == 1);
+  int files = TOTAL_SECTORS/100/MAX_SECTORS_PER_FILE+1; // over 1% of the disk
+  CHECK(flushed(disk, 1, 0, "r", files) == files);
+
+  // stopped, nothing is flushed
+  CHECK(flushed(disk, 0, 0, "s", 1) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("flusher checked out on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,413 @@
+//
+// fuse-libfs.c
+//
+// Mounts a LibFS disk image on a directory through FUSE, so that it
+// can be used (and benchmarked) with the usual tools. It uses the
+// low-level FUSE API: the FUSE inode numbers are the LibFS inode
+// numbers plus one (FUSE reserves 1 for the root, which is LibFS
+// inode 0). Requests are served by several threads, which call into
+// LibFS at the same time: it has locks of its own, and osErrno is
+// per thread. The image is mapped shared, so the slow-* tools can work on it
+// while it is mounted, and file data is spliced to the kernel right
+// from the image file rather than copied.
+//
+// Needs libfuse 3 ('make fuse'); unmount with 'fusermount3 -u dir'.
+//
+
+#define FUSE_USE_VERSION 34
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// a directory entry, as returned by Inode_ReadDir()
+#define DIRENT_SIZE 20
+
+// how long the kernel may cache names and attributes (in seconds);
+// kept short since other processes may change the image
+#define CACHE_TIMEOUT 1.0
+
+#define FS_INODE(ino) ((int)(ino)-1)
+#define FUSE_INODE(inode) ((fuse_ino_t)(inode)+1)
+
+// the parent of each directory, as last looked up or made here, for
+// the '..' entry of readdir (LibFS doesn't keep one); the kernel looks
+// a directory up before reading it, so only the root is left at 0,
+// which is its own parent
+static int parents[MAX_FILES];
+
+static void set_parent(int inode, int parent)
+{
+  if(0 <= inode && inode < MAX_FILES) __atomic_store_n(&parents[inode], parent, __ATOMIC_RELAXED);
+}
+
+static int get_parent(int inode)
+{
+  return 0 <= inode && inode < MAX_FILES ? __atomic_load_n(&parents[inode], __ATOMIC_RELAXED) : 0;
+}
+
+// the errno value for the last LibFS error
+static int fs_errno()
+{
+  switch(osErrno) {
+  case E_CREATE: return EEXIST;
+  case E_NO_SUCH_FILE: return ENOENT;
+  case E_NO_SUCH_DIR: return ENOENT;
+  case E_TOO_MANY_OPEN_FILES: return ENFILE;
+  case E_NO_SPACE: return ENOSPC;
+  case E_FILE_TOO_BIG: return EFBIG;
+  case E_SEEK_OUT_OF_BOUNDS: return EINVAL;
+  case E_FILE_IN_USE: return EBUSY;
+  case E_DIR_NOT_EMPTY: return ENOTEMPTY;
+  case E_ROOT_DIR: return EBUSY;
+  case E_BUFFER_TOO_SMALL: return ERANGE;
+  case E_READ_ONLY: return EROFS;
+  case E_NAME_TOO_LONG: return ENAMETOOLONG;
+  default: return EIO;
+  }
+}
+
+// fill in the attributes of a LibFS inode
+static int get_attr(int inode, struct stat* st)
+{
+  int type, size;
+  if(Inode_Stat(inode, &type, &size) < 0) return -1;
+  memset(st, 0, sizeof(*st));
+  st->st_ino = FUSE_INODE(inode);
+  if(type == 1) {
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    st->st_size = size*DIRENT_SIZE;
+  } else {
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = size;
+  }
+  st->st_blksize = SECTOR_SIZE;
+  st->st_blocks = (st->st_size+511)/512;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  return 0;
+}
+
+// reply with the entry for a LibFS inode found or made in directory
+// 'parent'
+static void reply_entry(fuse_req_t req, int parent, int inode)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  if(get_attr(inode, &e.attr) < 0) {
+    fuse_reply_err(req, fs_errno());
+    return;
+  }
+  if(S_ISDIR(e.attr.st_mode)) set_parent(inode, parent);
+  e.ino = FUSE_INODE(inode);
+  e.attr_timeout = CACHE_TIMEOUT;
+  e.entry_timeout = CACHE_TIMEOUT;
+  fuse_reply_entry(req, &e);
+}
+
+static void libfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  int inode = Inode_Lookup(FS_INODE(parent), (char*)name);
+  if(inode < 0) fuse_reply_err(req, fs_errno());
+  else reply_entry(req, FS_INODE(parent), inode);
+}
+
+static void libfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  struct stat st;
+  if(get_attr(FS_INODE(ino), &st) < 0) fuse_reply_err(req, fs_errno());
+  else fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+// only the size can be changed; mode, owner and times are ignored,
+// since LibFS doesn't keep them
+static void libfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+			  int to_set, struct fuse_file_info* fi)
+{
+  struct stat st;
+  if(((to_set & FUSE_SET_ATTR_SIZE) &&
+      Inode_Truncate(FS_INODE(ino), attr->st_size) < 0) ||
+     get_attr(FS_INODE(ino), &st) < 0)
+    fuse_reply_err(req, fs_errno());
+  else fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+// the name is checked by LibFS, whose limit depends on the image
+// (see FS_VARDIRENTS)
+static void create_inode(fuse_req_t req, fuse_ino_t parent, const char* name,
+			 int type, struct fuse_file_info* fi)
+{
+  int inode = Inode_Create(FS_INODE(parent), (char*)name, type);
+  if(inode < 0) fuse_reply_err(req, fs_errno());
+  else if(!fi) reply_entry(req, FS_INODE(parent), inode);
+  else {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    get_attr(inode, &e.attr);
+    e.ino = FUSE_INODE(inode);
+    e.attr_timeout = CACHE_TIMEOUT;
+    e.entry_timeout = CACHE_TIMEOUT;
+    fuse_reply_create(req, &e, fi);
+  }
+}
+
+static void libfs_mknod(fuse_req_t req, fuse_ino_t parent, const char* name,
+			mode_t mode, dev_t rdev)
+{
+  if(!S_ISREG(mode)) fuse_reply_err(req, EPERM);
+  else create_inode(req, parent, name, 0, NULL);
+}
+
+static void libfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+  create_inode(req, parent, name, 1, NULL);
+}
+
+static void libfs_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+			 mode_t mode, struct fuse_file_info* fi)
+{
+  create_inode(req, parent, name, 0, fi);
+}
+
+static void unlink_inode(fuse_req_t req, fuse_ino_t parent, const char* name, int type)
+{
+  int inode, itype, size;
+  if((inode = Inode_Lookup(FS_INODE(parent), (char*)name)) < 0 ||
+     Inode_Stat(inode, &itype, &size) < 0)
+    fuse_reply_err(req, ENOENT);
+  else if(itype != type)
+    fuse_reply_err(req, type ? ENOTDIR : EISDIR);
+  else if(Inode_Unlink(FS_INODE(parent), (char*)name, type) < 0)
+    fuse_reply_err(req, fs_errno());
+  else fuse_reply_err(req, 0);
+}
+
+static void libfs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  unlink_inode(req, parent, name, 0);
+}
+
+static void libfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  unlink_inode(req, parent, name, 1);
+}
+
+static void libfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  int type, size;
+  if(Inode_Stat(FS_INODE(ino), &type, &size) < 0) fuse_reply_err(req, fs_errno());
+  else if(type != 0) fuse_reply_err(req, EISDIR);
+  else fuse_reply_open(req, fi);
+}
+
+// send the data from the image file itself when it is used in place
+// (the kernel moves the pages with splice); otherwise copy it out
+static void libfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		       struct fuse_file_info* fi)
+{
+  int inode = FS_INODE(ino);
+  if(size > MAX_FILE_SIZE) size = MAX_FILE_SIZE;
+  if(off > MAX_FILE_SIZE) off = MAX_FILE_SIZE;
+
+  int fd, n = 0;
+  long pos;
+  if(Disk_Fd() >= 0) {
+    // one buffer for each run of consecutive sectors
+    struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec)+
+				      MAX_SECTORS_PER_FILE*sizeof(struct fuse_buf));
+    memset(bufv, 0, sizeof(struct fuse_bufvec));
+    size_t done = 0;
+    while(done < size &&
+	  (n = Inode_Locate(inode, off+done, size-done, &fd, &pos)) > 0) {
+      struct fuse_buf* b = &bufv->buf[bufv->count++];
+      memset(b, 0, sizeof(*b));
+      b->size = n;
+      b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      b->fd = fd;
+      b->pos = pos;
+      done += n;
+    }
+    if(n < 0) fuse_reply_err(req, fs_errno());
+    else if(bufv->count == 0) fuse_reply_buf(req, NULL, 0);
+    else fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    free(bufv);
+  } else {
+    char buf[MAX_FILE_SIZE];
+    n = Inode_Read(inode, off, buf, size);
+    if(n < 0) fuse_reply_err(req, fs_errno());
+    else fuse_reply_buf(req, buf, n);
+  }
+}
+
+static void libfs_write(fuse_req_t req, fuse_ino_t ino, const char* buf,
+			size_t size, off_t off, struct fuse_file_info* fi)
+{
+  if(off+size > MAX_FILE_SIZE) {
+    fuse_reply_err(req, EFBIG);
+    return;
+  }
+  int n = Inode_Write(FS_INODE(ino), off, (void*)buf, size);
+  if(n < 0) fuse_reply_err(req, fs_errno());
+  else fuse_reply_write(req, n);
+}
+
+// a directory is read in place (see Dir_View_t) from opendir to
+// releasedir, with the view kept in fi->fh; so long names
+// (FS_VARDIRENTS) come whole, and each readdir only copies out the
+// entries it returns; another thread may change the directory in the
+// meantime, and a readdir from the start (rewinddir) reads it again
+static void libfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  Dir_View_t* view = malloc(sizeof(Dir_View_t));
+  if(!view) fuse_reply_err(req, ENOMEM);
+  else if(Inode_ReadView(FS_INODE(ino), view) < 0) {
+    fuse_reply_err(req, fs_errno());
+    free(view);
+  } else {
+    fi->fh = (uintptr_t)view;
+    if(fuse_reply_open(req, fi) != 0) {
+      Dir_ReleaseView(view);
+      free(view);
+    }
+  }
+}
+
+static void libfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  Dir_View_t* view = (Dir_View_t*)(uintptr_t)fi->fh;
+  Dir_ReleaseView(view);
+  free(view);
+  fuse_reply_err(req, 0);
+}
+
+// the offset of an entry is its index plus 3 ('.' is 1 and '..' 2)
+static void libfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			  struct fuse_file_info* fi)
+{
+  Dir_View_t* view = (Dir_View_t*)(uintptr_t)fi->fh;
+  if(off == 0) {
+    Dir_ReleaseView(view);
+    if(Inode_ReadView(FS_INODE(ino), view) < 0) {
+      fuse_reply_err(req, fs_errno());
+      return;
+    }
+  }
+  char* buf = malloc(size);
+  if(!buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  size_t used = 0;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  for(off_t i=off; i<view->count+2; i++) {
+    char name[256];
+    if(i < 2) {
+      strcpy(name, i == 0 ? "." : "..");
+      st.st_ino = i == 0 ? ino : FUSE_INODE(get_parent(FS_INODE(ino)));
+      st.st_mode = S_IFDIR;
+    } else {
+      Dir_Entry_t* e = &view->entry[i-2];
+      snprintf(name, sizeof(name), "%.*s", e->len, e->name);
+      st.st_ino = FUSE_INODE(e->inode);
+      st.st_mode = 0; // unknown, the kernel looks it up
+    }
+    size_t n = fuse_add_direntry(req, buf+used, size-used, name, &st, i+1);
+    if(n > size-used) break;
+    used += n;
+  }
+  fuse_reply_buf(req, buf, used);
+  free(buf);
+}
+
+// just the one file, as File_Sync() (or File_DataSync()) does
+static void libfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			struct fuse_file_info* fi)
+{
+  fuse_reply_err(req, Inode_Sync(FS_INODE(ino), datasync) < 0 ? fs_errno() : 0);
+}
+
+static const struct fuse_lowlevel_ops libfs_ops = {
+  .lookup = libfs_lookup,
+  .getattr = libfs_getattr,
+  .setattr = libfs_setattr,
+  .mknod = libfs_mknod,
+  .mkdir = libfs_mkdir,
+  .unlink = libfs_unlink,
+  .rmdir = libfs_rmdir,
+  .open = libfs_open,
+  .read = libfs_read,
+  .write = libfs_write,
+  .fsync = libfs_fsync,
+  .opendir = libfs_opendir,
+  .readdir = libfs_readdir,
+  .releasedir = libfs_releasedir,
+  .create = libfs_create,
+};
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] disk mountpoint [FUSE options]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  // take our own arguments off the command line and leave the rest
+  // (starting with the program name) to FUSE
+  int flags = FS_SHARED;
+  int skip = 1;
+  if(argc > 1 && !strcmp(argv[1], "-r")) { flags = FS_RDONLY; skip++; }
+  if(argc < skip+2) usage(argv[0]);
+  char *diskfile = argv[skip];
+  argv[skip] = argv[0];
+  struct fuse_args args = FUSE_ARGS_INIT(argc-skip, argv+skip);
+  if(flags == FS_RDONLY) fuse_opt_add_arg(&args, "-oro");
+
+  struct fuse_cmdline_opts opts;
+  if(fuse_parse_cmdline(&args, &opts) != 0) return 1;
+  if(opts.show_help || !opts.mountpoint) usage(argv[0]);
+
+  if(FS_Mount(diskfile, flags) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  int ret = 1;
+  struct fuse_session* se = fuse_session_new(&args, &libfs_ops, sizeof(libfs_ops), NULL);
+  if(se) {
+    if(fuse_set_signal_handlers(se) == 0) {
+      if(fuse_session_mount(se, opts.mountpoint) == 0) {
+	fuse_daemonize(opts.foreground);
+	if(opts.singlethread) ret = fuse_session_loop(se);
+	else {
+	  struct fuse_loop_config config;
+	  config.clone_fd = opts.clone_fd;
+	  config.max_idle_threads = opts.max_idle_threads;
+	  ret = fuse_session_loop_mt(se, &config);
+	}
+	fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+  }
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", diskfile);
+    return -1;
+  }
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+//
+// hotinode-test.c
+//
+// Changes files and directories of a file system formatted with
+// FS_HOTINODES in every way that changes their size or type, and
+// checks each time that what the stat-like calls read from the table
+// of hot inodes (Inode_Stat(), Dir_Size()) is what the inodes say,
+// also after a remount, an import, and changes made by another process
+// sharing the image.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define FILES 20
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// check that inode 'inode' is of type 'type' and size 'size', both
+// as Inode_Stat() says and as the inode itself says (the data read
+// from a file, the entries of a directory)
+static void check_stat(int inode, int type, int size)
+{
+  static char buf[MAX_FILE_SIZE+1];
+  int t = -1, s = -1;
+  CHECK(Inode_Stat(inode, &t, &s) == 0 && t == type && s == size);
+  if(type == 0) CHECK(Inode_Read(inode, 0, buf, sizeof(buf)) == size);
+  else CHECK(Inode_ReadDir(inode, buf, sizeof(buf)) == size);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], archive[1100], lock[1100];
+  snprintf(archive, sizeof(archive), "%s.arch", disk);
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(lock);
+  if(FS_Mount(disk, FS_HOTINODES) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // files of many sizes, in a directory that grows with them
+  char name[16], buf[MAX_FILE_SIZE];
+  memset(buf, 'x', sizeof(buf));
+  CHECK(Dir_Create("/d") == 0);
+  int dir = Inode_Lookup(0, "d"), inode[FILES];
+  for(int i=0; i<FILES; i++) {
+    sprintf(name, "f%d", i);
+    CHECK((inode[i] = Inode_Create(dir, name, 0)) > 0);
+    check_stat(inode[i], 0, 0);
+    CHECK(Inode_Write(inode[i], 0, buf, i*300) == i*300);
+    check_stat(inode[i], 0, i*300);
+    check_stat(dir, 1, i+1);
+  }
+  CHECK(Dir_Size("/d") == FILES*20);
+
+  // written past the end, and cut short
+  CHECK(Inode_Write(inode[1], 1000, buf, 100) == 100);
+  check_stat(inode[1], 0, 1100);
+  CHECK(Inode_Truncate(inode[2], 10) == 0);
+  check_stat(inode[2], 0, 10);
+
+  // a file's inode taken again by a directory
+  CHECK(Inode_Unlink(dir, "f4", 0) == 0);
+  check_stat(dir, 1, FILES-1);
+  CHECK(Dir_Create("/d/e") == 0);
+  int e = Inode_Lookup(dir, "e");
+  CHECK(e == inode[4]);
+  check_stat(e, 1, 0);
+  CHECK(Dir_Size("/d/e") == 0);
+
+  // kept on disk
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(disk) == 0);
+  check_stat(inode[1], 0, 1100);
+  check_stat(e, 1, 0);
+  check_stat(dir, 1, FILES);
+
+  // an imported file system brings its own table
+  CHECK(FS_Export(archive) == 0);
+  CHECK(Inode_Truncate(inode[5], 0) == 0);
+  check_stat(inode[5], 0, 0);
+  CHECK(FS_Import(archive) == 0);
+  check_stat(inode[5], 0, 1500);
+  CHECK(FS_Sync() == 0);
+  unlink(archive);
+
+  // another process sharing the image changes a file seen here
+  CHECK(FS_Mount(disk, FS_SHARED) == 0);
+  check_stat(inode[6], 0, 1800);
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0) {
+    if(FS_Mount(disk, FS_SHARED) < 0) _exit(1);
+    _exit(Inode_Write(inode[6], 0, buf, 2500) == 2500 ? 0 : 1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  check_stat(inode[6], 0, 2500);
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("hot inodes checked out on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,215 @@
+//
+// log-test.c
+//
+// Mounts a file system with FS_LOGGED, and checks that FS_Sync() adds
+// the changes to the log and leaves the image file alone, that the
+// next mount replays them, that a process killed after a sync leaves
+// exactly what it synced, that a log cut short in the middle of a sync
+// replays up to the sync before, that the log is folded back into the
+// image once it gets big, and that other processes can only mount the
+// image read-only meanwhile.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// write 'size' bytes of 'c' to file 'name', in the root directory,
+// creating it if needed
+static int fill(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE];
+  memset(buf, c, size);
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0) inode = Inode_Create(0, name, 0);
+  return Inode_Write(inode, 0, buf, size);
+}
+
+// whether file 'name', in the root directory, holds 'size' bytes of
+// 'c' and nothing else
+static int holds(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE+1];
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0 || Inode_Read(inode, 0, buf, sizeof(buf)) != size) return 0;
+  for(int i=0; i<size; i++)
+    if(buf[i] != c) return 0;
+  return 1;
+}
+
+// the size of file 'path', -1 if there's none
+static long file_size(char *path)
+{
+  struct stat st;
+  return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+// return true if files 'a' and 'b' have the same content
+static int same_file(char *a, char *b)
+{
+  FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+  int same = fa && fb;
+  while(same) {
+    int ca = fgetc(fa), cb = fgetc(fb);
+    if(ca != cb) same = 0;
+    if(ca == EOF) break;
+  }
+  if(fa) fclose(fa);
+  if(fb) fclose(fb);
+  return same;
+}
+
+// copy the first 'size' bytes of file 'from' to file 'to' (all of it
+// if 'size' is negative); return 0 if successful, -1 otherwise
+static int copy_file(char *from, char *to, long size)
+{
+  int in = open(from, O_RDONLY);
+  int out = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  char buf[65536];
+  int ret = in < 0 || out < 0 ? -1 : 0;
+  while(ret == 0 && size != 0) {
+    long n = read(in, buf, size < 0 || size > sizeof(buf) ? sizeof(buf) : size);
+    if(n <= 0) break;
+    if(write(out, buf, n) != n) ret = -1;
+    if(size > 0) size -= n;
+  }
+  if(in >= 0) close(in);
+  if(out >= 0) close(out);
+  return ret;
+}
+
+// run 'fn' on 'disk' in another process; return what it returns
+static int elsewhere(int (*fn)(char *disk), char *disk)
+{
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0) _exit(fn(disk));
+  int status;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// 0 if a plain mount is turned down and a read-only one isn't
+static int mount_beside(char *disk)
+{
+  return FS_Boot(disk) == 0 || FS_Mount(disk, FS_RDONLY) < 0 || !holds("a", 'a', 1000);
+}
+
+// sync a change, make others, and die
+static int sync_and_die(char *disk)
+{
+  if(FS_Mount(disk, FS_LOGGED) < 0) return 1;
+  fill("b", 'b', 2000);
+  FS_Sync();
+  fill("b", 'x', 2000);
+  fill("c", 'c', 100);
+  raise(SIGKILL);
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], log[1100], copy[1100], cut[1100], cut_log[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  snprintf(copy, sizeof(copy), "%s.copy", disk);
+  snprintf(cut, sizeof(cut), "%s.cut", disk);
+  snprintf(cut_log, sizeof(cut_log), "%s.cut.log", disk);
+  unlink(disk);
+  unlink(log);
+  if(FS_Boot(disk) < 0 || FS_Sync() < 0 || copy_file(disk, copy, -1) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // a sync goes to the log, and the image file stays as it was
+  CHECK(FS_Mount(disk, FS_LOGGED) == 0);
+  CHECK(fill("a", 'a', 1000) == 1000);
+  CHECK(FS_Sync() == 0);
+  CHECK(file_size(log) > 0);
+  CHECK(same_file(disk, copy));
+  CHECK(elsewhere(mount_beside, disk) == 0);
+
+  // replayed by the next mount, logged or not
+  CHECK(FS_Mount(disk, FS_LOGGED) == 0);
+  CHECK(holds("a", 'a', 1000));
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("a", 'a', 1000));
+  CHECK(FS_Check(0) == 0);
+
+  // a crash leaves what was synced, and nothing after it
+  CHECK(FS_Sync() == 0);
+  CHECK(elsewhere(sync_and_die, disk) == -1);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("a", 'a', 1000));
+  CHECK(holds("b", 'b', 2000));
+  CHECK(Inode_Lookup(0, "c") < 0);
+  CHECK(FS_Check(0) == 0);
+  CHECK(FS_Sync() == 0);
+
+  // a log cut short in the changes of a sync replays up to the sync
+  // before (cut in the checkpoint that ends it, the changes are there
+  // without it, which is just as good)
+  CHECK(FS_Mount(disk, FS_LOGGED) == 0);
+  CHECK(fill("d", 'd', 3000) == 3000);
+  CHECK(FS_Sync() == 0);
+  long whole = file_size(log);
+  CHECK(fill("d", 'e', 3000) == 3000);
+  CHECK(FS_Sync() == 0);
+  CHECK(copy_file(disk, cut, -1) == 0);
+  long cuts[] = { whole, whole+100, file_size(log)-10 };
+  for(int i=0; i<3; i++) {
+    CHECK(copy_file(log, cut_log, cuts[i]) == 0);
+    CHECK(FS_Boot(cut) == 0);
+    CHECK(holds("d", 'd', 3000) || (i == 2 && holds("d", 'e', 3000)));
+    CHECK(FS_Check(0) == 0);
+  }
+
+  // a big log is folded into the image
+  CHECK(FS_Mount(disk, FS_LOGGED) == 0);
+  CHECK(holds("d", 'e', 3000));
+  long last = file_size(log);
+  int folded = 0;
+  for(int i=0; i<1000 && !folded; i++) {
+    CHECK(fill("f", 'a'+i%26, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    CHECK(FS_Sync() == 0);
+    folded = file_size(log) < last;
+    last = file_size(log);
+  }
+  CHECK(folded);
+  CHECK(fill("g", 'g', 10) == 10);
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("d", 'e', 3000));
+  CHECK(holds("g", 'g', 10));
+  CHECK(FS_Check(0) == 0);
+
+  unlink(copy);
+  unlink(cut);
+  unlink(cut_log);
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("logged mounts checked out on file '%s'\n", disk);
+  return 0;
+}
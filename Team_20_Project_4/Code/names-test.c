@@ -0,0 +1,90 @@
+//
+// names-test.c
+//
+// Fills a directory with names that differ only in their last
+// character, names that are prefixes of others, and names as long as
+// they get, and checks that each is found as its own entry, and that
+// names close to them but not in the directory aren't found; once with
+// fixed-size directory entries and once with packed ones. 'make test'
+// runs it with each of the LibSimd variants.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+#define NAMES 60 // spread over a few sectors of entries
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the name of entry 'i': 15 characters that differ only at the end,
+// then prefixes of them, then names that differ at the start
+static void name(char *buf, int i)
+{
+  if(i < 20) sprintf(buf, "abcdefghijklm%02d", i);
+  else if(i < 34) sprintf(buf, "%.*s", i-19, "abcdefghijklmno");
+  else sprintf(buf, "%cbcdefghijklmno", 'A'+i-34);
+}
+
+static void test(char *disk, int flags)
+{
+  unlink(disk);
+  if(FS_Mount(disk, flags) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    exit(1);
+  }
+  CHECK(Dir_Create("/d") == 0);
+  int dir = Inode_Lookup(0, "d"), inode[NAMES];
+  char buf[64];
+  for(int i=0; i<NAMES; i++) {
+    name(buf, i);
+    CHECK((inode[i] = Inode_Create(dir, buf, 0)) > 0);
+  }
+  for(int i=0; i<NAMES; i++) {
+    name(buf, i);
+    CHECK(Inode_Lookup(dir, buf) == inode[i]);
+  }
+
+  // close to the names, but not in the directory
+  char *missing[] = { "abcdefghijklm20", "abcdefghijklm0", "abcdefghijklmno",
+		      "abcdefghijklmnp", "b", "Bbcdefghijklmnp", "abcdefghijklm1" };
+  for(int i=0; i<sizeof(missing)/sizeof(missing[0]); i++)
+    CHECK(Inode_Lookup(dir, missing[i]) < 0);
+
+  // every other one removed, the rest are still found
+  for(int i=0; i<NAMES; i+=2) {
+    name(buf, i);
+    CHECK(Inode_Unlink(dir, buf, 0) == 0);
+  }
+  for(int i=0; i<NAMES; i++) {
+    name(buf, i);
+    CHECK(Inode_Lookup(dir, buf) == (i%2 ? inode[i] : -1));
+  }
+  CHECK(FS_Check(0) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  test(argv[1], 0);
+  test(argv[1], FS_VARDIRENTS);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("names matched on file '%s'\n", argv[1]);
+  return 0;
+}
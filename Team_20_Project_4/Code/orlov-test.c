@@ -0,0 +1,128 @@
+//
+// orlov-test.c
+//
+// Builds a few top-level directories with subtrees under them, by
+// turns, with FS_ALLOC_ORLOV, and checks that the top-level
+// directories are spread out over the inodes, that each subtree's
+// inodes sit right after its top-level directory and its data in a
+// region of the disk of its own, and that all of it lasts a remount.
+// (crash-test runs half its crashes with FS_ALLOC_ORLOV as well.)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define TREES 4
+#define FILES 4 // in each subdirectory of a tree, which has two
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the first and last sectors holding the data of tree 't' (the image
+// is used in place, so the data can be located in it), and the
+// highest inode in it
+static void extent(int t, int *first, int *last, int *highest)
+{
+  char path[64];
+  *first = TOTAL_SECTORS;
+  *last = *highest = -1;
+  sprintf(path, "d%d", t);
+  int top = Inode_Lookup(0, path);
+  for(int s=0; s<2; s++) {
+    sprintf(path, "s%d", s);
+    int sub = Inode_Lookup(top, path);
+    if(sub > *highest) *highest = sub;
+    for(int f=0; f<FILES; f++) {
+      sprintf(path, "f%d", f);
+      int inode = Inode_Lookup(sub, path), fd;
+      long pos;
+      CHECK(Inode_Locate(inode, 0, SECTOR_SIZE, &fd, &pos) > 0);
+      if(pos/SECTOR_SIZE < *first) *first = pos/SECTOR_SIZE;
+      if(pos/SECTOR_SIZE > *last) *last = pos/SECTOR_SIZE;
+      if(inode > *highest) *highest = inode;
+    }
+  }
+}
+
+static void check_trees()
+{
+  int top[TREES], first[TREES], last[TREES], highest[TREES];
+  char path[64];
+  for(int t=0; t<TREES; t++) {
+    sprintf(path, "d%d", t);
+    top[t] = Inode_Lookup(0, path);
+    extent(t, &first[t], &last[t], &highest[t]);
+    CHECK(top[t] > 0 && highest[t] > top[t] && highest[t] <= top[t]+2*(FILES+1));
+  }
+  for(int t=0; t<TREES; t++)
+    for(int u=0; u<TREES; u++)
+      if(t != u) {
+	CHECK(top[t] > highest[u] || top[u] > highest[t]);
+	CHECK(first[t] > last[u] || first[u] > last[t]);
+      }
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], lock[1100];
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(lock);
+  if(FS_Mount(disk, FS_SHARED) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+  CHECK(FS_AllocPolicy(FS_ALLOC_ORLOV) == FS_ALLOC_FIRST);
+
+  // the trees grow by turns
+  char path[64], buf[SECTOR_SIZE];
+  for(int t=0; t<TREES; t++) {
+    sprintf(path, "/d%d", t);
+    CHECK(Dir_Create(path) == 0);
+  }
+  for(int s=0; s<2; s++)
+    for(int t=0; t<TREES; t++) {
+      sprintf(path, "/d%d/s%d", t, s);
+      CHECK(Dir_Create(path) == 0);
+    }
+  for(int f=0; f<FILES; f++)
+    for(int s=0; s<2; s++)
+      for(int t=0; t<TREES; t++) {
+	sprintf(path, "/d%d/s%d/f%d", t, s, f);
+	CHECK(File_Create(path) == 0);
+	memset(buf, 'a'+t, sizeof(buf));
+	int fd = File_Open(path);
+	CHECK(fd >= 0 && File_Write(fd, buf, sizeof(buf)) == sizeof(buf));
+	File_Close(fd);
+      }
+  check_trees();
+  CHECK(FS_Check(0) == 0);
+
+  // the same after a remount
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Mount(disk, FS_SHARED) == 0);
+  check_trees();
+  CHECK(FS_Check(0) == 0);
+  FS_AllocPolicy(FS_ALLOC_FIRST);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("top-level directories spread out on file '%s'\n", disk);
+  return 0;
+}
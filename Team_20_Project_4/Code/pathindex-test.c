@@ -0,0 +1,113 @@
+//
+// pathindex-test.c
+//
+// Fills a file system formatted with FS_PATHINDEX with files of the
+// same name in many directories, and checks that each path leads to
+// its own file, that they all come and go as they should, and that the
+// index still works after a remount. 'make test' also runs it on a
+// build of LibFS whose path hashes are cut to 3 bits, so that most of
+// the paths collide in the index.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+#define DIRS 4    // top-level directories
+#define SUBDIRS 4 // in each of them
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the inode of 'path', looked up one directory at a time with
+// Inode_Lookup(), which the path index has no part in
+static int walk(char *path)
+{
+  char copy[256];
+  strcpy(copy, path);
+  int inode = 0;
+  for(char *name = strtok(copy, "/"); name && inode >= 0; name = strtok(NULL, "/"))
+    inode = Inode_Lookup(inode, name);
+  return inode;
+}
+
+// each subdirectory /dI/sJ holds a file 'x', and as many other files
+// as its number (so its size tells it apart)
+static void check_tree(int with_x)
+{
+  char path[64];
+  for(int i=0; i<DIRS; i++)
+    for(int j=0; j<SUBDIRS; j++) {
+      int n = i*SUBDIRS+j;
+      sprintf(path, "/d%d/s%d", i, j);
+      CHECK(Dir_Size(path) == (n%4+with_x)*20);
+      sprintf(path, "/d%d/s%d/x", i, j);
+      int fd = File_Open(path);
+      CHECK(with_x ? fd >= 0 : fd < 0);
+      if(fd >= 0) File_Close(fd);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  unlink(argv[1]);
+  if(FS_Mount(argv[1], FS_PATHINDEX) < 0) {
+    printf("ERROR: can't format '%s'\n", argv[1]);
+    return -1;
+  }
+
+  char path[64];
+  for(int i=0; i<DIRS; i++) {
+    sprintf(path, "/d%d", i);
+    CHECK(Dir_Create(path) == 0);
+    for(int j=0; j<SUBDIRS; j++) {
+      sprintf(path, "/d%d/s%d", i, j);
+      CHECK(Dir_Create(path) == 0);
+      sprintf(path, "/d%d/s%d/x", i, j);
+      CHECK(File_Create(path) == 0);
+      CHECK(File_Create(path) < 0 && osErrno == E_CREATE);
+      for(int k=0; k<(i*SUBDIRS+j)%4; k++) {
+	sprintf(path, "/d%d/s%d/f%d", i, j, k);
+	CHECK(File_Create(path) == 0);
+      }
+    }
+  }
+  check_tree(1);
+
+  // the index is kept in the image
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(argv[1]) == 0);
+  check_tree(1);
+
+  // every 'x' is its own file: removing one leaves the others
+  for(int i=0; i<DIRS; i++)
+    for(int j=0; j<SUBDIRS; j++) {
+      sprintf(path, "/d%d/s%d/x", i, j);
+      int inode = walk(path);
+      CHECK(inode > 0);
+      CHECK(File_Unlink(path) == 0);
+      CHECK(walk(path) < 0);
+      CHECK(File_Unlink(path) < 0 && osErrno == E_NO_SUCH_FILE);
+    }
+  check_tree(0);
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("path index checked out on file '%s'\n", argv[1]);
+  return 0;
+}
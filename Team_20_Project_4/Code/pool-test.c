@@ -0,0 +1,103 @@
+//
+// pool-test.c
+//
+// Runs FS_Check() and FS_Export(), which spread their work over a pool
+// of threads, while another thread keeps changing the size of the pool
+// with FS_Threads(), and checks that the results are what they are on
+// the caller's thread alone: no problems found, and the same archive.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+#define ROUNDS 50
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// return true if files 'a' and 'b' have the same content
+static int same_file(char *a, char *b)
+{
+  FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+  int same = fa && fb;
+  while(same) {
+    int ca = fgetc(fa), cb = fgetc(fb);
+    if(ca != cb) same = 0;
+    if(ca == EOF) break;
+  }
+  if(fa) fclose(fa);
+  if(fb) fclose(fb);
+  return same;
+}
+
+static volatile int done;
+
+static void *resize(void *arg)
+{
+  for(int n=0; !done; n++) FS_Threads(n%5);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], serial[1100], parallel[1100];
+  snprintf(serial, sizeof(serial), "%s.serial", disk);
+  snprintf(parallel, sizeof(parallel), "%s.parallel", disk);
+  unlink(disk);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // enough files for the archive to have many chunks
+  char path[64], buf[3000];
+  for(int i=0; i<50; i++) {
+    sprintf(path, "/f%d", i);
+    CHECK(File_Create(path) == 0);
+    for(int k=0; k<sizeof(buf); k++) buf[k] = 'a'+(i*k)%26;
+    CHECK(Inode_Write(Inode_Lookup(0, path+1), 0, buf, sizeof(buf)) == sizeof(buf));
+  }
+
+  FS_Threads(1);
+  CHECK(FS_Export(serial) == 0);
+
+  pthread_t t;
+  CHECK(pthread_create(&t, NULL, resize, NULL) == 0);
+  for(int i=0; i<ROUNDS; i++) {
+    CHECK(FS_Check(0) == 0);
+    CHECK(FS_Export(parallel) == 0);
+    CHECK(same_file(serial, parallel));
+  }
+  done = 1;
+  pthread_join(t, NULL);
+
+  // and the archive holds the files
+  CHECK(FS_Boot(parallel) == 0);
+  CHECK(Dir_Size("/") == 50*20);
+  CHECK(Inode_Read(Inode_Lookup(0, "f49"), 0, buf, sizeof(buf)) == sizeof(buf));
+  CHECK(buf[1] == 'a'+49%26);
+  CHECK(FS_Check(0) == 0);
+  unlink(serial);
+  unlink(parallel);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("the thread pool held up on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,139 @@
+//
+// readonly-test.c
+//
+// Mounts a file system with FS_RDONLY, and checks that it can't be
+// changed, that its files can be read in place in the image file, that
+// changes made meanwhile by a process with FS_SHARED show up without a
+// remount, and that a read-only mount next to one with FS_LOGGED sees
+// what's in the log, while other mounts are turned down.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// write 'size' bytes of 'c' to file 'name', in the root directory,
+// creating it if needed
+static int fill(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE];
+  memset(buf, c, size);
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0) inode = Inode_Create(0, name, 0);
+  return Inode_Write(inode, 0, buf, size);
+}
+
+// whether file 'name', in the root directory, holds 'size' bytes of
+// 'c' and nothing else
+static int holds(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE+1];
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0 || Inode_Read(inode, 0, buf, sizeof(buf)) != size) return 0;
+  for(int i=0; i<size; i++)
+    if(buf[i] != c) return 0;
+  return 1;
+}
+
+// run 'fn' on 'disk' in another process; return what it returns
+static int elsewhere(int (*fn)(char *disk), char *disk)
+{
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0) _exit(fn(disk));
+  int status;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int write_shared(char *disk)
+{
+  if(FS_Mount(disk, FS_SHARED) < 0) return 1;
+  return fill("f", 'b', 1000) != 1000 || fill("g", 'g', 100) != 100;
+}
+
+// 0 if a shared mount is turned down
+static int refuse_shared(char *disk)
+{
+  return FS_Mount(disk, FS_SHARED) == 0;
+}
+
+static int read_logged(char *disk)
+{
+  if(FS_Mount(disk, FS_RDONLY) < 0) return 1;
+  return !holds("f", 'c', 1000) || FS_Check(0) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], log[1100], lock[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(log);
+  unlink(lock);
+  if(FS_Boot(disk) < 0 || fill("f", 'a', 1000) != 1000 || FS_Sync() < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // nothing changes through a read-only mount
+  CHECK(FS_Mount(disk, FS_RDONLY) == 0);
+  CHECK(holds("f", 'a', 1000));
+  CHECK(File_Create("/new") < 0 && osErrno == E_READ_ONLY);
+  CHECK(Dir_Create("/new") < 0 && osErrno == E_READ_ONLY);
+  CHECK(File_Unlink("/f") < 0 && osErrno == E_READ_ONLY);
+  CHECK(Inode_Write(Inode_Lookup(0, "f"), 0, "x", 1) < 0 && osErrno == E_READ_ONLY);
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Check(0) == 0);
+
+  // the data is read straight from the image file
+  int fd;
+  long pos;
+  char buf[SECTOR_SIZE];
+  int n = Inode_Locate(Inode_Lookup(0, "f"), 0, 1000, &fd, &pos);
+  CHECK(n > 0 && n <= 1000);
+  CHECK(pread(fd, buf, n, pos) == n && buf[0] == 'a' && buf[n-1] == 'a');
+
+  // a shared mount's changes are seen right away
+  CHECK(elsewhere(write_shared, disk) == 0);
+  CHECK(holds("f", 'b', 1000));
+  CHECK(holds("g", 'g', 100));
+
+  // next to a logged mount, what's in its log is seen, and the image
+  // can't be mounted shared
+  CHECK(FS_Mount(disk, FS_LOGGED) == 0);
+  CHECK(holds("f", 'b', 1000));
+  CHECK(fill("f", 'c', 1000) == 1000);
+  CHECK(FS_Sync() == 0);
+  CHECK(elsewhere(read_logged, disk) == 0);
+  CHECK(elsewhere(refuse_shared, disk) == 0);
+
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("f", 'c', 1000));
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("read-only mounts checked out on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,97 @@
+//
+// shared-test.c
+//
+// Mounts a file system with FS_SHARED in two processes at once, and
+// checks that neither can unlink a file the other has open, that it
+// can once the file is closed, and that the open files of a process
+// that died are forgotten by the next process to mount it alone.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// mount 'disk' shared in a new process and unlink file 'path' there;
+// return 0 if the unlink succeeded, the error otherwise
+static int unlink_elsewhere(char *disk, char *path)
+{
+  pid_t child = fork();
+  if(child == 0) {
+    if(FS_Mount(disk, FS_SHARED) < 0) _exit(100);
+    _exit(File_Unlink(path) == 0 ? 0 : 1+osErrno);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 100;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], lock[1100];
+  snprintf(lock, sizeof(lock), "%s.lock", disk);
+  unlink(disk);
+  unlink(lock);
+  if(FS_Mount(disk, FS_SHARED) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+  CHECK(File_Create("/f") == 0);
+  CHECK(File_Create("/g") == 0);
+
+  // a file open here can't be unlinked by another process
+  int fd = File_Open("/f");
+  CHECK(fd >= 0);
+  CHECK(unlink_elsewhere(disk, "/f") == 1+E_FILE_IN_USE);
+  CHECK(File_Close(fd) == 0);
+  CHECK(unlink_elsewhere(disk, "/f") == 0);
+  CHECK(File_Open("/f") < 0 && osErrno == E_NO_SUCH_FILE);
+
+  // nor can a file open in another process be unlinked here
+  int ready[2];
+  char c;
+  CHECK(pipe(ready) == 0);
+  pid_t child = fork();
+  if(child == 0) {
+    if(FS_Mount(disk, FS_SHARED) < 0) _exit(1);
+    fd = File_Open("/g");
+    if(write(ready[1], fd >= 0 ? "y" : "n", 1) != 1) _exit(1);
+    pause();
+  }
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  CHECK(File_Unlink("/g") < 0 && osErrno == E_FILE_IN_USE);
+
+  // and when that process dies with the file open, the file stays in
+  // use until every process has let go of the file system
+  kill(child, SIGKILL);
+  waitpid(child, NULL, 0);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(unlink_elsewhere(disk, "/g") == 0);
+
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(Dir_Size("/") == 0);
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("shared mounts kept open files on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,142 @@
+//
+// simd-bench.c
+//
+// Checks the LibSimd kernels against plain C and times them on one
+// sector against a plain baseline (memcmp for the zero test, and bit
+// loops for the bitmap count and scan). The kernel variant is the one picked at
+// load time; 'make bench' runs it once for each variant the CPU has
+// (see LIBSIMD in LibSimd.c).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibDisk.h"
+#include "LibSimd.h"
+
+#define ROUNDS 2000000 // timed calls per kernel
+#define CHECKS 100000  // random cases checked per kernel
+
+// a sector, aligned the way the disk and scratch buffers are
+typedef struct {
+  char data[SECTOR_SIZE];
+} __attribute__((aligned(64))) sector_t;
+
+static sector_t src, dst, zero;
+
+// the glibc functions, called through pointers so that the compiler
+// can't put its own inline code in their place
+static int (*volatile libc_memcmp)(const void*, const void*, size_t) = memcmp;
+
+// keeps the compiler from dropping the calls whose result isn't used
+#define USE(p) __asm__ volatile("" :: "r"(p) : "memory")
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+// the number of unused bits in a bitmap, one bit at a time
+static int count_zero_bits(const unsigned char* p, int nbits)
+{
+  int n = 0;
+  for(int i=0; i<nbits; i++)
+    if(!(p[i/8] & (0x80 >> (i%8)))) n++;
+  return n;
+}
+
+// the first zero bit of a bitmap, one bit at a time
+static int first_zero_bit(const unsigned char* p, int nbits)
+{
+  for(int i=0; i<nbits; i++)
+    if(!(p[i/8] & (0x80 >> (i%8)))) return i;
+  return -1;
+}
+
+// the kernels give what plain C does, for any length and alignment
+static int check()
+{
+  static unsigned char a[SECTOR_SIZE+64], b[SECTOR_SIZE+64];
+  srand(1);
+  for(int i=0; i<CHECKS; i++) {
+    int off = rand()%64, n = rand()%(SECTOR_SIZE+1), nbits = rand()%(n*8+1);
+    unsigned char* p = a+off;
+
+    memset(a, 0xff, sizeof(a));
+    if(rand()%2) p[rand()%(n+1)] = rand();
+    if(Simd_FirstZeroBit(p, nbits) != first_zero_bit(p, nbits)) {
+      printf("FAILED: Simd_FirstZeroBit, %d bits at offset %d\n", nbits, off);
+      return -1;
+    }
+    int count = 0;
+    for(int k=0; k<n; k++) count += __builtin_popcount(p[k]);
+    if(Simd_Popcount(p, n) != count) {
+      printf("FAILED: Simd_Popcount, %d bytes at offset %d\n", n, off);
+      return -1;
+    }
+
+    memset(b, 0, sizeof(b));
+    if(n > 0 && rand()%2) b[off+rand()%n] = 1;
+    int is_zero = 1;
+    for(int k=0; k<n; k++) if(b[off+k]) is_zero = 0;
+    if(Simd_IsZero(b+off, n) != is_zero) {
+      printf("FAILED: Simd_IsZero, %d bytes at offset %d\n", n, off);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// print the time per call of a kernel and of its baseline, in ns
+static void report(char* what, double t, char* base, double t_base)
+{
+  printf("  %-18s %7.1f ns   %-18s %7.1f ns   x%.2f\n",
+	 what, t*1e9/ROUNDS, base, t_base*1e9/ROUNDS, t_base/t);
+}
+
+int main(int argc, char *argv[])
+{
+  printf("LibSimd variant '%s', %d-byte sectors\n", Simd_Variant(), SECTOR_SIZE);
+  if(check() < 0) return -1;
+  printf("  kernels check out against plain C\n");
+
+  volatile int r = 0;
+  double t, t_base;
+
+  t = now();
+  for(int i=0; i<ROUNDS; i++) { r += Simd_IsZero(dst.data, SECTOR_SIZE); USE(dst.data); }
+  t = now()-t;
+  t_base = now();
+  for(int i=0; i<ROUNDS; i++) { r += !libc_memcmp(dst.data, zero.data, SECTOR_SIZE); USE(dst.data); }
+  t_base = now()-t_base;
+  report("Simd_IsZero", t, "memcmp", t_base);
+
+  t = now();
+  for(int i=0; i<ROUNDS; i++) { r += SECTOR_SIZE*8-Simd_Popcount(src.data, SECTOR_SIZE); USE(src.data); }
+  t = now()-t;
+  t_base = now();
+  for(int i=0; i<ROUNDS/100; i++) {
+    r += count_zero_bits((unsigned char*)src.data, SECTOR_SIZE*8);
+    USE(src.data);
+  }
+  t_base = (now()-t_base)*100;
+  report("Simd_Popcount", t, "bit loop", t_base);
+
+  // a full bitmap sector but for its last bit, the worst case of a scan
+  memset(src.data, 0xff, SECTOR_SIZE);
+  src.data[SECTOR_SIZE-1] = 0xfe;
+  t = now();
+  for(int i=0; i<ROUNDS; i++) { r += Simd_FirstZeroBit(src.data, SECTOR_SIZE*8); USE(src.data); }
+  t = now()-t;
+  t_base = now();
+  for(int i=0; i<ROUNDS/100; i++) {
+    r += first_zero_bit((unsigned char*)src.data, SECTOR_SIZE*8);
+    USE(src.data);
+  }
+  t_base = (now()-t_base)*100;
+  report("Simd_FirstZeroBit", t, "bit loop", t_base);
+  return 0;
+}
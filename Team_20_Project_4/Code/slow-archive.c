@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] archive_unix_file\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *fname;
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; fname = argv[2]; }
+  else { diskfile = "default-disk"; fname = argv[1]; }
+
+  if(FS_Mount(diskfile, FS_RDONLY) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  
+  if(FS_Export(fname) < 0) {
+    printf("ERROR: can't export disk '%s' to archive '%s'\n", diskfile, fname);
+    return -2;
+  }
+  printf("disk '%s' exported to archive '%s'\n", diskfile, fname);
+  return 0;
+}
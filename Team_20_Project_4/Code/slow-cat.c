@@ -18,7 +18,7 @@ int main(int argc, char *argv[])
   if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
   else { diskfile = "default-disk"; path = argv[1]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_Mount(diskfile, FS_RDONLY) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
@@ -42,9 +42,5 @@ int main(int argc, char *argv[])
   
   File_Close(fd);
   
-  if(FS_Sync() < 0) {
-    printf("ERROR: can't sync disk '%s'\n", diskfile);
-    return -3;
-  }
   return 0;
 }
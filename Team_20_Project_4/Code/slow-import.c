@@ -18,7 +18,7 @@ int main(int argc, char *argv[])
   if(argc == 4) { diskfile = argv[1]; path = argv[2]; fname = argv[3]; }
   else { diskfile = "default-disk"; path = argv[1]; fname = argv[2]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_Mount(diskfile, FS_SHARED) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
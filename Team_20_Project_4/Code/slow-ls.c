@@ -16,37 +16,27 @@ int main(int argc, char *argv[])
   if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
   else { diskfile = "default-disk"; path = argv[1]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_Mount(diskfile, FS_RDONLY) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
-  int sz = Dir_Size(path);
-  if(sz < 0) {
+  // the entries are looked at where they are, not copied out
+  static Dir_View_t view;
+  int entries = Dir_ReadView(path, &view);
+  if(entries < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -2;
-  } else if (sz == 0) {
+  } else if (entries == 0) {
     printf("directory '%s': empty\n", path);
     return 0;
   }
   
-  char* buf = malloc(sz);
-  int entries = Dir_Read(path, buf, sz);
-  if(entries < 0) {
-    printf("ERROR: can't list '%s'\n", path);
-    return -3;
-  }
-  
   printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
-  int idx = 0;
   for(int i=0; i<entries; i++) {
-    printf("%-4d %-15s\t%-d\n", i, &buf[idx], *(int*)&buf[idx+16]);
-    idx += 20;
+    Dir_Entry_t* e = &view.entry[i];
+    printf("%-4d %-15.*s\t%-d\n", i, e->len, e->name, e->inode);
   }
-  free(buf);
+  Dir_ReleaseView(&view);
 
-  if(FS_Sync() < 0) {
-    printf("ERROR: can't sync disk '%s'\n", diskfile);
-    return -3;
-  }
   return 0;
 }
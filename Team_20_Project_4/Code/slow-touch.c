@@ -16,7 +16,7 @@ int main(int argc, char *argv[])
   if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
   else { diskfile = "default-disk"; path = argv[1]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_Mount(diskfile, FS_SHARED) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
@@ -0,0 +1,94 @@
+//
+// sparse-test.c
+//
+// Saves a file system whose sectors are mostly zeroes, and checks that
+// the image file is full-sized but sparse (the runs of zero sectors are
+// holes), and that what was saved, zero sectors between others and
+// sectors zeroed since the last save included, reads back the same.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// return true if file 'name', in the root directory, holds what's in
+// 'buf' ('size' bytes) and nothing else
+static int holds(char *name, char *buf, int size)
+{
+  char got[MAX_FILE_SIZE+1];
+  int inode = Inode_Lookup(0, name);
+  return inode >= 0 && Inode_Read(inode, 0, got, sizeof(got)) == size &&
+    memcmp(got, buf, size) == 0;
+}
+
+// the bytes of the image file that are stored on disk (not holes)
+static long stored(char *disk)
+{
+  struct stat st;
+  if(stat(disk, &st) < 0) return -1;
+  CHECK(st.st_size == (long)TOTAL_SECTORS*SECTOR_SIZE);
+  return (long)st.st_blocks*512;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], log[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  unlink(disk);
+  unlink(log);
+  if(FS_Boot(disk) < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // a new file system is mostly holes
+  long empty = stored(disk);
+  CHECK(empty >= 0 && empty < (long)TOTAL_SECTORS*SECTOR_SIZE/4);
+
+  // a file with zero sectors between others: 'a', then zeroes, then 'b'
+  char sparse[4*SECTOR_SIZE], dense[3*SECTOR_SIZE], zeroes[3*SECTOR_SIZE];
+  memset(sparse, 0, sizeof(sparse));
+  memset(sparse, 'a', SECTOR_SIZE);
+  memset(sparse+3*SECTOR_SIZE, 'b', SECTOR_SIZE);
+  memset(dense, 'c', sizeof(dense));
+  memset(zeroes, 0, sizeof(zeroes));
+  CHECK(Inode_Write(Inode_Create(0, "s", 0), 0, sparse, sizeof(sparse)) == sizeof(sparse));
+  CHECK(Inode_Write(Inode_Create(0, "d", 0), 0, dense, sizeof(dense)) == sizeof(dense));
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("s", sparse, sizeof(sparse)));
+  CHECK(holds("d", dense, sizeof(dense)));
+  CHECK(stored(disk) < (long)TOTAL_SECTORS*SECTOR_SIZE/4);
+
+  // sectors that held data and are zeroes now
+  CHECK(Inode_Write(Inode_Lookup(0, "d"), 0, zeroes, sizeof(zeroes)) == sizeof(zeroes));
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(holds("s", sparse, sizeof(sparse)));
+  CHECK(holds("d", zeroes, sizeof(zeroes)));
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("sparse image saved and loaded on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,119 @@
+//
+// sync-test.c
+//
+// Makes a file durable with File_Sync() and File_DataSync() while
+// other files are being changed, then kills the process before
+// anything else is saved, and checks that the file is all there after
+// the next mount, and that the file system passes FS_Check(); once
+// on a plain mount and once on one with FS_LOGGED.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// write 'size' bytes of 'c' at the start of file 'name', in the root
+// directory, and open it; return the file descriptor
+static int fill(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE], path[64];
+  memset(buf, c, size);
+  Inode_Write(Inode_Lookup(0, name), 0, buf, size);
+  snprintf(path, sizeof(path), "/%s", name);
+  return File_Open(path);
+}
+
+// whether file 'name', in the root directory, holds 'size' bytes of
+// 'c' and nothing else
+static int holds(char *name, char c, int size)
+{
+  char buf[MAX_FILE_SIZE+1];
+  int inode = Inode_Lookup(0, name);
+  if(inode < 0 || Inode_Read(inode, 0, buf, sizeof(buf)) != size) return 0;
+  for(int i=0; i<size; i++)
+    if(buf[i] != c) return 0;
+  return 1;
+}
+
+// sync files in the middle of other changes, then die
+static void sync_and_die(char *disk, int flags)
+{
+  if(FS_Mount(disk, flags) < 0) exit(1);
+  Dir_Create("/d");
+  FS_Sync();
+
+  // a whole sync, with a file created in another directory not synced
+  File_Create("/d/other");
+  File_Create("/f");
+  File_Sync(fill("f", 'a', 1000));
+
+  // the data alone, when the size stays the same
+  File_Create("/d/another");
+  File_DataSync(fill("f", 'b', 1000));
+
+  // the data of a file cut short and grown back to the same size sits
+  // in other sectors (its old ones are taken by another file), which
+  // the inode must be synced to point at
+  char buf[2000];
+  memset(buf, 'e', sizeof(buf));
+  File_Create("/g");
+  File_Sync(fill("g", 'c', 2000));
+  Inode_Truncate(Inode_Lookup(0, "g"), 0);
+  File_Create("/h");
+  Inode_Write(Inode_Lookup(0, "h"), 0, buf, sizeof(buf));
+  File_DataSync(fill("g", 'd', 2000));
+
+  // and nothing else is saved
+  raise(SIGKILL);
+}
+
+static void test(char *disk, int flags)
+{
+  char log[1100];
+  snprintf(log, sizeof(log), "%s.log", disk);
+  unlink(disk);
+  unlink(log);
+  if(FS_Boot(disk) < 0 || FS_Sync() < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    exit(1);
+  }
+  pid_t child = fork();
+  if(child == 0) sync_and_die(disk, flags);
+  waitpid(child, NULL, 0);
+
+  CHECK(FS_Boot(disk) == 0);
+  CHECK(FS_Check(0) == 0);
+  CHECK(holds("f", 'b', 1000));
+  CHECK(holds("g", 'd', 2000));
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  test(argv[1], 0);
+  test(argv[1], FS_LOGGED);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("synced files survived the crashes on file '%s'\n", argv[1]);
+  return 0;
+}
@@ -0,0 +1,126 @@
+//
+// vardirent-test.c
+//
+// Fills directories of a file system formatted with FS_VARDIRENTS with
+// names of every length up to the longest allowed, and checks that
+// they're all found again after a remount, and after others around
+// them are removed, that Dir_Read() gives the entries while the names
+// fit its fixed-size ones and fails after that, that Dir_ReadView()
+// gives them all, and that a name too long is turned down.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+#define NAMES 63 // names of 1 to 63 characters
+#define DIRENT_SIZE 20 // what Dir_Read() gives for each entry
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// the name of 'len' characters in the directories
+static void name(char *buf, int len)
+{
+  for(int i=0; i<len; i++) buf[i] = 'a'+(len+i)%26;
+  buf[len] = '\0';
+}
+
+// check that directory /l holds the names whose length is set in
+// 'lens' (one bit per length), as files with the given inodes
+static void check_dir(unsigned long long lens, int *inode)
+{
+  static Dir_View_t view;
+  char buf[64];
+  int dir = Inode_Lookup(0, "l"), count = 0;
+  for(int len=1; len<=NAMES; len++) {
+    name(buf, len);
+    int want = (lens >> len)&1 ? inode[len] : -1;
+    CHECK(Inode_Lookup(dir, buf) == want);
+    if(want >= 0) count++;
+  }
+  CHECK(Dir_Size("/l") == count*DIRENT_SIZE);
+
+  CHECK(Dir_ReadView("/l", &view) == count);
+  for(int i=0; i<view.count; i++) {
+    Dir_Entry_t *e = &view.entry[i];
+    name(buf, e->len);
+    CHECK(e->len >= 1 && e->len <= NAMES && ((lens >> e->len)&1));
+    CHECK(memcmp(e->name, buf, e->len) == 0 && e->inode == inode[e->len]);
+  }
+  Dir_ReleaseView(&view);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1];
+  unlink(disk);
+  if(FS_Mount(disk, FS_VARDIRENTS) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  // short names are read with Dir_Read() as ever
+  char buf[128], entries[NAMES*DIRENT_SIZE];
+  CHECK(Dir_Create("/s") == 0);
+  CHECK(File_Create("/s/fifteen_chars__") == 0);
+  CHECK(File_Create("/s/x") == 0);
+  CHECK(Dir_Read("/s", entries, sizeof(entries)) == 2);
+  CHECK(strncmp(entries, "fifteen_chars__", 16) == 0 && strcmp(entries+DIRENT_SIZE, "x") == 0);
+
+  // names of every length up to the longest
+  int inode[NAMES+1];
+  unsigned long long all = 0;
+  CHECK(Dir_Create("/l") == 0);
+  int dir = Inode_Lookup(0, "l");
+  for(int len=1; len<=NAMES; len++) {
+    name(buf, len);
+    CHECK((inode[len] = Inode_Create(dir, buf, 0)) > 0);
+    all |= 1ULL << len;
+  }
+  check_dir(all, inode);
+  CHECK(Dir_Read("/l", entries, sizeof(entries)) < 0 && osErrno == E_BUFFER_TOO_SMALL);
+
+  // one too long
+  name(buf, NAMES+1);
+  CHECK(Inode_Create(dir, buf, 0) < 0 && osErrno == E_NAME_TOO_LONG);
+  sprintf(entries, "/l/%s", buf);
+  CHECK(File_Create(entries) < 0 && osErrno == E_CREATE);
+
+  // the names stay the same on disk
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Boot(disk) == 0);
+  check_dir(all, inode);
+
+  // every third one removed, and one put back
+  for(int len=1; len<=NAMES; len+=3) {
+    name(buf, len);
+    CHECK(Inode_Unlink(dir, buf, 0) == 0);
+    all &= ~(1ULL << len);
+  }
+  check_dir(all, inode);
+  name(buf, 1);
+  CHECK((inode[1] = Inode_Create(dir, buf, 0)) > 0);
+  all |= 1ULL << 1;
+  check_dir(all, inode);
+  CHECK(FS_Check(0) == 0);
+
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("packed directory entries checked out on file '%s'\n", disk);
+  return 0;
+}
@@ -0,0 +1,128 @@
+//
+// view-test.c
+//
+// Lists a directory spread over a few sectors with Dir_ReadView() and
+// Dir_OpenView(), and checks that the entries are the directory's,
+// that they point into the directory's sectors as they change, that
+// FS_Mount() is turned down until the last view of them is released
+// (and works after), and that views of a mapped image and of an
+// archive work the same way.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define FILES 40 // over the entries of one sector
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { printf("ERROR: line %d: %s\n", __LINE__, #cond); failures++; } \
+  } while(0)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <new_disk_image_file>\n", prog);
+  exit(1);
+}
+
+// whether 'view' has the entries of directory /d, each once
+static int lists_dir(Dir_View_t *view)
+{
+  int seen[FILES] = { 0 };
+  int dir = Inode_Lookup(0, "d");
+  if(view->count != FILES || view->sectors < 2) return 0;
+  for(int i=0; i<view->count; i++) {
+    Dir_Entry_t *e = &view->entry[i];
+    char name[16];
+    int n;
+    if(e->len >= sizeof(name)) return 0;
+    sprintf(name, "%.*s", e->len, e->name);
+    if(sscanf(name, "f%d", &n) != 1 || n < 0 || n >= FILES || seen[n]++) return 0;
+    if(Inode_Lookup(dir, name) != e->inode) return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2) usage(argv[0]);
+  char *disk = argv[1], archive[1100];
+  snprintf(archive, sizeof(archive), "%s.arch", disk);
+  unlink(disk);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't format '%s'\n", disk);
+    return -1;
+  }
+
+  char path[64];
+  CHECK(Dir_Create("/d") == 0);
+  for(int i=0; i<FILES; i++) {
+    sprintf(path, "/d/f%d", i);
+    CHECK(File_Create(path) == 0);
+  }
+  CHECK(FS_Sync() == 0);
+
+  // the entries, pointing into the directory's sectors
+  static Dir_View_t view, again;
+  CHECK(Dir_ReadView("/d", &view) == FILES);
+  CHECK(lists_dir(&view));
+  CHECK(Dir_ReadView("/d/f0", &again) < 0 && osErrno == E_NO_SUCH_DIR);
+  CHECK(Dir_ReadView("/e", &again) < 0 && osErrno == E_NO_SUCH_DIR);
+
+  // not a snapshot: a removed entry is gone from under the view
+  int slot = -1;
+  for(int i=0; i<view.count; i++)
+    if(view.entry[i].len == 2 && strncmp(view.entry[i].name, "f0", 2) == 0) slot = i;
+  CHECK(slot >= 0);
+  CHECK(File_Unlink("/d/f0") == 0);
+  CHECK(slot >= 0 && (view.entry[slot].len != 2 || strncmp(view.entry[slot].name, "f0", 2) != 0));
+  CHECK(File_Create("/d/f0") == 0);
+
+  // no mount until every view is released
+  CHECK(Dir_ReadView("/d", &again) == FILES);
+  CHECK(FS_Mount(disk, 0) < 0 && osErrno == E_GENERAL);
+  Dir_ReleaseView(&view);
+  CHECK(FS_Mount(disk, 0) < 0 && osErrno == E_GENERAL);
+  Dir_ReleaseView(&again);
+  CHECK(FS_Sync() == 0);
+  CHECK(FS_Mount(disk, 0) == 0);
+
+  // views from the pool, a few at once
+  Dir_View_t *views[4];
+  for(int i=0; i<4; i++) {
+    CHECK((views[i] = Dir_OpenView("/d")) != NULL);
+    CHECK(views[i] && lists_dir(views[i]));
+  }
+  CHECK(Dir_OpenView("/e") == NULL && osErrno == E_NO_SUCH_DIR);
+  for(int i=0; i<3; i++)
+    Dir_CloseView(views[i]);
+  CHECK(FS_Mount(disk, 0) < 0);
+  Dir_CloseView(views[3]);
+
+  // the image mapped read-only, and an archive
+  CHECK(FS_Mount(disk, FS_RDONLY) == 0);
+  CHECK(Dir_ReadView("/d", &view) == FILES && lists_dir(&view));
+  CHECK(FS_Mount(disk, 0) < 0);
+  Dir_ReleaseView(&view);
+  CHECK(FS_Mount(disk, 0) == 0);
+  CHECK(FS_Export(archive) == 0);
+  CHECK(FS_Mount(archive, 0) == 0);
+  CHECK(Dir_ReadView("/d", &view) == FILES && lists_dir(&view));
+  CHECK(FS_Mount(disk, 0) < 0);
+  Dir_ReleaseView(&view);
+  CHECK(FS_Mount(disk, 0) == 0);
+  CHECK(FS_Check(0) == 0);
+
+  unlink(archive);
+  if(failures) {
+    printf("%d check(s) failed\n", failures);
+    return -1;
+  }
+  printf("directory views checked out on file '%s'\n", disk);
+  return 0;
+}